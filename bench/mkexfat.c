@@ -0,0 +1,832 @@
+//-----------------------------------------
+// mkexfat
+//
+// Generates synthetic exFAT volume images for benchmarking without
+// depending on mkfs. The generated tree is fully described by the command
+// line so that every run with the same arguments produces the same image.
+// The image can:
+// 1. use any sector / cluster size combination allowed by exFAT
+// 2. contain a directory tree of configurable depth, fan out and name length
+// 3. store files as FAT chains (optionally fragmented) or as contiguous NoFatChain extents
+// 4. be sparse and arbitrarily large (multi-terabyte) without using that much disk
+//
+//-----------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define BYTES_PER_ENTRY 32
+#define UNICODE_CHARS_PER_ENTRY 15
+#define MAX_NAME_LENGTH 255
+#define CLUSTER_INDEX_OFFSET 2
+#define END_OF_CHAIN 0xFFFFFFFFu
+#define MEDIA_DESCRIPTOR 0xFFFFFFF8u
+
+#define BOOT_REGION_SECTORS 12
+#define FAT_ALIGNMENT_SECTORS 128
+
+#define ALLOCATION_BITMAP_ENTRY 0x81
+#define UPCASE_TABLE_ENTRY 0x82
+#define VOLUME_LABEL_ENTRY 0x83
+#define FILE_TYPE_ENTRY 0x85
+#define STREAM_EXTENSION_ENTRY 0xC0
+#define FILE_NAME_ENTRY 0xC1
+#define IN_USE_BIT 0x80
+
+#define ATTR_DIRECTORY 0x10
+#define ATTR_ARCHIVE 0x20
+#define FLAG_ALLOCATION_POSSIBLE 0x01
+#define FLAG_NO_FAT_CHAIN 0x02
+
+#define UPCASE_TABLE_CHARS 128
+#define WRITE_CHUNK (1 << 20)
+
+typedef struct extent
+{
+    uint32_t startCluster;
+    uint32_t count;
+} extent;
+
+typedef struct node
+{
+    char name[MAX_NAME_LENGTH + 1];
+    char path[4096];
+    bool directory;
+    bool noFatChain;
+    uint32_t ordinal;
+    uint64_t dataLength;
+    uint64_t validDataLength;
+    uint32_t clustersNeeded;
+    uint32_t clustersAllocated;
+    extent *extents;
+    int extentCount;
+    int extentCapacity;
+    struct node **children;
+    int childCount;
+} node;
+
+typedef struct options
+{
+    const char *imagePath;
+    const char *referenceDir;
+    const char *label;
+    uint64_t size;
+    uint32_t serial;
+    int sectorShift;
+    int clusterShift;
+    int depth;
+    int dirsPerDir;
+    int filesPerDir;
+    uint64_t fileSize;
+    int bigFiles;
+    uint64_t bigFileSize;
+    int nameLength;
+    uint32_t fragment;
+    bool noFatChain;
+    int validPercent;
+    uint64_t skipClusters;
+    bool deleted;
+} options;
+
+// volume geometry and allocation state
+static uint32_t bytesPerSector;
+static uint32_t sectorsPerCluster;
+static uint64_t bytesPerCluster;
+static uint64_t totalSectors;
+static uint32_t fatOffset;
+static uint32_t fatLength;
+static uint32_t clstHeapOffset;
+static uint32_t clusterCount;
+static uint32_t *fat;
+static uint8_t *bitmap;
+static uint64_t cursor = CLUSTER_INDEX_OFFSET;
+static uint16_t upcase[UPCASE_TABLE_CHARS];
+static uint32_t nextOrdinal;
+static int imageFd;
+static options opts;
+
+static void die(const char *message)
+{
+    fprintf(stderr, "mkexfat: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+//return parsed byte count, accepting K/M/G/T suffixes
+static uint64_t parseSize(const char *text)
+{
+    char *end;
+    uint64_t value = strtoull(text, &end, 0);
+    switch (*end)
+    {
+    case 'T': case 't': value <<= 10; /* fall through */
+    case 'G': case 'g': value <<= 10; /* fall through */
+    case 'M': case 'm': value <<= 10; /* fall through */
+    case 'K': case 'k': value <<= 10; break;
+    case '\0': break;
+    default: die("bad size suffix");
+    }
+    return value;
+}
+
+static uint64_t roundUp(uint64_t value, uint64_t unit)
+{
+    return (value + unit - 1) / unit * unit;
+}
+
+static uint64_t clusterOffset(uint64_t cluster)
+{
+    return ((uint64_t)clstHeapOffset + (cluster - CLUSTER_INDEX_OFFSET) * sectorsPerCluster) * bytesPerSector;
+}
+
+static void pwriteAll(const void *buffer, size_t length, uint64_t offset)
+{
+    const uint8_t *bytes = buffer;
+    while (length > 0)
+    {
+        ssize_t written = pwrite(imageFd, bytes, length, (off_t)offset);
+        if (written <= 0)
+            die(strerror(errno));
+        bytes += written;
+        length -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+}
+
+//writes the buffer but leaves all-zero blocks as holes so huge sparse images stay small
+static void pwriteSparse(const uint8_t *buffer, uint64_t length, uint64_t offset)
+{
+    const uint64_t block = 4096;
+    for (uint64_t done = 0; done < length; done += block)
+    {
+        uint64_t chunk = length - done < block ? length - done : block;
+        bool zero = true;
+        for (uint64_t i = 0; i < chunk && zero; i++)
+            zero = buffer[done + i] == 0;
+        if (!zero)
+            pwriteAll(buffer + done, chunk, offset + done);
+    }
+}
+
+//------------------------------------------------------
+// Allocation
+//------------------------------------------------------
+
+static void addExtent(node *n, uint32_t start, uint32_t count)
+{
+    if (n->extentCount > 0)
+    {
+        extent *last = &n->extents[n->extentCount - 1];
+        if (last->startCluster + last->count == start)
+        {
+            last->count += count;
+            return;
+        }
+    }
+    if (n->extentCount == n->extentCapacity)
+    {
+        n->extentCapacity = n->extentCapacity ? n->extentCapacity * 2 : 4;
+        n->extents = realloc(n->extents, sizeof(extent) * (size_t)n->extentCapacity);
+        if (n->extents == NULL)
+            die("out of memory");
+    }
+    n->extents[n->extentCount].startCluster = start;
+    n->extents[n->extentCount].count = count;
+    n->extentCount++;
+}
+
+static void allocate(node *n, uint32_t count)
+{
+    if (cursor + count > (uint64_t)clusterCount + CLUSTER_INDEX_OFFSET)
+        die("volume too small for requested tree");
+    for (uint32_t i = 0; i < count; i++)
+        bitmap[(cursor + i - CLUSTER_INDEX_OFFSET) / 8] |= (uint8_t)(1 << ((cursor + i - CLUSTER_INDEX_OFFSET) % 8));
+    addExtent(n, (uint32_t)cursor, count);
+    n->clustersAllocated += count;
+    cursor += count;
+}
+
+//link every cluster of the node's extents into the FAT (skipped for NoFatChain nodes)
+static void linkChain(node *n)
+{
+    if (n->noFatChain)
+        return;
+    uint32_t previous = 0;
+    for (int e = 0; e < n->extentCount; e++)
+    {
+        for (uint32_t i = 0; i < n->extents[e].count; i++)
+        {
+            uint32_t cluster = n->extents[e].startCluster + i;
+            if (previous != 0)
+                fat[previous] = cluster;
+            previous = cluster;
+        }
+    }
+    if (previous != 0)
+        fat[previous] = END_OF_CHAIN;
+}
+
+//------------------------------------------------------
+// Checksums
+//------------------------------------------------------
+
+static uint16_t nameHash(const uint16_t *name, int length)
+{
+    uint16_t hash = 0;
+    for (int i = 0; i < length; i++)
+    {
+        uint16_t c = name[i] < UPCASE_TABLE_CHARS ? upcase[name[i]] : name[i];
+        hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xFF));
+        hash = (uint16_t)(((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8));
+    }
+    return hash;
+}
+
+static uint16_t entrySetChecksum(const uint8_t *entries, int count)
+{
+    uint16_t checksum = 0;
+    for (int i = 0; i < count * BYTES_PER_ENTRY; i++)
+    {
+        if (i == 2 || i == 3)
+            continue;
+        checksum = (uint16_t)(((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + entries[i]);
+    }
+    return checksum;
+}
+
+static uint32_t bootChecksum(const uint8_t *sectors)
+{
+    uint32_t checksum = 0;
+    for (uint32_t i = 0; i < bytesPerSector * 11; i++)
+    {
+        if (i == 106 || i == 107 || i == 112)
+            continue;
+        checksum = ((checksum & 1) ? 0x80000000u : 0) + (checksum >> 1) + sectors[i];
+    }
+    return checksum;
+}
+
+//------------------------------------------------------
+// Tree construction
+//------------------------------------------------------
+
+static void put16(uint8_t *p, uint16_t v) { memcpy(p, &v, 2); }
+static void put32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+static void put64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+
+static node *newNode(const node *parent, const char *baseName, bool directory)
+{
+    node *n = calloc(1, sizeof(node));
+    if (n == NULL)
+        die("out of memory");
+    int length = (int)strlen(baseName);
+    memcpy(n->name, baseName, (size_t)length);
+    // pad the name with a repeating pattern (before any extension) when long names are requested
+    if (opts.nameLength > length)
+    {
+        const char *dot = strrchr(baseName, '.');
+        int stem = dot ? (int)(dot - baseName) : length;
+        int pad = (opts.nameLength > MAX_NAME_LENGTH ? MAX_NAME_LENGTH : opts.nameLength) - length;
+        memmove(n->name + stem + pad, baseName + stem, (size_t)(length - stem));
+        for (int i = 0; i < pad; i++)
+            n->name[stem + i] = (char)('a' + i % 26);
+        length += pad;
+    }
+    n->name[length] = '\0';
+    if (parent != NULL)
+    {
+        size_t parentLength = strlen(parent->path);
+        if (parentLength + 1 + (size_t)length >= sizeof(n->path))
+            die("path too long");
+        memcpy(n->path, parent->path, parentLength);
+        if (parentLength > 0)
+            n->path[parentLength++] = '/';
+        memcpy(n->path + parentLength, n->name, (size_t)length + 1);
+    }
+    n->directory = directory;
+    n->noFatChain = opts.noFatChain;
+    return n;
+}
+
+static void addChild(node *parent, node *child)
+{
+    parent->children = realloc(parent->children, sizeof(node *) * (size_t)(parent->childCount + 1));
+    if (parent->children == NULL)
+        die("out of memory");
+    parent->children[parent->childCount++] = child;
+}
+
+static int entriesFor(const node *n)
+{
+    return 2 + ((int)strlen(n->name) + UNICODE_CHARS_PER_ENTRY - 1) / UNICODE_CHARS_PER_ENTRY;
+}
+
+static void setFileLength(node *n, uint64_t length)
+{
+    n->dataLength = length;
+    n->validDataLength = length * (uint64_t)opts.validPercent / 100;
+    n->clustersNeeded = (uint32_t)((length + bytesPerCluster - 1) / bytesPerCluster);
+}
+
+static void buildTree(node *dir, int level)
+{
+    char name[64];
+    for (int f = 0; f < opts.filesPerDir; f++)
+    {
+        snprintf(name, sizeof(name), "File_%05u.MP4", nextOrdinal);
+        node *file = newNode(dir, name, false);
+        file->ordinal = nextOrdinal++;
+        uint64_t length = opts.fileSize;
+        if (file->ordinal % 11 == 10)
+            length = 0;
+        else if (length > 0)
+            length -= (uint64_t)file->ordinal * 997 % (length / 2 + 1);
+        setFileLength(file, length);
+        addChild(dir, file);
+    }
+    if (level < opts.depth)
+    {
+        for (int d = 0; d < opts.dirsPerDir; d++)
+        {
+            snprintf(name, sizeof(name), "Dir_%d_%d", level, d);
+            node *child = newNode(dir, name, true);
+            addChild(dir, child);
+            buildTree(child, level + 1);
+        }
+    }
+}
+
+//directory sizes depend only on their children so they can be sized before anything is written
+static void sizeDirectories(node *dir, int extraEntries)
+{
+    int entries = extraEntries;
+    for (int i = 0; i < dir->childCount; i++)
+    {
+        entries += entriesFor(dir->children[i]) * (opts.deleted && i % 5 == 0 ? 2 : 1);
+        if (dir->children[i]->directory)
+            sizeDirectories(dir->children[i], 0);
+    }
+    uint64_t bytes = roundUp((uint64_t)entries * BYTES_PER_ENTRY, bytesPerCluster);
+    if (bytes == 0)
+        bytes = bytesPerCluster;
+    dir->dataLength = bytes;
+    dir->validDataLength = bytes;
+    dir->clustersNeeded = (uint32_t)(bytes / bytesPerCluster);
+}
+
+static void allocateDirectories(node *dir)
+{
+    allocate(dir, dir->clustersNeeded);
+    for (int i = 0; i < dir->childCount; i++)
+        if (dir->children[i]->directory)
+            allocateDirectories(dir->children[i]);
+}
+
+//files of one directory are either laid out back to back or interleaved `fragment` clusters at a time
+static void allocateFiles(node *dir)
+{
+    if (opts.fragment == 0)
+    {
+        for (int i = 0; i < dir->childCount; i++)
+            if (!dir->children[i]->directory && dir->children[i]->clustersNeeded > 0)
+                allocate(dir->children[i], dir->children[i]->clustersNeeded);
+    }
+    else
+    {
+        bool pending = true;
+        while (pending)
+        {
+            pending = false;
+            for (int i = 0; i < dir->childCount; i++)
+            {
+                node *file = dir->children[i];
+                if (file->directory || file->clustersAllocated == file->clustersNeeded)
+                    continue;
+                uint32_t chunk = file->clustersNeeded - file->clustersAllocated;
+                if (chunk > opts.fragment)
+                    chunk = opts.fragment;
+                allocate(file, chunk);
+                pending = true;
+            }
+        }
+    }
+    for (int i = 0; i < dir->childCount; i++)
+        if (dir->children[i]->directory)
+            allocateFiles(dir->children[i]);
+}
+
+//------------------------------------------------------
+// Serialisation
+//------------------------------------------------------
+
+static uint64_t fileByteWord(uint32_t ordinal, uint64_t word)
+{
+    uint64_t z = ((uint64_t)ordinal << 40) ^ word ^ 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+//expected bytes of a file: a deterministic pattern up to ValidDataLength, zeros after it
+static void fillContent(const node *n, uint64_t offset, uint8_t *buffer, uint64_t length)
+{
+    for (uint64_t i = 0; i < length; i++)
+    {
+        uint64_t position = offset + i;
+        if (position >= n->validDataLength)
+            buffer[i] = 0;
+        else
+            buffer[i] = (uint8_t)(fileByteWord(n->ordinal, position / 8) >> (8 * (position % 8)));
+    }
+}
+
+static void writeFileData(const node *n, uint8_t *buffer)
+{
+    uint64_t fileOffset = 0;
+    for (int e = 0; e < n->extentCount; e++)
+    {
+        uint64_t extentBytes = (uint64_t)n->extents[e].count * bytesPerCluster;
+        uint64_t diskOffset = clusterOffset(n->extents[e].startCluster);
+        for (uint64_t done = 0; done < extentBytes; done += WRITE_CHUNK)
+        {
+            uint64_t chunk = extentBytes - done < WRITE_CHUNK ? extentBytes - done : WRITE_CHUNK;
+            fillContent(n, fileOffset + done, buffer, chunk);
+            // bytes past ValidDataLength are undefined on disk, make them visibly wrong
+            for (uint64_t i = 0; i < chunk; i++)
+                if (fileOffset + done + i >= n->validDataLength)
+                    buffer[i] = 0xEE;
+            pwriteAll(buffer, chunk, diskOffset + done);
+        }
+        fileOffset += extentBytes;
+    }
+}
+
+static void writeReference(const node *n, uint8_t *buffer)
+{
+    char path[8192];
+    snprintf(path, sizeof(path), "%s/%s", opts.referenceDir, n->path);
+    if (n->directory)
+    {
+        mkdir(path, 0755);
+        return;
+    }
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+        die(strerror(errno));
+    for (uint64_t done = 0; done < n->dataLength; done += WRITE_CHUNK)
+    {
+        uint64_t chunk = n->dataLength - done < WRITE_CHUNK ? n->dataLength - done : WRITE_CHUNK;
+        fillContent(n, done, buffer, chunk);
+        if (write(out, buffer, chunk) != (ssize_t)chunk)
+            die(strerror(errno));
+    }
+    close(out);
+}
+
+//encode the File / Stream Extension / File Name entries describing `n`
+static int encodeEntrySet(const node *n, uint8_t *entries)
+{
+    int nameLength = (int)strlen(n->name);
+    int count = entriesFor(n);
+    uint16_t unicode[MAX_NAME_LENGTH];
+    for (int i = 0; i < nameLength; i++)
+        unicode[i] = (uint8_t)n->name[i];
+    memset(entries, 0, (size_t)count * BYTES_PER_ENTRY);
+
+    // 2024-05-17 12:34:56 in exFAT timestamp layout
+    uint32_t timestamp = (44u << 25) | (5u << 21) | (17u << 16) | (12u << 11) | (34u << 5) | 28u;
+    entries[0] = FILE_TYPE_ENTRY;
+    entries[1] = (uint8_t)(count - 1);
+    put16(entries + 4, n->directory ? ATTR_DIRECTORY : ATTR_ARCHIVE);
+    put32(entries + 8, timestamp);
+    put32(entries + 12, timestamp + n->ordinal % 30);
+    put32(entries + 16, timestamp);
+
+    uint8_t *stream = entries + BYTES_PER_ENTRY;
+    stream[0] = STREAM_EXTENSION_ENTRY;
+    stream[1] = (uint8_t)((n->extentCount > 0 ? FLAG_ALLOCATION_POSSIBLE : 0) | (n->noFatChain ? FLAG_NO_FAT_CHAIN : 0));
+    stream[3] = (uint8_t)nameLength;
+    put16(stream + 4, nameHash(unicode, nameLength));
+    put64(stream + 8, n->validDataLength);
+    put32(stream + 20, n->extentCount > 0 ? n->extents[0].startCluster : 0);
+    put64(stream + 24, n->dataLength);
+
+    for (int e = 2; e < count; e++)
+    {
+        uint8_t *nameEntry = entries + e * BYTES_PER_ENTRY;
+        nameEntry[0] = FILE_NAME_ENTRY;
+        for (int c = 0; c < UNICODE_CHARS_PER_ENTRY; c++)
+        {
+            int index = (e - 2) * UNICODE_CHARS_PER_ENTRY + c;
+            if (index < nameLength)
+                put16(nameEntry + 2 + c * 2, unicode[index]);
+        }
+    }
+    put16(entries + 2, entrySetChecksum(entries, count));
+    return count;
+}
+
+//write the directory contents of `dir` into its clusters (extents are followed in order)
+static void writeDirectory(const node *dir, const uint8_t *prefix, int prefixEntries)
+{
+    uint8_t *contents = calloc(1, dir->dataLength);
+    if (contents == NULL)
+        die("out of memory");
+    size_t used = (size_t)prefixEntries * BYTES_PER_ENTRY;
+    memcpy(contents, prefix, used);
+    for (int i = 0; i < dir->childCount; i++)
+    {
+        int count = encodeEntrySet(dir->children[i], contents + used);
+        if (opts.deleted && i % 5 == 0)
+        {
+            // leave a deleted copy in front of the live set, exercising the parser's skip path
+            memcpy(contents + used + (size_t)count * BYTES_PER_ENTRY, contents + used, (size_t)count * BYTES_PER_ENTRY);
+            for (int e = 0; e < count; e++)
+                contents[used + (size_t)e * BYTES_PER_ENTRY] &= (uint8_t)~IN_USE_BIT;
+            used += (size_t)count * BYTES_PER_ENTRY;
+        }
+        used += (size_t)count * BYTES_PER_ENTRY;
+    }
+    uint64_t written = 0;
+    for (int e = 0; e < dir->extentCount; e++)
+    {
+        uint64_t bytes = (uint64_t)dir->extents[e].count * bytesPerCluster;
+        pwriteAll(contents + written, bytes, clusterOffset(dir->extents[e].startCluster));
+        written += bytes;
+    }
+    free(contents);
+}
+
+static void writeTree(node *dir, uint8_t *buffer)
+{
+    if (dir->path[0] != '\0')
+        writeDirectory(dir, NULL, 0);
+    linkChain(dir);
+    if (opts.referenceDir != NULL)
+        writeReference(dir, buffer);
+    for (int i = 0; i < dir->childCount; i++)
+    {
+        node *child = dir->children[i];
+        if (child->directory)
+        {
+            writeTree(child, buffer);
+        }
+        else
+        {
+            linkChain(child);
+            writeFileData(child, buffer);
+            if (opts.referenceDir != NULL)
+                writeReference(child, buffer);
+        }
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: mkexfat [options] <image>\n"
+            "  --size BYTES          volume size, K/M/G/T suffixes allowed (default 64M)\n"
+            "  --sector-shift N      log2 bytes per sector, 9-12 (default 9)\n"
+            "  --cluster-shift N     log2 sectors per cluster (default 3)\n"
+            "  --depth N             directory nesting depth (default 2)\n"
+            "  --dirs N              sub directories per directory (default 2)\n"
+            "  --files N             files per directory (default 4)\n"
+            "  --file-size BYTES     nominal file size (default 64K)\n"
+            "  --big-files N         extra large files in the root (default 0)\n"
+            "  --big-size BYTES      size of each large file (default 16M)\n"
+            "  --name-length N       pad names to N characters (more File Name entries)\n"
+            "  --fragment N          interleave files N clusters at a time (fragmented chains)\n"
+            "  --no-fat-chain        store files and directories as contiguous NoFatChain extents\n"
+            "  --valid-percent N     ValidDataLength as a percentage of DataLength (default 100)\n"
+            "  --skip-clusters N     leave N free clusters before file data (high offsets)\n"
+            "  --deleted             add deleted entry sets to every directory\n"
+            "  --label NAME          volume label (default BENCH)\n"
+            "  --serial HEX          volume serial number (default 0x1234ABCD)\n"
+            "  --reference DIR       also write the expected file tree to DIR\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    opts.size = 64ull << 20;
+    opts.sectorShift = 9;
+    opts.clusterShift = 3;
+    opts.depth = 2;
+    opts.dirsPerDir = 2;
+    opts.filesPerDir = 4;
+    opts.fileSize = 64 << 10;
+    opts.bigFileSize = 16 << 20;
+    opts.validPercent = 100;
+    opts.label = "BENCH";
+    opts.serial = 0x1234ABCD;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            opts.imagePath = arg;
+            continue;
+        }
+        if (strcmp(arg, "--no-fat-chain") == 0)
+        {
+            opts.noFatChain = true;
+            continue;
+        }
+        if (strcmp(arg, "--deleted") == 0)
+        {
+            opts.deleted = true;
+            continue;
+        }
+        if (value == NULL)
+            usage();
+        i++;
+        if (strcmp(arg, "--size") == 0)
+            opts.size = parseSize(value);
+        else if (strcmp(arg, "--sector-shift") == 0)
+            opts.sectorShift = atoi(value);
+        else if (strcmp(arg, "--cluster-shift") == 0)
+            opts.clusterShift = atoi(value);
+        else if (strcmp(arg, "--depth") == 0)
+            opts.depth = atoi(value);
+        else if (strcmp(arg, "--dirs") == 0)
+            opts.dirsPerDir = atoi(value);
+        else if (strcmp(arg, "--files") == 0)
+            opts.filesPerDir = atoi(value);
+        else if (strcmp(arg, "--file-size") == 0)
+            opts.fileSize = parseSize(value);
+        else if (strcmp(arg, "--big-files") == 0)
+            opts.bigFiles = atoi(value);
+        else if (strcmp(arg, "--big-size") == 0)
+            opts.bigFileSize = parseSize(value);
+        else if (strcmp(arg, "--name-length") == 0)
+            opts.nameLength = atoi(value);
+        else if (strcmp(arg, "--fragment") == 0)
+            opts.fragment = (uint32_t)atoi(value);
+        else if (strcmp(arg, "--valid-percent") == 0)
+            opts.validPercent = atoi(value);
+        else if (strcmp(arg, "--skip-clusters") == 0)
+            opts.skipClusters = parseSize(value);
+        else if (strcmp(arg, "--label") == 0)
+            opts.label = value;
+        else if (strcmp(arg, "--serial") == 0)
+            opts.serial = (uint32_t)strtoul(value, NULL, 16);
+        else if (strcmp(arg, "--reference") == 0)
+            opts.referenceDir = value;
+        else
+            usage();
+    }
+    if (opts.imagePath == NULL || opts.sectorShift < 9 || opts.sectorShift > 12 ||
+        opts.clusterShift < 0 || opts.sectorShift + opts.clusterShift > 25 ||
+        opts.validPercent < 0 || opts.validPercent > 100)
+        usage();
+    if (opts.noFatChain && opts.fragment != 0)
+        die("--no-fat-chain files are contiguous and cannot be fragmented");
+
+    // geometry
+    bytesPerSector = 1u << opts.sectorShift;
+    sectorsPerCluster = 1u << opts.clusterShift;
+    bytesPerCluster = (uint64_t)bytesPerSector * sectorsPerCluster;
+    totalSectors = opts.size / bytesPerSector;
+    fatOffset = FAT_ALIGNMENT_SECTORS > 2 * BOOT_REGION_SECTORS ? FAT_ALIGNMENT_SECTORS : 2 * BOOT_REGION_SECTORS;
+    uint64_t clusters = (totalSectors - fatOffset) / sectorsPerCluster;
+    if (clusters > 0xFFFFFFF5u - CLUSTER_INDEX_OFFSET)
+        clusters = 0xFFFFFFF5u - CLUSTER_INDEX_OFFSET;
+    // the FAT takes space away from the heap, iterate until the two agree
+    for (int pass = 0; pass < 4; pass++)
+    {
+        fatLength = (uint32_t)roundUp((clusters + CLUSTER_INDEX_OFFSET) * 4, bytesPerSector) / bytesPerSector;
+        clstHeapOffset = (uint32_t)roundUp(fatOffset + fatLength, sectorsPerCluster);
+        clusters = (totalSectors - clstHeapOffset) / sectorsPerCluster;
+        if (clusters > 0xFFFFFFF5u - CLUSTER_INDEX_OFFSET)
+            clusters = 0xFFFFFFF5u - CLUSTER_INDEX_OFFSET;
+    }
+    if (totalSectors <= clstHeapOffset || clusters < 16)
+        die("volume too small");
+    clusterCount = (uint32_t)clusters;
+
+    fat = calloc((size_t)clusterCount + CLUSTER_INDEX_OFFSET, sizeof(uint32_t));
+    bitmap = calloc(roundUp(clusterCount, 8) / 8, 1);
+    uint8_t *buffer = malloc(WRITE_CHUNK);
+    if (fat == NULL || bitmap == NULL || buffer == NULL)
+        die("out of memory");
+    fat[0] = MEDIA_DESCRIPTOR;
+    fat[1] = END_OF_CHAIN;
+
+    imageFd = open(opts.imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (imageFd < 0 || ftruncate(imageFd, (off_t)(totalSectors * bytesPerSector)) != 0)
+        die(strerror(errno));
+    if (opts.referenceDir != NULL)
+        mkdir(opts.referenceDir, 0755);
+
+    for (int i = 0; i < UPCASE_TABLE_CHARS; i++)
+        upcase[i] = (uint16_t)((i >= 'a' && i <= 'z') ? i - 'a' + 'A' : i);
+
+    // metadata objects at the start of the heap: bitmap, up-case table, root directory
+    node bitmapNode = {0}, upcaseNode = {0};
+    bitmapNode.dataLength = roundUp(clusterCount, 8) / 8;
+    upcaseNode.dataLength = sizeof(upcase);
+    allocate(&bitmapNode, (uint32_t)((bitmapNode.dataLength + bytesPerCluster - 1) / bytesPerCluster));
+    allocate(&upcaseNode, (uint32_t)((upcaseNode.dataLength + bytesPerCluster - 1) / bytesPerCluster));
+
+    node *root = newNode(NULL, "", true);
+    root->noFatChain = false; // the root directory has no stream extension, it is always chained
+    buildTree(root, 0);
+    for (int b = 0; b < opts.bigFiles; b++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "Big_%02d.MOV", b);
+        node *big = newNode(root, name, false);
+        big->ordinal = nextOrdinal++;
+        setFileLength(big, opts.bigFileSize);
+        addChild(root, big);
+    }
+    sizeDirectories(root, 3);
+    uint32_t rootCluster = (uint32_t)cursor;
+    allocateDirectories(root);
+    // sub directories keep their NoFatChain flag only if they are contiguous, which allocate() guarantees
+    cursor += opts.skipClusters;
+    if (cursor > (uint64_t)clusterCount + CLUSTER_INDEX_OFFSET)
+        die("--skip-clusters beyond the end of the volume");
+    allocateFiles(root);
+
+    // root directory: label, bitmap and up-case entries followed by the tree
+    uint8_t prefix[3 * BYTES_PER_ENTRY] = {0};
+    int labelLength = (int)strlen(opts.label);
+    if (labelLength > 11)
+        labelLength = 11;
+    prefix[0] = VOLUME_LABEL_ENTRY;
+    prefix[1] = (uint8_t)labelLength;
+    for (int i = 0; i < labelLength; i++)
+        put16(prefix + 2 + i * 2, (uint8_t)opts.label[i]);
+    uint8_t *bitmapEntry = prefix + BYTES_PER_ENTRY;
+    bitmapEntry[0] = ALLOCATION_BITMAP_ENTRY;
+    put32(bitmapEntry + 20, bitmapNode.extents[0].startCluster);
+    put64(bitmapEntry + 24, bitmapNode.dataLength);
+    uint8_t *upcaseEntry = prefix + 2 * BYTES_PER_ENTRY;
+    uint32_t tableChecksum = 0;
+    const uint8_t *upcaseBytes = (const uint8_t *)upcase;
+    for (size_t i = 0; i < sizeof(upcase); i++)
+        tableChecksum = ((tableChecksum & 1) ? 0x80000000u : 0) + (tableChecksum >> 1) + upcaseBytes[i];
+    upcaseEntry[0] = UPCASE_TABLE_ENTRY;
+    put32(upcaseEntry + 4, tableChecksum);
+    put32(upcaseEntry + 20, upcaseNode.extents[0].startCluster);
+    put64(upcaseEntry + 24, upcaseNode.dataLength);
+
+    root->path[0] = '\0';
+    writeDirectory(root, prefix, 3);
+    writeTree(root, buffer);
+    linkChain(&bitmapNode);
+    linkChain(&upcaseNode);
+    pwriteAll(upcase, sizeof(upcase), clusterOffset(upcaseNode.extents[0].startCluster));
+
+    // the bitmap must be fully allocated before it is written
+    pwriteSparse(bitmap, bitmapNode.dataLength, clusterOffset(bitmapNode.extents[0].startCluster));
+    pwriteSparse((const uint8_t *)fat, ((uint64_t)clusterCount + CLUSTER_INDEX_OFFSET) * 4, (uint64_t)fatOffset * bytesPerSector);
+
+    // boot region and its backup
+    uint8_t *region = calloc(BOOT_REGION_SECTORS, bytesPerSector);
+    if (region == NULL)
+        die("out of memory");
+    memcpy(region, "\xEB\x76\x90" "EXFAT   ", 11);
+    put64(region + 72, totalSectors);
+    put32(region + 80, fatOffset);
+    put32(region + 84, fatLength);
+    put32(region + 88, clstHeapOffset);
+    put32(region + 92, clusterCount);
+    put32(region + 96, rootCluster);
+    put32(region + 100, opts.serial);
+    put16(region + 104, 0x0100);
+    region[108] = (uint8_t)opts.sectorShift;
+    region[109] = (uint8_t)opts.clusterShift;
+    region[110] = 1;
+    region[111] = 0x80;
+    region[112] = (uint8_t)((cursor - CLUSTER_INDEX_OFFSET) * 100 / clusterCount);
+    region[510] = 0x55;
+    region[511] = 0xAA;
+    for (uint32_t s = 1; s <= 8; s++)
+    {
+        region[s * bytesPerSector + bytesPerSector - 2] = 0x55;
+        region[s * bytesPerSector + bytesPerSector - 1] = 0xAA;
+    }
+    uint32_t checksum = bootChecksum(region);
+    for (uint32_t i = 0; i < bytesPerSector / 4; i++)
+        put32(region + 11 * bytesPerSector + i * 4, checksum);
+    pwriteAll(region, (size_t)BOOT_REGION_SECTORS * bytesPerSector, 0);
+    pwriteAll(region, (size_t)BOOT_REGION_SECTORS * bytesPerSector, (uint64_t)BOOT_REGION_SECTORS * bytesPerSector);
+
+    printf("{\"image\":\"%s\",\"bytes\":%llu,\"clusterSize\":%llu,\"clusters\":%u,\"usedClusters\":%llu,\"files\":%u}\n",
+           opts.imagePath, (unsigned long long)(totalSectors * bytesPerSector), (unsigned long long)bytesPerCluster,
+           clusterCount, (unsigned long long)(cursor - CLUSTER_INDEX_OFFSET - opts.skipClusters), nextOrdinal);
+    free(region);
+    free(buffer);
+    close(imageFd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,550 @@
+//-----------------------------------------
+// runbench
+//
+// Benchmarks exFAT_OS_Read_Operate against synthetic images made by mkexfat.
+// For every scenario the image is generated, then info, list and get are run
+// a few times each. Every measurement is printed to standard output as one
+// JSON object per line so that results can be compared between builds:
+// 1. wall clock time (median of the runs), user and system time
+// 2. peak resident set size
+// 3. number of system calls, counted with ptrace in a separate run
+// 4. throughput: bytes extracted per second for get, entries per second for list
+// A command is ok when it exits successfully and, for get, every file it
+// extracted is identical to the one mkexfat wrote to its reference tree.
+//
+//-----------------------------------------
+
+#define _GNU_SOURCE //__WALL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+
+#define MAX_ARGUMENTS 64
+#define MAX_REPEATS 100
+#define DEFAULT_REPEATS 3
+#define OPEN_DIRECTORIES 32 //file descriptors nftw may use
+#define TRACE_STOP_SYSCALL (SIGTRAP | 0x80)
+#define COMPARE_BLOCK_BYTES (1024 * 1024)
+
+//an image to generate and what to extract from it
+typedef struct scenario
+{
+    const char *name;
+    const char *generatorArguments;      //mkexfat options, separated by single spaces
+    const char *quickGeneratorArguments; //the same with smaller sizes, for --quick
+    const char *getPath;                 //file extracted by the single get
+} scenario;
+
+//how to run the program being measured
+typedef struct benchCommand
+{
+    const char *name;
+    const char *arguments; //after the image path, separated by single spaces
+    bool extracts;         //writes files below the output directory
+    bool lists;            //prints one line per directory entry
+} benchCommand;
+
+//what one run of a command cost
+typedef struct measurement
+{
+    double wallMs;
+    double userMs;
+    double systemMs;
+    long maxRssKb;
+    long syscalls; //-1 when not counted
+    int status;    //as returned by wait
+} measurement;
+
+static const scenario scenarios[] = {
+    {"flat-dcim", "--depth 0 --files 10000 --file-size 4K --big-files 1 --big-size 16M --size 256M",
+     "--depth 0 --files 2000 --file-size 4K --big-files 1 --big-size 4M --size 64M", "Big_00.MOV"},
+    {"deep-tree", "--depth 4 --dirs 4 --files 8 --file-size 8K --big-files 1 --big-size 16M --size 512M",
+     "--depth 3 --dirs 3 --files 6 --file-size 8K --big-files 1 --big-size 4M --size 128M", "Big_00.MOV"},
+    {"long-names", "--depth 2 --dirs 3 --files 64 --name-length 255 --file-size 8K --big-files 1 --big-size 16M --size 256M",
+     "--depth 2 --dirs 2 --files 16 --name-length 255 --file-size 8K --big-files 1 --big-size 4M --size 64M", NULL},
+    {"fragmented", "--cluster-shift 0 --fragment 1 --files 32 --file-size 64K --big-files 2 --big-size 32M --size 256M",
+     "--cluster-shift 0 --fragment 1 --files 8 --file-size 64K --big-files 2 --big-size 8M --size 64M", "Big_00.MOV"},
+    {"no-fat-chain", "--no-fat-chain --files 32 --file-size 64K --big-files 2 --big-size 64M --size 512M",
+     "--no-fat-chain --files 8 --file-size 64K --big-files 2 --big-size 8M --size 64M", "Big_00.MOV"},
+    {"large-clusters", "--sector-shift 12 --cluster-shift 5 --files 16 --file-size 1M --big-files 2 --big-size 64M --size 1G",
+     "--sector-shift 12 --cluster-shift 5 --files 4 --file-size 1M --big-files 2 --big-size 8M --size 256M", "Big_00.MOV"},
+    //a sparse 5 TB image (a few MB on disk) with every file past 4 TB, where 32 bit offsets wrap
+    {"huge-sparse", "--size 5T --cluster-shift 8 --skip-clusters 35000000 --depth 2 --dirs 2 --files 8 --file-size 64K --big-files 1 --big-size 64M",
+     "--size 5T --cluster-shift 8 --skip-clusters 35000000 --depth 1 --dirs 2 --files 4 --file-size 64K --big-files 1 --big-size 8M", "Big_00.MOV"},
+};
+
+static const benchCommand commands[] = {
+    {"info", "info", false, false},
+    {"list", "list", false, true},
+    {"list-threads", "list --threads=0", false, true},
+    {"get", "get", true, false},
+    {"get-batch", "get / --dest=out", true, false},
+};
+
+static uint64_t outputBytes;       //summed by addFileSize
+static const char *referenceRoot;  //trees compared by compareEntry
+static const char *extractedRoot;
+static bool treesMatch;
+
+//------------------------------------------------------
+// splitArguments
+//
+// PURPOSE: Append the space separated words of a string to an argument vector
+// INPUT PARAMETERS:
+//     the vector, how many entries it already holds, the words (copied)
+// OUTPUT PARAMETERS:
+//      the new number of entries, the vector stays NULL terminated
+//------------------------------------------------------
+static int splitArguments(char **argumentVector, int count, const char *words)
+{
+    char *copy = strdup(words);
+    for (char *word = strtok(copy, " "); word != NULL && count < MAX_ARGUMENTS - 1; word = strtok(NULL, " "))
+        argumentVector[count++] = strdup(word);
+    argumentVector[count] = NULL;
+    free(copy);
+    return count;
+}
+
+//input: a directory and a name in it
+//returns the heap allocated path "directory/name"
+static char *joinPath(const char *directory, const char *name)
+{
+    char *joined = malloc(strlen(directory) + strlen(name) + 2);
+    sprintf(joined, "%s/%s", directory, name);
+    return joined;
+}
+
+//input: a NULL terminated argument vector built by splitArguments
+static void freeArguments(char **argumentVector)
+{
+    for (int i = 0; argumentVector[i] != NULL; i++)
+        free(argumentVector[i]);
+}
+
+//input: a timespec
+//returns it in milliseconds
+static double toMs(struct timespec time)
+{
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+//input: a timeval
+//returns it in milliseconds
+static double timevalMs(struct timeval time)
+{
+    return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+}
+
+//------------------------------------------------------
+// traceSyscalls
+//
+// PURPOSE: Follow a traced child (and every thread it creates) to its end, counting the system calls it makes. Each call stops the thread twice, on entry and on exit.
+// INPUT PARAMETERS:
+//     the child, stopped by its own SIGSTOP after PTRACE_TRACEME, where to store its status and resource usage
+// OUTPUT PARAMETERS:
+//      number of system calls
+//------------------------------------------------------
+static long traceSyscalls(pid_t child, int *status, struct rusage *usage)
+{
+    long syscallStops = 0;
+
+    ptrace(PTRACE_SETOPTIONS, child, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, child, 0, 0);
+    for (;;)
+    {
+        int threadStatus;
+        struct rusage threadUsage;
+        pid_t thread = wait4(-1, &threadStatus, __WALL, &threadUsage);
+        if (thread < 0)
+            break;
+        if (WIFEXITED(threadStatus) || WIFSIGNALED(threadStatus))
+        {
+            if (thread == child)
+            {
+                *status = threadStatus;
+                *usage = threadUsage;
+                break;
+            }
+            continue;
+        }
+
+        int signal = WSTOPSIG(threadStatus);
+        int inject = 0;
+        if (signal == TRACE_STOP_SYSCALL)
+            syscallStops++;
+        else if (signal != SIGTRAP && signal != SIGSTOP) //SIGTRAP: clone event, SIGSTOP: new thread starting
+            inject = signal;
+        ptrace(PTRACE_SYSCALL, thread, 0, inject);
+    }
+    return (syscallStops + 1) / 2; //exit_group never returns
+}
+
+//------------------------------------------------------
+// runCommand
+//
+// PURPOSE: Run a program to completion and measure it
+// INPUT PARAMETERS:
+//     its argument vector (argv[0] is an absolute path), the directory to run it in, file to send its standard output to, true to count its system calls (slows it down, so such runs are not timed)
+// OUTPUT PARAMETERS:
+//      the measurement
+//------------------------------------------------------
+static measurement runCommand(char **argumentVector, const char *workingDirectory, const char *outputFile, bool countSyscalls)
+{
+    measurement result = {0, 0, 0, 0, -1, -1};
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    pid_t child;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    child = fork();
+    if (child == 0)
+    {
+        int out = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || chdir(workingDirectory) != 0)
+            _exit(127);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+        if (countSyscalls)
+        {
+            if (ptrace(PTRACE_TRACEME, 0, 0, 0) != 0)
+                _exit(126);
+            raise(SIGSTOP);
+        }
+        execv(argumentVector[0], argumentVector);
+        _exit(127);
+    }
+    if (child < 0)
+    {
+        perror("fork");
+        return result;
+    }
+
+    if (countSyscalls)
+    {
+        int status;
+        waitpid(child, &status, 0);
+        if (WIFSTOPPED(status))
+            result.syscalls = traceSyscalls(child, &result.status, &usage);
+        else
+            wait4(child, &result.status, 0, &usage); //could not be traced (exited with 126)
+    }
+    else
+    {
+        wait4(child, &result.status, 0, &usage);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result.wallMs = toMs(end) - toMs(start);
+    result.userMs = timevalMs(usage.ru_utime);
+    result.systemMs = timevalMs(usage.ru_stime);
+    result.maxRssKb = usage.ru_maxrss;
+    return result;
+}
+
+//nftw callback: removes everything below a directory (depth first)
+static int removeEntry(const char *entryPath, const struct stat *info, int type, struct FTW *position)
+{
+    (void)info;
+    (void)type;
+    (void)position;
+    remove(entryPath);
+    return 0;
+}
+
+//nftw callback: adds the size of every regular file to outputBytes
+static int addFileSize(const char *entryPath, const struct stat *info, int type, struct FTW *position)
+{
+    (void)entryPath;
+    (void)position;
+    if (type == FTW_F)
+        outputBytes += info->st_size;
+    return 0;
+}
+
+//input: two files
+//returns true if both can be read and hold the same bytes
+static bool sameFile(const char *first, const char *second)
+{
+    FILE *a = fopen(first, "rb");
+    FILE *b = fopen(second, "rb");
+    char *blockA = malloc(COMPARE_BLOCK_BYTES);
+    char *blockB = malloc(COMPARE_BLOCK_BYTES);
+    bool same = a != NULL && b != NULL && blockA != NULL && blockB != NULL;
+
+    while (same)
+    {
+        size_t lengthA = fread(blockA, 1, COMPARE_BLOCK_BYTES, a);
+        size_t lengthB = fread(blockB, 1, COMPARE_BLOCK_BYTES, b);
+        same = lengthA == lengthB && memcmp(blockA, blockB, lengthA) == 0;
+        if (lengthA == 0)
+            break;
+    }
+    if (a != NULL)
+        fclose(a);
+    if (b != NULL)
+        fclose(b);
+    free(blockA);
+    free(blockB);
+    return same;
+}
+
+//nftw callback over referenceRoot: clears treesMatch when a file is missing below extractedRoot or differs
+static int compareEntry(const char *entryPath, const struct stat *info, int type, struct FTW *position)
+{
+    (void)info;
+    (void)position;
+    if (type == FTW_F)
+    {
+        char *extracted = joinPath(extractedRoot, entryPath + strlen(referenceRoot) + 1);
+        if (!sameFile(entryPath, extracted))
+        {
+            fprintf(stderr, "%s differs from the reference\n", extracted);
+            treesMatch = false;
+        }
+        free(extracted);
+    }
+    return 0;
+}
+
+//input: a file
+//returns the number of lines in it
+static long countLines(const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    long lines = 0;
+    int character;
+
+    if (file == NULL)
+        return 0;
+    while ((character = getc(file)) != EOF)
+        lines += character == '\n';
+    fclose(file);
+    return lines;
+}
+
+//qsort comparison of two measurements by wall clock time
+static int compareWall(const void *first, const void *second)
+{
+    double a = ((const measurement *)first)->wallMs;
+    double b = ((const measurement *)second)->wallMs;
+    return (a > b) - (a < b);
+}
+
+//------------------------------------------------------
+// benchScenario
+//
+// PURPOSE: Generate one scenario's image and measure every command against it, printing one JSON line per command
+// INPUT PARAMETERS:
+//     the scenario, the program to measure, mkexfat, the work directory, timed runs per command, smaller images, count system calls
+//------------------------------------------------------
+static void benchScenario(const scenario *current, const char *binary, const char *generator, const char *workDirectory, int repeats, bool quick, bool countSyscalls)
+{
+    char *scenarioDirectory = joinPath(workDirectory, current->name);
+    char *outputDirectory = joinPath(scenarioDirectory, "out");
+    char *imagePath = joinPath(scenarioDirectory, "image.img");
+    char *stdoutPath = joinPath(scenarioDirectory, "stdout.txt");
+    char *referenceDirectory = joinPath(scenarioDirectory, "reference");
+    char *argumentVector[MAX_ARGUMENTS];
+    struct stat imageInfo;
+    measurement runs[MAX_REPEATS];
+    size_t commandCount = sizeof(commands) / sizeof(commands[0]);
+
+    nftw(scenarioDirectory, removeEntry, OPEN_DIRECTORIES, FTW_DEPTH | FTW_PHYS);
+    mkdir(workDirectory, 0755);
+    mkdir(scenarioDirectory, 0755);
+
+    fprintf(stderr, "%s: generating image\n", current->name);
+    argumentVector[0] = strdup(generator);
+    int count = splitArguments(argumentVector, 1, quick ? current->quickGeneratorArguments : current->generatorArguments);
+    argumentVector[count++] = strdup("--reference");
+    argumentVector[count++] = strdup(referenceDirectory);
+    argumentVector[count++] = strdup(imagePath);
+    argumentVector[count] = NULL;
+    measurement generated = runCommand(argumentVector, scenarioDirectory, stdoutPath, false);
+    freeArguments(argumentVector);
+    if (!WIFEXITED(generated.status) || WEXITSTATUS(generated.status) != 0 || stat(imagePath, &imageInfo) != 0)
+    {
+        fprintf(stderr, "%s: mkexfat failed\n", current->name);
+        commandCount = 0; //nothing to measure
+    }
+
+    for (size_t c = 0; c < commandCount; c++)
+    {
+        const benchCommand *command = &commands[c];
+        if (strcmp(command->name, "get") == 0 && current->getPath == NULL)
+            continue;
+
+        argumentVector[0] = strdup(binary);
+        argumentVector[1] = strdup(imagePath);
+        count = splitArguments(argumentVector, 2, command->arguments);
+        if (strcmp(command->name, "get") == 0)
+        {
+            argumentVector[count++] = strdup(current->getPath);
+            argumentVector[count] = NULL;
+        }
+
+        fprintf(stderr, "%s: %s\n", current->name, command->name);
+        long syscalls = -1;
+        if (countSyscalls)
+        {
+            nftw(outputDirectory, removeEntry, OPEN_DIRECTORIES, FTW_DEPTH | FTW_PHYS);
+            mkdir(outputDirectory, 0755);
+            syscalls = runCommand(argumentVector, outputDirectory, stdoutPath, true).syscalls;
+        }
+
+        long maxRssKb = 0;
+        for (int r = 0; r < repeats; r++)
+        {
+            nftw(outputDirectory, removeEntry, OPEN_DIRECTORIES, FTW_DEPTH | FTW_PHYS); //every get writes fresh files
+            mkdir(outputDirectory, 0755);
+            runs[r] = runCommand(argumentVector, outputDirectory, stdoutPath, false);
+            if (runs[r].maxRssKb > maxRssKb)
+                maxRssKb = runs[r].maxRssKb;
+        }
+        freeArguments(argumentVector);
+
+        outputBytes = 0;
+        if (command->extracts)
+            nftw(outputDirectory, addFileSize, OPEN_DIRECTORIES, FTW_PHYS);
+        long entries = command->lists ? countLines(stdoutPath) : 0;
+        bool succeeded = true;
+        for (int r = 0; r < repeats; r++)
+            succeeded = succeeded && WIFEXITED(runs[r].status) && WEXITSTATUS(runs[r].status) == 0;
+        if (succeeded && strcmp(command->name, "get") == 0) //the last run's output is still there
+        {
+            char *reference = joinPath(referenceDirectory, current->getPath);
+            char *extracted = joinPath(outputDirectory, current->getPath);
+            succeeded = sameFile(reference, extracted);
+            free(reference);
+            free(extracted);
+        }
+        else if (succeeded && command->extracts)
+        {
+            char *destination = joinPath(outputDirectory, "out");
+            referenceRoot = referenceDirectory;
+            extractedRoot = destination;
+            treesMatch = true;
+            nftw(referenceDirectory, compareEntry, OPEN_DIRECTORIES, FTW_PHYS);
+            succeeded = treesMatch;
+            free(destination);
+        }
+
+        qsort(runs, repeats, sizeof(measurement), compareWall);
+        measurement *median = &runs[repeats / 2];
+        double seconds = median->wallMs / 1000.0;
+        printf("{\"scenario\":\"%s\",\"command\":\"%s\",\"quick\":%s,\"image_bytes\":%lld,\"runs\":%d,\"ok\":%s,"
+               "\"wall_ms\":%.3f,\"wall_ms_min\":%.3f,\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld,\"syscalls\":%ld,"
+               "\"bytes\":%llu,\"mb_per_s\":%.1f,\"entries\":%ld,\"entries_per_s\":%.0f}\n",
+               current->name, command->name, quick ? "true" : "false", (long long)imageInfo.st_size, repeats,
+               succeeded ? "true" : "false", median->wallMs, runs[0].wallMs, median->userMs, median->systemMs, maxRssKb,
+               syscalls, (unsigned long long)outputBytes, seconds > 0 ? outputBytes / 1e6 / seconds : 0,
+               entries, seconds > 0 ? entries / seconds : 0);
+        fflush(stdout);
+    }
+    free(referenceDirectory);
+    free(stdoutPath);
+    free(imagePath);
+    free(outputDirectory);
+    free(scenarioDirectory);
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: runbench [options]\n"
+            "  --binary PATH      program to measure (default ./exFAT_OS_Read_Operate)\n"
+            "  --mkexfat PATH     image generator (default: mkexfat next to runbench)\n"
+            "  --work DIR         where images and outputs go (default bench/work)\n"
+            "  --repeat N         timed runs per command, the median is reported (default 3)\n"
+            "  --scenario NAME    only run this scenario (may be repeated)\n"
+            "  --quick            smaller images\n"
+            "  --no-syscalls      skip the extra ptrace run that counts system calls\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *binary = "./exFAT_OS_Read_Operate";
+    const char *generator = NULL;
+    const char *workDirectory = "bench/work";
+    const char *selected[MAX_ARGUMENTS];
+    int selectedCount = 0;
+    int repeats = DEFAULT_REPEATS;
+    bool quick = false;
+    bool countSyscalls = true;
+    char binaryPath[PATH_MAX];
+    char generatorPath[PATH_MAX];
+    char workPath[PATH_MAX];
+    char *defaultGenerator = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if (strcmp(argv[i], "--no-syscalls") == 0)
+            countSyscalls = false;
+        else if (value == NULL)
+            usage();
+        else if (strcmp(argv[i], "--binary") == 0)
+            binary = argv[++i];
+        else if (strcmp(argv[i], "--mkexfat") == 0)
+            generator = argv[++i];
+        else if (strcmp(argv[i], "--work") == 0)
+            workDirectory = argv[++i];
+        else if (strcmp(argv[i], "--repeat") == 0)
+            repeats = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--scenario") == 0 && selectedCount < MAX_ARGUMENTS)
+            selected[selectedCount++] = argv[++i];
+        else
+            usage();
+    }
+    if (repeats < 1 || repeats > MAX_REPEATS)
+        usage();
+
+    if (generator == NULL) //next to this program
+    {
+        char *self = strdup(argv[0]);
+        defaultGenerator = joinPath(dirname(self), "mkexfat");
+        free(self);
+        generator = defaultGenerator;
+    }
+    //the commands run inside the work directory, so every path they get must be absolute
+    mkdir(workDirectory, 0755);
+    if (realpath(binary, binaryPath) == NULL || realpath(generator, generatorPath) == NULL)
+    {
+        fprintf(stderr, "runbench: cannot find %s or %s\n", binary, generator);
+        return EXIT_FAILURE;
+    }
+    free(defaultGenerator);
+    if (realpath(workDirectory, workPath) == NULL)
+    {
+        perror(workDirectory);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+    {
+        bool wanted = selectedCount == 0;
+        for (int i = 0; i < selectedCount; i++)
+            wanted = wanted || strcmp(selected[i], scenarios[s].name) == 0;
+        if (wanted)
+            benchScenario(&scenarios[s], binaryPath, generatorPath, workPath, repeats, quick, countSyscalls);
+    }
+    return EXIT_SUCCESS;
+}
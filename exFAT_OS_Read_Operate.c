@@ -7,717 +7,4403 @@
 // 2. list all the files and directories contained within it (ordered how they are stored)
 // 3. Extract a file from the file system to the directory the program runs in
 //
+// The volume itself is read through the handle based core in exfat.c (see exfat.h).
+//
 //-----------------------------------------
 
+#define _GNU_SOURCE //copy_file_range
+#define _FILE_OFFSET_BITS 64 //64 bit off_t for output files and sendfile on 32 bit builds too
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <time.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
 
-#define FILE_BIT_OFFSET 16          //bit set if file is file, else directory i.e. base 2: 0001 0000
-#define ALLOCATION_BITMAP_ENTRY 129 //0x81
-#define VOLUME_LABEL_ENTRY 131      //0x83
-#define FILE_TYPE_ENTRY 133         //0x85
-#define BYTES_PER_ENTRY 32
+#include "exfat.h"
+#include "hash.h"
 
-#define CLUSTER_INDEX_OFFSET 2
-#define VOLUME_LABEL_CHARS 11
-#define UNICODE_CHARS_PER_ENTRY 15
-#define ASCII_TO_UNICODE_CHAR_RATIO 2
-#define MAX_ASCII_STRING_SIZE 255
+#define PERMISSIONS 0644
+#define DIRECTORY_PERMISSIONS 0755
 
-#define MAX_BYTE_VALUE 255
+#define COPY_BUFFER_BYTES (1024 * 1024) //largest single read/write issued when copying a file
+#define COPY_BUFFER_ALIGNMENT 4096      //page aligned, so the buffer suits O_DIRECT style devices too
+#define KERNEL_COPY_MAX_BYTES 0x7FFFF000 //most Linux moves in one copy_file_range/sendfile call
+#define DEFAULT_QUEUE_DEPTH 32           //copies the asynchronous engines keep in flight
+#define MAX_QUEUE_DEPTH 4096
+#define DEFAULT_IO_BUFFER_KB 512         //size of each of their buffers
+#define DEFAULT_COPY_THREADS 4           //threads copying one large file in chunks
+#define DEFAULT_CHUNK_MB 64              //size of those chunks
+#define HASH_PIPELINE_BUFFERS 4          //blocks copied ahead of the hashing thread
+#define DEFAULT_CACHE_MB 16              //metadata cluster cache of a volume read with pread
+#define BATCH_OPEN_FILES 256             //outputs a batch get keeps open at once
+#define NS_PER_MS 1000000.0
+#define LIST_BUFFER_BYTES (1024 * 1024) //list output is written in blocks of this size
+#define LIST_MAGIC "EXFATLST"
+#define LIST_VERSION 1
+#define INFO_TEXT_BYTES 512
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_REQUEST_BYTES 65536
+#define BITS_PER_WORD 64
 #define BITS_PER_BYTE 8
-#define BYTES_PER_KB 1024
+#define UNICODE_CHARS_PER_ENTRY 15
+#define HISTOGRAM_BUCKETS 32           //power of two buckets, enough for any 32 bit count of clusters or extents
+#define ATTRIBUTE_READ_ONLY 0x01
+#define ATTRIBUTE_HIDDEN 0x02
+#define ATTRIBUTE_SYSTEM 0x04
+#define ATTRIBUTE_ARCHIVE 0x20
+#define UTF8_BYTES_PER_UNIT 3           //most UTF-8 bytes one UTF-16 code unit needs (a surrogate pair needs 4 for its 2)
 
-#define PERMISSIONS 0644
+#define INDEX_MAGIC "EXFATIDX"
+#define INDEX_VERSION 5 //2: path hashes are over up-cased paths, 3: records carry ValidDataLength, 5: directories carry a hash of their contents
+#define INDEX_SUFFIX ".idx"        //default index file is the volume's path plus this
+#define INDEX_MIN_BUCKETS 16
+#define HASH_SEED 0xCBF29CE484222325ULL
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
 
-uint32_t serialNumber;
-uint32_t rootDirectory;  //recall that FAT[X] corresponds to Cluster[X-2]
-uint32_t clstHeapOffset; //offset to data region in sectors
-uint32_t fatOffset;      // in sectors
-uint32_t clusterCount;   // number of clusters
-
-int bytesPerSector;
-int sectorsPerCluster;
-char *volumeLabel;
-char *path; //used for get instruction
-int freeSpaceKB;
-
-typedef enum bool
-{
-    false,
-    true
-} bool;
-
-/**
- * Convert a Unicode-formatted string containing only ASCII characters
- * into a regular ASCII-formatted string (16 bit chars to 8 bit 
- * chars).
- *
- * NOTE: this function does a heap allocation for the string it 
- *       returns, caller is responsible for `free`-ing the allocation
- *       when necessary.
- *
- * uint16_t *unicode_string: the Unicode-formatted string to be 
- *                           converted.
- * uint8_t   length: the length of the Unicode-formatted string (in
- *                   characters).
- *
- * returns: a heap allocated ASCII-formatted string.
- */
-static char *unicode2ascii(uint16_t *unicode_string, uint8_t length)
-{
-    assert(unicode_string != NULL);
-    assert(length > 0);
-    
-    char *ascii_string = NULL;
-
-    if (unicode_string != NULL && length > 0)
-    {
-        // +1 for a NULL terminator
-        ascii_string = calloc(sizeof(char), length + 1);
-
-        if (ascii_string)
-        {
-            // strip the top 8 bits from every character in the
-            // unicode string
-            for (uint8_t i = 0; i < length; i++)
-            {
-                ascii_string[i] = (char)unicode_string[i];
-            }
-            // stick a null terminator at the end of the string.
-            ascii_string[length] = '\0';
-        }
-    }
+//how extracted data is moved, chosen with --io
+typedef enum ioEngine
+{
+    IO_SYNC,   //one extent at a time with copy_file_range/sendfile/pwrite
+    IO_URING,  //many blocks in flight through io_uring
+    IO_THREADS //many blocks in flight on a pool of threads doing blocking calls
+} ioEngine;
 
-    return ascii_string;
-}
+//how list prints entries, chosen with --format
+typedef enum listFormat
+{
+    LIST_TEXT,   //a dash per level, the entry type and the name
+    LIST_NDJSON, //one JSON object per line
+    LIST_BINARY  //a listHeader, then per entry a listRecord followed by its path
+} listFormat;
 
-//input: file descriptor of exFAT volume
-void getSerialNumber(int fd)
+//start of a binary listing
+typedef struct listHeader
 {
-    lseek(fd, 100, SEEK_SET);
-    read(fd, &serialNumber, 4);
-}
+    char magic[8];        //LIST_MAGIC
+    uint32_t version;     //LIST_VERSION
+    uint32_t recordBytes; //sizeof(listRecord), so readers can check it
+} listHeader;
 
-//input: file descriptor of exFAT volume
-void getRootDirectory(int fd)
+//one entry of a binary listing (little endian), followed by pathLength bytes of UTF-8 path without a terminator
+typedef struct listRecord
 {
-    lseek(fd, 96, SEEK_SET);
-    read(fd, &rootDirectory, 4);
-}
+    uint64_t dataLength;
+    int64_t createdMs;  //milliseconds since 1970 (UTC when the volume recorded an offset), 0 if not set
+    int64_t modifiedMs;
+    int64_t accessedMs;
+    uint32_t firstCluster;
+    uint32_t extentCount;
+    uint32_t pathLength;
+    uint16_t attributes;
+    uint8_t generalFlags; //holds NO_FAT_CHAIN_FLAG
+    uint8_t reserved;
+} listRecord;
 
-//return offset in bytes from start of volume to cluster
-long findOffsetToCluster(int cluster)
+//list output gathered in a large buffer so it goes out in few writes, and the path of the entry being listed
+typedef struct listOutput
 {
-    long offset = (clstHeapOffset + ((cluster - CLUSTER_INDEX_OFFSET) * sectorsPerCluster)) * bytesPerSector;
-    return offset;
-}
+    listFormat format;
+    int fd;             //where the output goes
+    bool chunked;       //every write is framed as a server response chunk
+    char *buffer;       //LIST_BUFFER_BYTES
+    size_t length;      //bytes waiting in buffer
+    char *path;         //UTF-8, not null terminated. only kept for the machine readable formats
+    size_t pathLength;
+    size_t pathCapacity;
+    bool failed;        //a write failed (full disk, closed pipe), the rest of the output is dropped
+} listOutput;
+
+//what the extents command adds up over the whole volume
+typedef struct fragmentationReport
+{
+    const uint32_t *runs;                          //from buildFatRuns
+    uint64_t files;
+    uint64_t fragmentedFiles;                      //more than one extent
+    uint64_t fileExtents;
+    uint64_t extentCountHistogram[HISTOGRAM_BUCKETS]; //files by number of extents, see histogramBucket
+    uint64_t extentSizeHistogram[HISTOGRAM_BUCKETS];  //file extents by clusters
+    uint64_t freeSizeHistogram[HISTOGRAM_BUCKETS];    //free space extents by clusters
+} fragmentationReport;
+
+//a directory the verify command still has to check
+typedef struct verifyDirectory
+{
+    uint32_t firstCluster;
+    uint64_t dataLength; //0 for the root directory, whose chain is followed to its end
+    bool noFatChain;
+    char *path;          //ends with '/' except for the root, which is ""
+} verifyDirectory;
+
+//what the verify threads share
+typedef struct verifier
+{
+    const exfatVolume *volume;
+    const uint32_t *runs;       //from buildFatRuns
+    uint64_t *referenced;       //a bit per cluster of the heap, set with atomic ORs as chains claim clusters
+    uint64_t *allocated;        //the allocation bitmap, same layout
+    uint64_t words;             //in each of them
+    verifyDirectory *level;     //directories of the tree level being checked
+    size_t levelCount;
+    size_t nextDirectory;       //taken with an atomic add
+    verifyDirectory *nextLevel; //their subdirectories, guarded by lock
+    size_t nextLevelCount;
+    size_t nextLevelCapacity;
+    pthread_mutex_t lock;       //also keeps each problem report whole
+    uint64_t directories;       //these counters are atomic
+    uint64_t entrySets;
+    uint64_t chainClusters;
+    uint64_t problems;          //guarded by lock
+} verifier;
+
+//what the find command looks for, from --name, --path, --type, --min-size, --max-size and --attr
+typedef struct findQuery
+{
+    const char *name;    //glob for the last component of the path, NULL for any
+    const char *path;    //glob for the whole path from the root, "**" standing for any number of directories, NULL for any
+    int type;            //'f' for files, 'd' for directories, 0 for both
+    uint64_t minSize;
+    uint64_t maxSize;
+    uint16_t attributes; //all of these must be set
+} findQuery;
+
+//a directory a parallel find still has to search
+typedef struct findDirectory
+{
+    uint32_t firstCluster;
+    uint64_t dataLength; //0 for the root directory
+    bool noFatChain;
+    char *path;          //UTF-8 from the root, not null terminated
+    size_t pathLength;
+} findDirectory;
+
+//what the find threads share
+typedef struct finder
+{
+    exfatVolume *volume;
+    const findQuery *query;
+    listFormat format;
+    int threadCount;
+    char *name;               //the query's patterns up-cased like the names they are matched with
+    char *pathText;
+    char **pathComponents;    //pointers into pathText, NULL without --path
+    int pathComponentCount;
+    findDirectory *level;     //directories of the tree level being searched
+    size_t levelCount;
+    size_t nextDirectory;     //taken with an atomic add
+    findDirectory *nextLevel; //their subdirectories, guarded by lock
+    size_t nextLevelCount;
+    size_t nextLevelCapacity;
+    pthread_mutex_t lock;     //also keeps standard output whole
+} finder;
+
+//blocks of one file on their way from the copy to the hashing thread of copyAndHash, in file order
+typedef struct hashPipeline
+{
+    hashState hash;
+    const uint8_t *blocks[HASH_PIPELINE_BUFFERS]; //each slot's data: in the volume's mapping, the slot's buffer or a block of zeros
+    size_t lengths[HASH_PIPELINE_BUFFERS];
+    uint8_t *buffers[HASH_PIPELINE_BUFFERS];      //COPY_BUFFER_BYTES each, only read into when the volume is not mapped
+    uint64_t queued;                              //blocks handed to the hashing thread, the next goes in slot queued % HASH_PIPELINE_BUFFERS
+    uint64_t hashed;                              //blocks it has finished with
+    bool finished;                                //no more blocks will be queued
+    pthread_mutex_t lock;
+    pthread_cond_t changed;                       //broadcast whenever queued, hashed or finished changes
+} hashPipeline;
+
+//copy `length` bytes at `volumeOffset` on the volume to `fileOffset` in the file `out`
+typedef struct copyRequest
+{
+    int out;
+    uint64_t volumeOffset;
+    uint64_t fileOffset;
+    uint64_t length;
+} copyRequest;
+
+//one directory of a parallel list: where it is on disk and, once a worker has read it, what it prints
+typedef struct listNode
+{
+    uint32_t firstCluster;
+    uint64_t dataLength;
+    bool noFatChain;
+    int levels;
+    char *path;                 //full path of the directory, "" for the root
+    char **lines;               //one output line per entry, in on-disk order
+    struct listNode **children; //children[i] is the directory named by lines[i], NULL for files
+    int entryCount;
+} listNode;
+
+//a worker's queue of directories still to read. the owner takes from the tail, other workers steal from the head
+typedef struct workQueue
+{
+    listNode **tasks;
+    int head;
+    int tail;
+    int capacity;
+    pthread_mutex_t lock;
+} workQueue;
+
+//shared state of the parallel list workers
+typedef struct listPool
+{
+    exfatVolume *volume;
+    workQueue *queues; //one per worker
+    int threadCount;
+    bool unordered;
+    int queued;        //tasks waiting in the queues (protected by lock)
+    int pending;       //tasks waiting or being read (protected by lock), the walk is over at 0
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_mutex_t outputLock; //unordered mode: keeps each directory's lines together
+} listPool;
+
+typedef struct listWorker
+{
+    listPool *pool;
+    int index;
+} listWorker;
+
+//start of a sidecar path index file. followed by bucketCount buckets, recordCount records and the path strings
+typedef struct indexHeader
+{
+    char magic[8];             //INDEX_MAGIC
+    uint32_t version;          //INDEX_VERSION
+    uint32_t serialNumber;     //of the volume the index describes
+    uint64_t metadataChecksum; //see metadataChecksum, a mismatch means the index is stale
+    uint64_t rootContents;     //hashBytes of the root directory, see indexPathCurrent
+    uint32_t recordCount;
+    uint32_t bucketCount;      //power of two, each bucket holds a record number + 1 (0 is empty)
+} indexHeader;
+
+//an io_uring instance set up by uringOpen, with its rings mapped
+typedef struct uringQueue
+{
+    int fd;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingBytes;
+    size_t cqRingBytes; //0 when the completion ring shares the submission ring's mapping
+    size_t sqesBytes;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#else
+    void *sqes;
+#endif
+} uringQueue;
+
+//one buffer of the io_uring engine and the block it is moving
+typedef struct uringSlot
+{
+    uint8_t *buffer;
+    copyRequest block;
+    uint64_t done;   //bytes of the current read or write completed
+    bool writing;    //the block has been read, now it is being written
+    bool busy;
+} uringSlot;
+
+//work shared by the threads of the thread pool engine
+typedef struct copyPool
+{
+    const exfatVolume *volume;
+    const copyRequest *blocks;
+    size_t blockCount;
+    size_t nextBlock; //taken with an atomic add
+    uint64_t blockBytes;
+    int error;        //first errno seen, stops the workers
+} copyPool;
+
+//work shared by the threads copying one large file, see copyChunks
+typedef struct chunkPool
+{
+    const exfatVolume *volume;
+    const char *name;          //of the output, each thread opens its own descriptor
+    const copyRequest *chunks;
+    size_t chunkCount;
+    size_t nextChunk;          //taken with an atomic add
+    int error;                 //first errno seen, stops the workers
+} chunkPool;
+
+//one file or directory in the path index
+typedef struct indexRecord
+{
+    uint64_t pathHash;
+    uint64_t dataLength;
+    uint64_t validDataLength;
+    uint64_t contents;   //directories: hashBytes of the directory as stored, see indexPathCurrent. 0 for files
+    uint32_t pathOffset; //into the string table, paths are null terminated
+    uint32_t pathLength;
+    uint32_t firstCluster;
+    uint16_t attributes;
+    uint8_t generalFlags; //holds NO_FAT_CHAIN_FLAG
+    uint8_t reserved;
+} indexRecord;
+
+//an index while it is being built
+typedef struct indexBuilder
+{
+    indexRecord *records;
+    uint32_t recordCount;
+    uint32_t recordCapacity;
+    char *strings;
+    uint32_t stringsLength;
+    uint32_t stringsCapacity;
+} indexBuilder;
+
+//one path asked for by a batch get
+typedef struct batchTarget
+{
+    char *key;      //normalised and up-cased, what the walk compares against
+    char *original; //as the user typed it, for messages
+    bool found;
+} batchTarget;
+
+//one file a batch get will write
+typedef struct batchJob
+{
+    char *outputPath;
+    uint32_t firstCluster;
+    uint64_t dataLength;
+    uint64_t validDataLength; //pieces stop here, the rest of the output is a hole
+    bool noFatChain;
+    bool opened; //the output has been created (and truncated) already
+    int fd;      //open output while its pieces are being copied, -1 otherwise
+} batchJob;
+
+//a contiguous part of a batch job's data, the unit batchExtract sorts by position on the volume
+typedef struct batchPiece
+{
+    uint64_t diskOffset;
+    uint64_t fileOffset;
+    uint64_t length;
+    int job;
+} batchPiece;
+
+//everything a batch get resolves before reading any data
+typedef struct batchPlan
+{
+    exfatVolume *volume;
+    const char *destination;
+    batchTarget *targets; //sorted by key
+    int targetCount;
+    batchJob *jobs;
+    int jobCount;
+    int jobCapacity;
+} batchPlan;
+
+//what the diff command works from while walking both trees
+typedef struct differ
+{
+    exfatVolume *newer;
+    exfatVolume *older;
+    const uint32_t *runs;     //from buildFatRuns of the newer volume
+    uint64_t *changed;        //a bit per cluster of the heap whose allocation bit or FAT entry differs between the volumes
+    uint64_t changedClusters;
+    listOutput *output;       //holds the path of the entry being reported
+    batchPlan *plan;          //added and modified files to extract, NULL without --dest
+    uint64_t added;
+    uint64_t modified;
+    uint64_t deleted;
+} differ;
+
+//first byte of every server response
+typedef enum serverStatus
+{
+    SERVER_OK,
+    SERVER_NOT_FOUND,  //no such path, or get of a directory
+    SERVER_BAD_REQUEST
+} serverStatus;
+
+//one file or directory of the tree the server keeps in memory
+typedef struct serverNode
+{
+    dirEntry *entry; //heap copy holding only nameLength characters of name, NULL for the root directory
+    char *key;       //full path up-cased, what lookups compare against
+    int parent;
+    int firstChild;  //a directory's children are stored next to each other
+    int childCount;
+} serverNode;
+
+//everything the server keeps warm, read-only once serve has built it
+typedef struct serverState
+{
+    exfatVolume *volume;
+    serverNode *nodes;   //nodes[0] is the root directory
+    int nodeCount;
+    uint32_t *buckets;   //power of two, each bucket holds a node number + 1 (0 is empty), hashed by key
+    uint32_t bucketCount;
+    char *info;          //output of the info command
+} serverState;
+
+typedef struct serverClient
+{
+    serverState *server;
+    int fd;
+} serverClient;
+
+bool useMmap = true;      //cleared by --no-mmap
+int listThreads = 1;      //--threads=N, threads used by the list command
+bool listUnordered;       //--unordered, stream list output as directories are read
+char *indexFile;          //--index[=PATH], sidecar path index used by get
+char *batchDestination;   //--dest=DIR, batch get writes below this directory
+char *batchPathFile;      //--from=FILE, batch get reads more paths from this file
+bool useCopyRange = true; //atomic, cleared once copy_file_range fails (other file system, block device, old kernel...)
+bool useSendfile = true;  //atomic, cleared once sendfile fails
+listFormat listFormatChoice = LIST_TEXT;                     //--format=text|ndjson|binary
+ioEngine ioEngineChoice = IO_SYNC;                           //--io=sync|uring|threads
+int ioQueueDepth = DEFAULT_QUEUE_DEPTH;                      //--queue-depth=N
+uint64_t ioBlockBytes = DEFAULT_IO_BUFFER_KB * BYTES_PER_KB; //--io-buffer-kb=N
+int copyThreads = DEFAULT_COPY_THREADS;                      //--copy-threads=N, 1 copies large files on one thread
+uint64_t copyChunkBytes = (uint64_t)DEFAULT_CHUNK_MB * BYTES_PER_KB * BYTES_PER_KB; //--chunk-mb=N
+int cacheMegabytes = DEFAULT_CACHE_MB;                       //--cache-mb=N, 0 for no cache
+hashAlgorithm hashChoice = HASH_NONE;                        //--hash=sha256|xxh64, digest of every extracted file
+findQuery findChoice = {NULL, NULL, 0, 0, UINT64_MAX, 0};    //--name, --path, --type, --min-size, --max-size and --attr of find
+bool statsJson;                        //--stats=json
+const char *statPhaseNames[PHASE_COUNT] = {"boot_sector", "fat_load", "volume_label", "bitmap_scan", "tree_walk", "data_copy"};
+const char *statCounterNames[STAT_COUNTER_COUNT] = {"read_calls", "lseek_calls", "bytes_read", "kernel_copies", "write_calls", "bytes_written",
+                                                    "fat_lookups", "clusters_visited", "directories_read", "entry_sets", "name_allocations",
+                                                    "cache_hits", "cache_misses", "sparse_bytes", "bytes_hashed"};
 
 //------------------------------------------------------
-// clusterHeapOffset
+// printStats
 //
-// PURPOSE: Find the offset in sectors the beginning of the cluster heap / data region as well as the count of clusters in the volume and set the global variable to the appropriate value
+// PURPOSE: Report the --stats phase times and counters on stderr (stdout carries the command's own output), as aligned text or as one JSON object
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume
+//     statsClock() taken at the start of the run
 //------------------------------------------------------
-void clusterHeapOffset(int fd)
+void printStats(uint64_t runStart)
+{
+    double totalMs = (statsClock() - runStart) / NS_PER_MS;
+
+    if (statsJson)
+    {
+        fprintf(stderr, "{\"total_ms\":%.3f,\"phases_ms\":{", totalMs);
+        for (int i = 0; i < PHASE_COUNT; i++)
+            fprintf(stderr, "%s\"%s\":%.3f", i > 0 ? "," : "", statPhaseNames[i], statPhaseNs[i] / NS_PER_MS);
+        fprintf(stderr, "},\"counters\":{");
+        for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+            fprintf(stderr, "%s\"%s\":%llu", i > 0 ? "," : "", statCounterNames[i], (unsigned long long)statCounts[i]);
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-18s %12.3f ms\n", "total", totalMs);
+    for (int i = 0; i < PHASE_COUNT; i++)
+        fprintf(stderr, "%-18s %12.3f ms\n", statPhaseNames[i], statPhaseNs[i] / NS_PER_MS);
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+        fprintf(stderr, "%-18s %12llu\n", statCounterNames[i], (unsigned long long)statCounts[i]);
+}
+
+//input: a file descriptor (file, pipe or socket), bytes to write and how many
+//returns true if every byte was written. a closed socket is an error, not a SIGPIPE
+bool writeAll(int fd, const void *data, size_t length)
 {
-    lseek(fd, 88, SEEK_SET);
-    read(fd, &clstHeapOffset, 4);
-    read(fd, &clusterCount, 4);
+    while (length > 0)
+    {
+        ssize_t result = send(fd, data, length, MSG_NOSIGNAL);
+        if (result < 0 && errno == ENOTSOCK)
+            result = write(fd, data, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        data = (const char *)data + result;
+        length -= result;
+    }
+    return true;
 }
 
-//------------------------------------------------------
-// sectorsPerClus
-//
-// PURPOSE: Find how many sectors there are per cluster and set the global variable to the appropriate value
-// INPUT PARAMETERS:
-//     file descriptor of exFAT volume
-// OUTPUT PARAMETERS:
-//      number of unset bits (0 - 8)
-//------------------------------------------------------
-void sectorsPerClus(int fd)
+//input: list output, bytes to write and how many
+//writes them straight out, as one chunk (a 32 bit little endian length, then the bytes) when the output is chunked
+void writeListBlock(listOutput *output, const void *data, size_t length)
+{
+    uint32_t chunkLength = length;
+
+    if (length == 0 || output->failed) //an empty chunk would end a chunked response
+        return;
+    if (output->chunked && !writeAll(output->fd, &chunkLength, sizeof(chunkLength)))
+        output->failed = true;
+    else if (!writeAll(output->fd, data, length))
+        output->failed = true;
+}
+
+//input: list output
+//writes out everything waiting in the buffer
+void flushList(listOutput *output)
 {
-    uint8_t powerOfTwoClst;     // 2^powerOfTwoClst = sectors per cluster
-    uint8_t powerOfTwoSecBytes; // 2^powerOfTwoSecBytes = bytes per sector
-    int sctPerClst = 1;         // minimum
-    int bytesPerSec = 1;        // minimum
-    int sizeInBytesOfCluster;
+    writeListBlock(output, output->buffer, output->length);
+    output->length = 0;
+}
 
-    lseek(fd, 108, SEEK_SET);
-    read(fd, &powerOfTwoSecBytes, 1);
-    // 2 ^ powerOfTwoSecBytes
-    bytesPerSec = bytesPerSec << powerOfTwoSecBytes;
-    bytesPerSector = bytesPerSec;
-    read(fd, &powerOfTwoClst, 1);
-    //2 ^ powerOfTwoClst
-    sctPerClst = sctPerClst << powerOfTwoClst;
-    sectorsPerCluster = sctPerClst;
-    sizeInBytesOfCluster = sctPerClst * bytesPerSec;
+//input: list output, how many bytes are about to be added (at most LIST_BUFFER_BYTES)
+//returns where to put them, flushing first if they do not fit. the caller adds what it used to output->length
+char *reserveList(listOutput *output, size_t bytes)
+{
+    if (output->length + bytes > LIST_BUFFER_BYTES)
+        flushList(output);
+    return output->buffer + output->length;
 }
 
-//input: file descriptor of exFAT volume
-void getFatOffset(int fd)
+//input: list output, bytes to add and how many
+void writeList(listOutput *output, const void *data, size_t length)
 {
-    lseek(fd, 80, SEEK_SET);
-    read(fd, &fatOffset, 4);
+    if (length > LIST_BUFFER_BYTES) //too big to buffer, goes straight out after what is waiting
+    {
+        flushList(output);
+        writeListBlock(output, data, length);
+        return;
+    }
+    memcpy(reserveList(output, length), data, length);
+    output->length += length;
 }
 
-//input: file descriptor of exFAT volume and the current cluster
-//this returns the value stored at FAT[currCluster].
-//recall that the correct cluster index is the value returned - 2 for historical reasons.
-uint32_t nextCluster(int fd, uint32_t currCluster)
+//input: list output, a number
+//adds the number in decimal
+void writeDecimal(listOutput *output, int64_t number)
 {
-    uint32_t next;
+    char digits[24];
+    int position = sizeof(digits);
+    uint64_t magnitude = number < 0 ? -(uint64_t)number : (uint64_t)number;
+
+    do
+    {
+        digits[--position] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (number < 0)
+        digits[--position] = '-';
+    writeList(output, digits + position, sizeof(digits) - position);
+}
 
-    lseek(fd, fatOffset * bytesPerSector, SEEK_SET); //to start of FAT
-    lseek(fd, 4 * currCluster, SEEK_CUR);            //to correct FAT index. each cluster in fat is 4 bytes
-    read(fd, &next, 4);
+//input: list output, the path of the entry as a JSON string with quotes
+void writeJsonPath(listOutput *output)
+{
+    size_t runStart = 0;
 
-    return next;
+    writeList(output, "\"", 1);
+    for (size_t i = 0; i < output->pathLength; i++)
+    {
+        unsigned char character = output->path[i];
+        if (character >= 0x20 && character != '"' && character != '\\')
+            continue;
+        char escape[7];
+        writeList(output, output->path + runStart, i - runStart);
+        if (character == '"' || character == '\\')
+            snprintf(escape, sizeof(escape), "\\%c", character);
+        else
+            snprintf(escape, sizeof(escape), "\\u%04x", character);
+        writeList(output, escape, strlen(escape));
+        runStart = i + 1;
+    }
+    writeList(output, output->path + runStart, output->pathLength - runStart);
+    writeList(output, "\"", 1);
 }
 
 //------------------------------------------------------
-// getVolumeLabel
+// appendPathName
 //
-// PURPOSE: Set the global volume label string to the appropriate label
+// PURPOSE: Add an entry's name to the path kept in the list output, converted from UTF-16 to UTF-8 (a lone surrogate becomes U+FFFD)
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume
+//     list output holding the parent directory's path, the entry
 //------------------------------------------------------
-void getVolumeLabel(int fd)
+void appendPathName(listOutput *output, const dirEntry *file)
 {
-    uint16_t unicodeString[VOLUME_LABEL_CHARS];
-    uint8_t length;
-    uint8_t entryType;
-    bool found = false;
-    long bytesReadInCluster = 0;
-    uint32_t currCluster = rootDirectory;
-    lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-    while (!found)
+    size_t needed = output->pathLength + 1 + file->nameLength * UTF8_BYTES_PER_UNIT;
+    char *position;
+
+    if (needed > output->pathCapacity)
+    {
+        output->pathCapacity = needed * 2;
+        output->path = realloc(output->path, output->pathCapacity);
+        assert(output->path != NULL);
+    }
+    position = output->path + output->pathLength;
+    if (output->pathLength > 0)
+        *position++ = '/';
+    for (int i = 0; i < file->nameLength; i++)
     {
-        read(fd, &entryType, 1);
-        bytesReadInCluster += 1;
-        if (entryType == VOLUME_LABEL_ENTRY)
+        uint32_t character = file->name[i];
+        if (character >= 0xD800 && character <= 0xDBFF && i + 1 < file->nameLength && file->name[i + 1] >= 0xDC00 && file->name[i + 1] <= 0xDFFF)
+            character = 0x10000 + ((character - 0xD800) << 10) + (file->name[++i] - 0xDC00);
+        else if (character >= 0xD800 && character <= 0xDFFF)
+            character = 0xFFFD;
+
+        if (character < 0x80)
         {
-            found = true;
+            *position++ = character;
         }
-        else
+        else if (character < 0x800)
         {
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInCluster, SEEK_CUR);
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInCluster;
+            *position++ = 0xC0 | (character >> 6);
+            *position++ = 0x80 | (character & 0x3F);
         }
-
-        if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
+        else if (character < 0x10000)
+        {
+            *position++ = 0xE0 | (character >> 12);
+            *position++ = 0x80 | ((character >> 6) & 0x3F);
+            *position++ = 0x80 | (character & 0x3F);
+        }
+        else
         {
-            currCluster = nextCluster(fd, currCluster);
-            lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-            bytesReadInCluster = 0;
+            *position++ = 0xF0 | (character >> 18);
+            *position++ = 0x80 | ((character >> 12) & 0x3F);
+            *position++ = 0x80 | ((character >> 6) & 0x3F);
+            *position++ = 0x80 | (character & 0x3F);
         }
     }
-    read(fd, &length, 1);
-    read(fd, &unicodeString, length * ASCII_TO_UNICODE_CHAR_RATIO);
-    volumeLabel = unicode2ascii(unicodeString, length);
+    output->pathLength = position - output->path;
 }
 
 //------------------------------------------------------
-// countOffBits
+// writeListEntry
 //
-// PURPOSE: Count how many bits of a byte are unset
+// PURPOSE: Add one entry to the list output in the chosen format. Text is a dash per level, the entry type and the name. NDJSON and binary records carry the full path, size, first cluster, attributes, timestamps and number of extents.
 // INPUT PARAMETERS:
-//     the byte
-// OUTPUT PARAMETERS:
-//      number of unset bits (0 - 8)
+//     the volume, list output (holding the entry's path for the machine readable formats), the entry, how many levels below the root it is
 //------------------------------------------------------
-long countOffBits(uint8_t byte)
+void writeListEntry(const exfatVolume *volume, listOutput *output, const dirEntry *file, int levels)
 {
-    long count = 0;
-    uint8_t myByte = byte;
-    for (int x = 1; x <= MAX_BYTE_VALUE; x = x << 1)
+    if (output->format == LIST_TEXT)
+    {
+        const char *tag = file->directory ? "Directory: " : "File: ";
+        for (int i = 0; i < levels; i++)
+            writeList(output, "-", 1);
+        writeList(output, tag, strlen(tag));
+        char *name = reserveList(output, file->nameLength + 1);
+        int length = 0;
+        while (length < file->nameLength && (char)file->name[length] != '\0') //same bytes unicode2ascii would give
+        {
+            name[length] = (char)file->name[length];
+            length++;
+        }
+        name[length++] = '\n';
+        output->length += length;
+        return;
+    }
+
+    uint32_t extentCount = countExtents(volume, file->firstCluster, file->dataLength, file->noFatChain);
+    int64_t createdMs = timestampToUnixMs(file->createTimestamp, file->create10ms, file->createUtcOffset);
+    int64_t modifiedMs = timestampToUnixMs(file->modifyTimestamp, file->modify10ms, file->modifyUtcOffset);
+    int64_t accessedMs = timestampToUnixMs(file->accessTimestamp, 0, file->accessUtcOffset);
+
+    if (output->format == LIST_BINARY)
     {
-        if ((x & myByte) == 0)
-            count++;
+        listRecord record = {file->dataLength, createdMs, modifiedMs, accessedMs, file->firstCluster, extentCount,
+                             output->pathLength, file->attributes, file->generalFlags, 0};
+        writeList(output, &record, sizeof(record));
+        writeList(output, output->path, output->pathLength);
+        return;
     }
-    return count;
+
+    writeList(output, "{\"path\":", 8);
+    writeJsonPath(output);
+    writeList(output, file->directory ? ",\"type\":\"directory\",\"size\":" : ",\"type\":\"file\",\"size\":", file->directory ? 27 : 22);
+    writeDecimal(output, file->dataLength);
+    writeList(output, ",\"first_cluster\":", 17);
+    writeDecimal(output, file->firstCluster);
+    writeList(output, ",\"attributes\":", 14);
+    writeDecimal(output, file->attributes);
+    writeList(output, ",\"no_fat_chain\":", 16);
+    writeList(output, file->noFatChain ? "true" : "false", file->noFatChain ? 4 : 5);
+    writeList(output, ",\"extents\":", 11);
+    writeDecimal(output, extentCount);
+    writeList(output, ",\"created_ms\":", 14);
+    writeDecimal(output, createdMs);
+    writeList(output, ",\"modified_ms\":", 15);
+    writeDecimal(output, modifiedMs);
+    writeList(output, ",\"accessed_ms\":", 15);
+    writeDecimal(output, accessedMs);
+    writeList(output, "}\n", 2);
 }
 
 //------------------------------------------------------
-// getEmptys
+// listRecurse
 //
-// PURPOSE: Count the unset bits of the bitmap to find unused cluster count
+// PURPOSE: Traverse the file system in a depth first manner. When a directory is found print the name and then find and print the file/directories it contains recursively
 // INPUT PARAMETERS:
-//     the offset to the bitmap (start of cluster), file descriptor of exFAT volume, the cluster to start at
+//     the volume, list output, the cluster to look at (start with the root directory in general), DataLength of the directory (0 for the root), NoFatChain flag of the directory, how many levels have been searched (0 to start)
 //------------------------------------------------------
-void getEmptys(long offset, int fd, uint32_t currCluster)
+void listRecurse(exfatVolume *volume, listOutput *output, uint32_t firstCluster, uint64_t dataLength, bool noFatChain, int levels)
 {
-    uint8_t currByte;
-    long emptys = 0;
-    lseek(fd, offset, SEEK_SET);
-    int bytesReadInCluster = 0;
+    dirIterator directoryIterator;
+    dirEntry file;
+    size_t parentLength = output->pathLength;
 
-    for (int i = 0; i < (int)(clusterCount / BITS_PER_BYTE); i++)
+    openDirectory(volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+    while (nextDirEntry(&directoryIterator, &file))
     {
-        read(fd, &currByte, 1);
-        emptys += countOffBits(currByte);
-        if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
+        if (output->format != LIST_TEXT)
+            appendPathName(output, &file);
+        writeListEntry(volume, output, &file, levels);
+        if (file.directory)
         {
-            currCluster = nextCluster(fd, currCluster);
-            lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-            bytesReadInCluster = 0;
+            listRecurse(volume, output, file.firstCluster, file.dataLength, file.noFatChain, levels + 1);
         }
-    }
-    long freeSpace = emptys * sectorsPerCluster * bytesPerSector;
-    freeSpaceKB = freeSpace / BYTES_PER_KB;
+        output->pathLength = parentLength;
+    } //while more files at this level
+    closeDirectory(&directoryIterator);
 }
+
 //------------------------------------------------------
-// allocationBitMap
+// list
 //
-// PURPOSE: Find where the desired allocation bit map entry is.
+// PURPOSE: Execute the list command on one thread, all output going through one large buffer
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume
+//     the volume, the output format
 //------------------------------------------------------
-void allocationBitMap(int fd)
+void list(exfatVolume *volume, listFormat format)
 {
-    int myOffset = (clstHeapOffset + ((rootDirectory - CLUSTER_INDEX_OFFSET) * sectorsPerCluster)) * bytesPerSector;
-    uint8_t entryType;
-    bool found = false;
-    uint32_t firstCluster;
-    uint32_t currCluster = rootDirectory;
-    int bytesOffset;
+    listOutput output = {format, STDOUT_FILENO, false, malloc(LIST_BUFFER_BYTES), 0, NULL, 0, 0, false};
+    assert(output.buffer != NULL);
 
-    long bytesReadInCluster = 0;
-    lseek(fd, myOffset, SEEK_SET);
-    while (!found) //search for allocation bit map entry
+    if (format == LIST_BINARY)
     {
-        read(fd, &entryType, 1);
-        bytesReadInCluster += 1;
-
-        if (entryType == ALLOCATION_BITMAP_ENTRY)
-        {
-            found = true;
-
-            lseek(fd, 19, SEEK_CUR);
-            bytesReadInCluster += 19;
-            read(fd, &firstCluster, 4);
-            bytesOffset = (clstHeapOffset + (firstCluster - CLUSTER_INDEX_OFFSET)) * bytesPerSector;
-
-            getEmptys(bytesOffset, fd, currCluster);
-        }
-        else
-        {
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInCluster, SEEK_CUR);
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInCluster;
-        }
-        if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-        {
-            currCluster = nextCluster(fd, currCluster);
-            lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-            bytesReadInCluster = 0;
-        }
+        listHeader header = {LIST_MAGIC, LIST_VERSION, sizeof(listRecord)};
+        writeList(&output, &header, sizeof(header));
     }
+    listRecurse(volume, &output, volume->rootDirectory, 0, false, 0); //the root directory always uses the FAT
+    flushList(&output);
+    free(output.buffer);
+    free(output.path);
 }
 
-//------------------------------------------------------
-// info
-//
-// PURPOSE: Called to execute the info command
-// INPUT PARAMETERS:
-//     file descriptor of exFAT volume
-//------------------------------------------------------
-void info(int fd)
+//input: a count of at least 1
+//returns its histogram bucket: bucket k counts values from 2^k to 2^(k+1) - 1
+int histogramBucket(uint64_t value)
 {
-    getSerialNumber(fd);
-    getRootDirectory(fd);
-    sectorsPerClus(fd);
-    clusterHeapOffset(fd);
-    getFatOffset(fd);
-    getVolumeLabel(fd);
-    allocationBitMap(fd);
+    return 63 - __builtin_clzll(value);
 }
 
 //------------------------------------------------------
-// listRecurse
+// fileFragmentation
 //
-// PURPOSE: Traverse the file system in a depth first manner. When a directory is found print the name and then find and print the file/directories it contains recursively
+// PURPOSE: Report how one file is laid out: a line (or NDJSON object) with its extent count, largest and smallest extent, size and path, and add it to the volume's totals
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume, the cluster to look at (start with rootDirectory in general), how many levels have been searched (0 to start)
+//     the volume, list output holding the file's path, the totals, the file's entry set
 //------------------------------------------------------
-void listRecurse(int fdOrig, int firstCluster, int levels)
+void fileFragmentation(const exfatVolume *volume, listOutput *output, fragmentationReport *report, const dirEntry *file)
 {
-    int fd = fdOrig; //we will keep a second file pointer so that when we return from the recusive call the pointer is not affected
-    int currCluster = firstCluster;
+    uint64_t clustersWanted = (file->dataLength + volume->bytesPerCluster - 1) / volume->bytesPerCluster;
+    uint64_t clusters = 0;
+    uint64_t largest = 0;
+    uint64_t smallest = 0;
+    int extentCount;
+    extent *extents;
 
-    //include bytes we 'skip' over in order to track whether to go to next cluster/entry or not
-    int bytesReadInCluster = 0;
-    int bytesReadInEntry = 0;
-    char* asciiString;
+    if (file->noFatChain)
+        extents = fileExtents(volume, file->firstCluster, file->dataLength, true, &extentCount);
+    else
+        extents = runExtents(volume, report->runs, file->firstCluster, clustersWanted, &extentCount);
+    for (int i = 0; i < extentCount; i++)
+    {
+        clusters += extents[i].count;
+        if (extents[i].count > largest)
+            largest = extents[i].count;
+        if (i == 0 || extents[i].count < smallest)
+            smallest = extents[i].count;
+        report->extentSizeHistogram[histogramBucket(extents[i].count)]++;
+    }
+    free(extents);
+    report->files++;
+    report->fileExtents += extentCount;
+    if (extentCount > 1)
+        report->fragmentedFiles++;
+    if (extentCount > 0)
+        report->extentCountHistogram[histogramBucket(extentCount)]++;
 
-    bool done = false;
+    if (output->format == LIST_NDJSON)
+    {
+        writeList(output, "{\"type\":\"file\",\"path\":", 22);
+        writeJsonPath(output);
+        writeList(output, ",\"size\":", 8);
+        writeDecimal(output, file->dataLength);
+        writeList(output, ",\"clusters\":", 12);
+        writeDecimal(output, clusters);
+        writeList(output, ",\"extents\":", 11);
+        writeDecimal(output, extentCount);
+        writeList(output, ",\"largest_extent_bytes\":", 24);
+        writeDecimal(output, largest * volume->bytesPerCluster);
+        writeList(output, ",\"smallest_extent_bytes\":", 25);
+        writeDecimal(output, smallest * volume->bytesPerCluster);
+        writeList(output, "}\n", 2);
+    }
+    else
+    {
+        writeDecimal(output, extentCount);
+        writeList(output, "\t", 1);
+        writeDecimal(output, largest * volume->bytesPerCluster);
+        writeList(output, "\t", 1);
+        writeDecimal(output, smallest * volume->bytesPerCluster);
+        writeList(output, "\t", 1);
+        writeDecimal(output, file->dataLength);
+        writeList(output, "\t", 1);
+        writeList(output, output->path, output->pathLength);
+        writeList(output, "\n", 1);
+    }
+}
 
-    uint8_t currEntryType;
-    uint8_t secondaryCount;  //to know how many file name directories there is
-    uint32_t nextDirCluster; // value from FAT
-    uint8_t nameLength;
-    bool directory;
-    uint16_t unicodeString[MAX_ASCII_STRING_SIZE];
+//input: the volume, list output, the totals, a directory's location
+//reports every file below the directory, recursively
+void extentsRecurse(exfatVolume *volume, listOutput *output, fragmentationReport *report, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
+{
+    dirIterator directoryIterator;
+    dirEntry file;
+    size_t parentLength = output->pathLength;
 
-    
-    sectorsPerClus(fd);
-    clusterHeapOffset(fd);
-    getFatOffset(fd);
+    openDirectory(volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+    while (nextDirEntry(&directoryIterator, &file))
+    {
+        appendPathName(output, &file);
+        if (file.directory)
+            extentsRecurse(volume, output, report, file.firstCluster, file.dataLength, file.noFatChain);
+        else
+            fileFragmentation(volume, output, report, &file);
+        output->pathLength = parentLength;
+    }
+    closeDirectory(&directoryIterator);
+}
 
-    lseek(fd, findOffsetToCluster(firstCluster), SEEK_SET);
+//input: list output, the histogram's name, its buckets, what one unit counted by a bucket is worth (bytes per cluster, or 1)
+//writes the histogram's non-empty buckets, as "min-max:count" (or "min:count") words after a "# name" in text or as a JSON array of objects
+void writeHistogram(listOutput *output, const char *name, const uint64_t *histogram, uint64_t unit)
+{
+    bool first = true;
 
-    while (!done)
+    if (output->format == LIST_NDJSON)
+    {
+        writeList(output, ",\"", 2);
+        writeList(output, name, strlen(name));
+        writeList(output, "\":[", 3);
+    }
+    else
     {
-        read(fd, &currEntryType, 1);
-        bytesReadInCluster += 1;
-        bytesReadInEntry += 1;
-        if (currEntryType == FILE_TYPE_ENTRY)
+        writeList(output, "# ", 2);
+        writeList(output, name, strlen(name));
+    }
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        if (histogram[bucket] == 0)
+            continue;
+        uint64_t low = ((uint64_t)1 << bucket) * unit;
+        uint64_t high = (((uint64_t)2 << bucket) - 1) * unit;
+        if (output->format == LIST_NDJSON)
         {
-            read(fd, &secondaryCount, 1);
-            bytesReadInEntry += 1;
-            bytesReadInCluster += 1;
-
-            lseek(fd, 2, SEEK_CUR); //skip 2 bytes of set checksum
-            bytesReadInEntry += 2;
-            bytesReadInCluster += 2;
-            uint16_t fileAttributes;
-            read(fd, &fileAttributes, 2);
-            bytesReadInEntry += 2;
-            bytesReadInCluster += 2;
-
-            if ((fileAttributes & FILE_BIT_OFFSET) == FILE_BIT_OFFSET)
-            {
-                directory = true;
-            }
-            else
-            {
-                directory = false;
-            }
-
-            //stream extension
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInEntry, SEEK_CUR); //skip past rest of file dir entry
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInEntry;
-            bytesReadInEntry = 0;
-
-            if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-            {
-                currCluster = nextCluster(fd, currCluster);
-                lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                bytesReadInCluster = 0;
-            }
-            lseek(fd, 3, SEEK_CUR);
-            read(fd, &nameLength, 1);
-            lseek(fd, 16, SEEK_CUR);
-            bytesReadInEntry += 20;
-            read(fd, &nextDirCluster, 4);
-            bytesReadInEntry += 4;
-            lseek(fd, 8, SEEK_CUR);
-            bytesReadInEntry += 8;
-
-            bytesReadInEntry = 0;
-
-            bytesReadInCluster += BYTES_PER_ENTRY;
-
-            if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
+            writeList(output, first ? "{\"min\":" : ",{\"min\":", first ? 7 : 8);
+            writeDecimal(output, low);
+            writeList(output, ",\"max\":", 7);
+            writeDecimal(output, high);
+            writeList(output, ",\"count\":", 9);
+            writeDecimal(output, histogram[bucket]);
+            writeList(output, "}", 1);
+        }
+        else
+        {
+            writeList(output, " ", 1);
+            writeDecimal(output, low);
+            if (high > low)
             {
-                currCluster = nextCluster(fd, currCluster);
-                lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                bytesReadInCluster = 0;
+                writeList(output, "-", 1);
+                writeDecimal(output, high);
             }
+            writeList(output, ":", 1);
+            writeDecimal(output, histogram[bucket]);
+        }
+        first = false;
+    }
+    writeList(output, output->format == LIST_NDJSON ? "]" : "\n", 1);
+}
 
-            lseek(fd, 2 + findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET); //skip first 2 bytes of filename directory
-            bytesReadInCluster += 2;
-            bytesReadInEntry = 2;
+//input: list output, a summary field's name and value
+//writes ",\"name\":value" in NDJSON or " name value" in text
+void writeSummaryField(listOutput *output, const char *name, uint64_t value)
+{
+    if (output->format == LIST_NDJSON)
+    {
+        writeList(output, ",\"", 2);
+        writeList(output, name, strlen(name));
+        writeList(output, "\":", 2);
+    }
+    else
+    {
+        writeList(output, " ", 1);
+        writeList(output, name, strlen(name));
+        writeList(output, " ", 1);
+    }
+    writeDecimal(output, value);
+}
 
-            read(fd, &unicodeString[0], 30);
-            bytesReadInCluster += 30;
-            bytesReadInEntry = BYTES_PER_ENTRY;
+//------------------------------------------------------
+// extents
+//
+// PURPOSE: Execute the extents command: walk the tree once reporting every file's extents (see fileFragmentation), then summarise the volume: fragmented files, extents per file and extent sizes, and the free space extents of the allocation bitmap, as histograms with power of two buckets. Chains are resolved with buildFatRuns/runExtents, one FAT lookup per extent.
+// INPUT PARAMETERS:
+//     the volume, the output format (text or NDJSON)
+// OUTPUT PARAMETERS:
+//      false if the report could not be written out
+//------------------------------------------------------
+bool extents(exfatVolume *volume, listFormat format)
+{
+    listOutput output = {format, STDOUT_FILENO, false, malloc(LIST_BUFFER_BYTES), 0, NULL, 0, 0, false};
+    fragmentationReport report = {0};
+    uint64_t freeClusters = 0;
+    uint64_t largestFree = 0;
+    int freeCount;
+    extent *freeRuns;
+    assert(output.buffer != NULL);
 
-            lseek(fd, findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET);
+    report.runs = buildFatRuns(volume);
+    extentsRecurse(volume, &output, &report, volume->rootDirectory, 0, false); //the root directory always uses the FAT
+    freeRuns = freeExtents(volume, &freeCount);
+    for (int i = 0; i < freeCount; i++)
+    {
+        freeClusters += freeRuns[i].count;
+        if (freeRuns[i].count > largestFree)
+            largestFree = freeRuns[i].count;
+        report.freeSizeHistogram[histogramBucket(freeRuns[i].count)]++;
+    }
 
-            //read the secondary entries of the set
-            for (int i = 0; i < secondaryCount - 2; i++) // - 2 because first file name and stream extension have been read already
-            {
-                lseek(fd, 2, SEEK_CUR);
-                bytesReadInCluster += 2;
-                bytesReadInEntry = 2;
-                read(fd, &unicodeString[UNICODE_CHARS_PER_ENTRY * (i + 1)], 30);
-                bytesReadInCluster += 30;
-                bytesReadInEntry = BYTES_PER_ENTRY;
-
-                if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-                {
-                    currCluster = nextCluster(fd, currCluster);
-                    lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                    bytesReadInCluster = 0;
-                }
-            }
+    if (format == LIST_NDJSON)
+    {
+        writeList(&output, "{\"type\":\"summary\"", 17);
+    }
+    else
+    {
+        writeList(&output, "#", 1);
+    }
+    writeSummaryField(&output, "files", report.files);
+    writeSummaryField(&output, "fragmented_files", report.fragmentedFiles);
+    writeSummaryField(&output, "file_extents", report.fileExtents);
+    writeSummaryField(&output, "free_extents", freeCount);
+    writeSummaryField(&output, "free_bytes", freeClusters * volume->bytesPerCluster);
+    writeSummaryField(&output, "largest_free_extent_bytes", largestFree * volume->bytesPerCluster);
+    if (format != LIST_NDJSON)
+        writeList(&output, "\n", 1);
+    writeHistogram(&output, "extents_per_file", report.extentCountHistogram, 1);
+    writeHistogram(&output, "file_extent_bytes", report.extentSizeHistogram, volume->bytesPerCluster);
+    writeHistogram(&output, "free_extent_bytes", report.freeSizeHistogram, volume->bytesPerCluster);
+    if (format == LIST_NDJSON)
+        writeList(&output, "}\n", 2);
+    flushList(&output);
+    if (output.failed)
+        perror("extents");
 
-            for (int i = 0; i < levels; i++)
-            {
-                printf("-");
-            }
-            if (directory)
-            {
-                printf("Directory: ");
-            }
-            else
-            {
-                printf("File: ");
-            }
-            asciiString = unicode2ascii(unicodeString, nameLength);
+    free(freeRuns);
+    free((void *)report.runs);
+    free(output.buffer);
+    free(output.path);
+    return !output.failed;
+}
 
-            printf("%s\n", asciiString);
+//input: the verifier, the path of what is wrong, printf style description
+//prints one problem found by verify, whole even when several threads find problems at once
+void reportProblem(verifier *check, const char *path, const char *format, ...)
+{
+    va_list arguments;
 
-            if (directory)
-            {
-                listRecurse(fdOrig, nextDirCluster, levels + 1);
-            }
-            free(asciiString);
-            lseek(fd, findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET);
-        }
-        else if (currEntryType == 0)
-        {
-            done = true;
-        }
-        if (bytesReadInEntry < BYTES_PER_ENTRY) //skip remaining bytes, go to next entry
-        {
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInEntry, SEEK_CUR);
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInEntry;
-        }
-        bytesReadInEntry = 0;
-        if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-        {
-            currCluster = nextCluster(fd, currCluster);
-            lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-            bytesReadInCluster = 0;
-        }
-    } //while more files at this level
+    va_start(arguments, format);
+    pthread_mutex_lock(&check->lock);
+    printf("%s: ", path);
+    vprintf(format, arguments);
+    putchar('\n');
+    check->problems++;
+    pthread_mutex_unlock(&check->lock);
+    va_end(arguments);
 }
 
 //------------------------------------------------------
-// getFile
+// markClusters
 //
-// PURPOSE: Copy the chosen file from the file system to the current directory, one cluster at a time
+// PURPOSE: Record that a run of clusters belongs to a chain, a 64 bit word at a time with atomic ORs, and compare it with the allocation bitmap
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume, the name of the file to be created, the cluster to look at, the bytes to read for the file (length)
+//     the verifier, the run (inside the cluster heap), where to store how many of its clusters are free in the allocation bitmap
+// OUTPUT PARAMETERS:
+//      how many of its clusters some chain had already claimed (cross-linked)
 //------------------------------------------------------
-void getFile(int fd, char *name, int startCluster, uint64_t length)
+uint64_t markClusters(verifier *check, uint32_t startCluster, uint64_t count, uint64_t *freeInBitmap)
 {
-    int out = open(name, O_RDWR | O_CREAT, PERMISSIONS);
-    uint64_t bytesRead = 0;
-    int currCluster = startCluster;
-    lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-    uint8_t cluster[bytesPerSector * sectorsPerCluster];
-    while (bytesRead != length)
+    uint64_t bit = startCluster - CLUSTER_INDEX_OFFSET;
+    uint64_t end = bit + count;
+    uint64_t claimed = 0;
+
+    *freeInBitmap = 0;
+    while (bit < end)
     {
-        uint64_t bytesToRead = bytesPerSector * sectorsPerCluster;
-        if (length - bytesRead < bytesToRead)
-            bytesToRead = length - bytesRead;
-        read(fd, cluster, bytesPerSector * sectorsPerCluster);
-        write(out, cluster, bytesPerSector * sectorsPerCluster);
-        bytesRead += bytesToRead;
-        currCluster = nextCluster(fd, currCluster);
-        lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
+        uint64_t word = bit / BITS_PER_WORD;
+        uint64_t shift = bit % BITS_PER_WORD;
+        uint64_t bits = end - bit < BITS_PER_WORD - shift ? end - bit : BITS_PER_WORD - shift;
+        uint64_t mask = (bits == BITS_PER_WORD ? ~0ULL : (1ULL << bits) - 1) << shift;
+        uint64_t before = __atomic_fetch_or(&check->referenced[word], mask, __ATOMIC_RELAXED);
+        claimed += __builtin_popcountll(before & mask);
+        *freeInBitmap += __builtin_popcountll(~check->allocated[word] & mask);
+        bit += bits;
     }
+    return claimed;
 }
 
 //------------------------------------------------------
-// get
+// verifyChain
 //
-// PURPOSE: Find where the desired file is stored. Very similar to the listRecurse function above but it will stop searching once the file is found.
+// PURPOSE: Check the clusters of a file, directory or system structure: the chain must hold all of its data, stay inside the cluster heap, share no cluster with another chain and be allocated in the bitmap
 // INPUT PARAMETERS:
-//     file descriptor of exFAT volume, the cluster to look at, how many levels have been searched (0 to start)
+//     the verifier, the path to report problems against, first cluster, DataLength (0 to follow the chain to its end, for the root directory), NoFatChain flag
+// OUTPUT PARAMETERS:
+//      how many of its clusters another chain had claimed already, 0 unless it is cross-linked
 //------------------------------------------------------
-void get(int fdOrig, int firstCluster, int levels)
+uint64_t verifyChain(verifier *check, const char *path, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
 {
-    int fd = fdOrig; //we will keep a second file pointer so that when we return from the recusive call the pointer is not affected
-    int currCluster = firstCluster;
+    const exfatVolume *volume = check->volume;
+    uint64_t clustersWanted = (dataLength + volume->bytesPerCluster - 1) / volume->bytesPerCluster;
+    uint64_t clustersFound = 0;
+    uint64_t claimed = 0;
+    uint64_t freeInBitmap = 0;
+    int extentCount;
+    extent *extents;
+
+    if (dataLength == 0 && !noFatChain)
+        extents = buildExtents(volume, firstCluster, 0, &extentCount);
+    else if (noFatChain)
+        extents = fileExtents(volume, firstCluster, dataLength, true, &extentCount);
+    else
+        extents = runExtents(volume, check->runs, firstCluster, clustersWanted, &extentCount);
 
-    //include bytes we 'skip' over in order to track whether to go to next cluster/entry or not
-    int bytesReadInCluster = 0;
-    int bytesReadInEntry = 0;
-    char* asciiString;
+    for (int i = 0; i < extentCount; i++)
+    {
+        uint64_t heapEnd = (uint64_t)volume->clusterCount + CLUSTER_INDEX_OFFSET;
+        uint64_t count = extents[i].count;
+        uint64_t freeHere;
+        if (extents[i].startCluster < CLUSTER_INDEX_OFFSET || extents[i].startCluster >= heapEnd)
+            break;
+        if (extents[i].startCluster + count > heapEnd) //a NoFatChain run can claim to go past the end
+            count = heapEnd - extents[i].startCluster;
+        claimed += markClusters(check, extents[i].startCluster, count, &freeHere);
+        freeInBitmap += freeHere;
+        clustersFound += count;
+    }
+    free(extents);
+    __atomic_fetch_add(&check->chainClusters, clustersFound, __ATOMIC_RELAXED);
 
-    uint8_t nameLength;
-    uint64_t length; //of file
-    bool done = false;
-    uint8_t currEntryType;
-    uint8_t secondaryCount;  //to know how many file name directories there is
-    uint32_t nextDirCluster; // value from FAT
-    bool directory;
-    uint16_t unicodeString[MAX_ASCII_STRING_SIZE];
+    if (clustersFound < clustersWanted)
+        reportProblem(check, path, "cluster chain ends after %llu of its %llu clusters", (unsigned long long)clustersFound, (unsigned long long)clustersWanted);
+    if (claimed > 0)
+        reportProblem(check, path, "%llu clusters are also used by another chain (cross-linked)", (unsigned long long)claimed);
+    if (freeInBitmap > 0)
+        reportProblem(check, path, "%llu clusters are free in the allocation bitmap", (unsigned long long)freeInBitmap);
+    return claimed;
+}
 
+//input: the parent directory's path, an entry set in memory, its SecondaryCount (at least 2)
+//returns the heap allocated path of the entry set, built from its File Name entries in UTF-8 as list and find print it, with "<unnamed>" for a set that has no name
+char *entrySetPath(const char *directoryPath, const uint8_t *set, int secondaryCount)
+{
+    listOutput name = {LIST_TEXT, -1, false, NULL, 0, NULL, 0, 0, false}; //only its path is used
+    dirEntry file;
+    uint8_t nameLength = set[BYTES_PER_ENTRY + 3];
+    int copied = 0;
 
-    sectorsPerClus(fd);
-    clusterHeapOffset(fd);
-    getFatOffset(fd);
-    char *myPath = strdup(path);
-    char *currentLookUp;
-    currentLookUp = strtok(myPath, "/");
-    for (int i = 0; i < levels; i++)
+    for (int i = 2; i <= secondaryCount && copied < nameLength; i++)
     {
-        currentLookUp = strtok(NULL, "/");
+        const uint8_t *entry = set + i * BYTES_PER_ENTRY;
+        for (int c = 0; c < UNICODE_CHARS_PER_ENTRY && copied < nameLength && copied < MAX_ASCII_STRING_SIZE; c++)
+            memcpy(&file.name[copied++], entry + 2 + c * sizeof(uint16_t), sizeof(uint16_t));
     }
+    file.nameLength = copied;
+    if (copied > 0)
+        appendPathName(&name, &file);
+
+    char *path = malloc(strlen(directoryPath) + (copied > 0 ? name.pathLength : strlen("<unnamed>")) + 1);
+    assert(path != NULL);
+    if (copied > 0)
+        sprintf(path, "%s%.*s", directoryPath, (int)name.pathLength, name.path);
+    else
+        sprintf(path, "%s<unnamed>", directoryPath);
+    free(name.path);
+    return path;
+}
 
-    lseek(fd, findOffsetToCluster(firstCluster), SEEK_SET);
+//------------------------------------------------------
+// verifyDirectoryEntries
+//
+// PURPOSE: Check one directory: the SetChecksum of every entry set and the chain of every entry, queueing its subdirectories for the next level. In the root directory the allocation bitmap and up-case table chains are checked too.
+// INPUT PARAMETERS:
+//     the verifier, the directory
+//------------------------------------------------------
+void verifyDirectoryEntries(verifier *check, const verifyDirectory *directory)
+{
+    const exfatVolume *volume = check->volume;
+    bool root = directory->dataLength == 0;
+    dirIterator directoryIterator;
+    const uint8_t *entry;
 
-    while (!done)
+    openDirectory(volume, &directoryIterator, directory->firstCluster, directory->dataLength, directory->noFatChain);
+    __atomic_fetch_add(&check->directories, 1, __ATOMIC_RELAXED);
+    while ((entry = nextRawEntry(&directoryIterator)) != NULL)
     {
-        // printf("but here done is set to: %d\n", done);
-        read(fd, &currEntryType, 1);
-        bytesReadInCluster += 1;
-        bytesReadInEntry += 1;
-        if (currEntryType == FILE_TYPE_ENTRY)
-        {
-            read(fd, &secondaryCount, 1);
-            bytesReadInEntry += 1;
-            bytesReadInCluster += 1;
+        uint32_t firstCluster;
+        uint64_t dataLength;
 
-            lseek(fd, 2, SEEK_CUR); //skip 2 bytes of set checksum
-            bytesReadInEntry += 2;
-            bytesReadInCluster += 2;
-            uint16_t fileAttributes;
-            read(fd, &fileAttributes, 2);
-            bytesReadInEntry += 2;
-            bytesReadInCluster += 2;
+        if (root && (entry[0] == ALLOCATION_BITMAP_ENTRY || entry[0] == UPCASE_TABLE_ENTRY))
+        {
+            memcpy(&firstCluster, entry + 20, 4);
+            memcpy(&dataLength, entry + 24, 8);
+            verifyChain(check, entry[0] == ALLOCATION_BITMAP_ENTRY ? "Allocation Bitmap" : "Up-case Table", firstCluster, dataLength, false);
+            continue;
+        }
+        if (entry[0] != FILE_TYPE_ENTRY)
+            continue;
 
-            if ((fileAttributes & FILE_BIT_OFFSET) == FILE_BIT_OFFSET)
-            {
-                directory = true;
-            }
-            else
-            {
-                directory = false;
-            }
+        int secondaryCount = entry[1];
+        uint64_t setStart = directoryIterator.position - BYTES_PER_ENTRY;
+        uint64_t setBytes = (uint64_t)(secondaryCount + 1) * BYTES_PER_ENTRY;
+        const uint8_t *set = directoryIterator.contents + setStart;
+        if (secondaryCount < 2 || setStart + setBytes > directoryIterator.length || set[BYTES_PER_ENTRY] != STREAM_EXTENSION_ENTRY)
+        {
+            reportProblem(check, directory->path[0] != '\0' ? directory->path : "/", "malformed entry set at byte %llu", (unsigned long long)setStart);
+            continue;
+        }
+        __atomic_fetch_add(&check->entrySets, 1, __ATOMIC_RELAXED);
+        directoryIterator.position = setStart + setBytes; //past its secondary entries
 
-            //stream extension
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInEntry, SEEK_CUR); //skip past rest of file dir entry
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInEntry;
-            bytesReadInEntry = 0;
+        char *path = entrySetPath(directory->path, set, secondaryCount);
+        uint16_t stored;
+        uint16_t computed = entrySetChecksum(set, secondaryCount + 1);
+        uint16_t attributes;
+        memcpy(&stored, set + 2, 2);
+        memcpy(&attributes, set + 4, 2);
+        memcpy(&firstCluster, set + BYTES_PER_ENTRY + 20, 4);
+        memcpy(&dataLength, set + BYTES_PER_ENTRY + 24, 8);
+        bool noFatChain = (set[BYTES_PER_ENTRY + 1] & NO_FAT_CHAIN_FLAG) != 0;
+        uint64_t crossLinked = 0;
+        if (stored != computed)
+            reportProblem(check, path, "entry set checksum is 0x%04x, should be 0x%04x", stored, computed);
+        if (firstCluster != 0 || dataLength != 0)
+            crossLinked = verifyChain(check, path, firstCluster, dataLength, noFatChain);
 
-            if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
+        //a directory sharing clusters with another chain (its own ancestor, say) has been reported and is not descended into, or the walk could loop forever
+        if ((attributes & FILE_BIT_OFFSET) && dataLength > 0 && crossLinked == 0)
+        {
+            pthread_mutex_lock(&check->lock);
+            if (check->nextLevelCount == check->nextLevelCapacity)
             {
-                currCluster = nextCluster(fd, currCluster);
-                lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                bytesReadInCluster = 0;
+                check->nextLevelCapacity = check->nextLevelCapacity > 0 ? check->nextLevelCapacity * 2 : 64;
+                check->nextLevel = realloc(check->nextLevel, check->nextLevelCapacity * sizeof(verifyDirectory));
+                assert(check->nextLevel != NULL);
             }
-            lseek(fd, 3, SEEK_CUR);
-            read(fd, &nameLength, 1);
-            lseek(fd, 16, SEEK_CUR);
-            bytesReadInEntry += 20;
-            read(fd, &nextDirCluster, 4);
-            bytesReadInEntry += 4;
-            read(fd, &length, 8);
-            bytesReadInEntry += 8;
+            verifyDirectory *child = &check->nextLevel[check->nextLevelCount++];
+            child->firstCluster = firstCluster;
+            child->dataLength = dataLength;
+            child->noFatChain = noFatChain;
+            child->path = realloc(path, strlen(path) + 2);
+            assert(child->path != NULL);
+            strcat(child->path, "/"); //so entries below it can be appended directly
+            path = NULL;
+            pthread_mutex_unlock(&check->lock);
+        }
+        free(path);
+    }
+    closeDirectory(&directoryIterator);
+}
+
+//input: the verifier
+//thread of the verify command: checks directories of the current level until none are left
+void *verifyWorkerMain(void *argument)
+{
+    verifier *check = argument;
+
+    while (true)
+    {
+        size_t index = __atomic_fetch_add(&check->nextDirectory, 1, __ATOMIC_RELAXED);
+        if (index >= check->levelCount)
+            break;
+        verifyDirectoryEntries(check, &check->level[index]);
+    }
+    return NULL;
+}
+
+//input: the volume, how many 64 bit words hold a bit per cluster
+//returns the allocation bitmap read into that many words (all clear if the volume has none), bits past the last cluster clear
+uint64_t *loadAllocationBitmap(const exfatVolume *volume, uint64_t words)
+{
+    uint8_t entry[BYTES_PER_ENTRY];
+    uint64_t *bitmap = calloc(words, sizeof(uint64_t));
+    assert(bitmap != NULL);
+
+    if (findRootEntry(volume, ALLOCATION_BITMAP_ENTRY, entry))
+    {
+        uint32_t firstCluster;
+        uint64_t dataLength;
+        uint64_t wanted = ((uint64_t)volume->clusterCount + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+        uint64_t filled = 0;
+        int extentCount;
+        memcpy(&firstCluster, entry + 20, 4);
+        memcpy(&dataLength, entry + 24, 8);
+        if (dataLength < wanted)
+            wanted = dataLength;
+        extent *extents = fileExtents(volume, firstCluster, wanted, false, &extentCount);
+        for (int i = 0; i < extentCount && filled < wanted; i++)
+        {
+            uint64_t bytes = extents[i].count * volume->bytesPerCluster;
+            if (bytes > wanted - filled)
+                bytes = wanted - filled;
+            readVolume(volume, findOffsetToCluster(volume, extents[i].startCluster), (uint8_t *)bitmap + filled, bytes);
+            filled += bytes;
+        }
+        free(extents);
+    }
+    if (volume->clusterCount % BITS_PER_WORD != 0)
+        bitmap[words - 1] &= (1ULL << (volume->clusterCount % BITS_PER_WORD)) - 1;
+    return bitmap;
+}
+
+//------------------------------------------------------
+// verify
+//
+// PURPOSE: Execute the verify command: check the checksums of both boot regions, then walk the tree a level at a time with a pool of threads checking the SetChecksum of every entry set and the cluster chain of every entry against the other chains and the allocation bitmap (see verifyChain), and finally report clusters allocated in the bitmap that no chain uses. Each problem is printed on its own line.
+// INPUT PARAMETERS:
+//     the volume, the number of threads
+// OUTPUT PARAMETERS:
+//      the number of problems found
+//------------------------------------------------------
+uint64_t verify(exfatVolume *volume, int threadCount)
+{
+    verifier check = {0};
+    uint32_t checksum;
+    uint64_t lost = 0;
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+    assert(threads != NULL);
+
+    check.volume = volume;
+    check.words = ((uint64_t)volume->clusterCount + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    check.referenced = calloc(check.words > 0 ? check.words : 1, sizeof(uint64_t));
+    check.allocated = loadAllocationBitmap(volume, check.words > 0 ? check.words : 1);
+    check.runs = buildFatRuns(volume);
+    assert(check.referenced != NULL);
+    pthread_mutex_init(&check.lock, NULL);
+
+    if (!bootRegionChecksum(volume, 0, &checksum))
+        reportProblem(&check, "Boot Region", "checksum 0x%08x does not match its checksum sector", checksum);
+    if (!bootRegionChecksum(volume, BOOT_REGION_SECTORS, &checksum))
+        reportProblem(&check, "Backup Boot Region", "checksum 0x%08x does not match its checksum sector", checksum);
+
+    verifyChain(&check, "Root Directory", volume->rootDirectory, 0, false);
+    check.level = malloc(sizeof(verifyDirectory));
+    assert(check.level != NULL);
+    check.level[0].firstCluster = volume->rootDirectory;
+    check.level[0].dataLength = 0; //follow the FAT chain to its end
+    check.level[0].noFatChain = false;
+    check.level[0].path = strdup("");
+    check.levelCount = 1;
+    while (check.levelCount > 0)
+    {
+        int started = (size_t)threadCount < check.levelCount ? threadCount : (int)check.levelCount;
+        check.nextDirectory = 0;
+        for (int i = 0; i < started; i++)
+            pthread_create(&threads[i], NULL, verifyWorkerMain, &check);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        for (size_t i = 0; i < check.levelCount; i++)
+            free(check.level[i].path);
+        free(check.level);
+        check.level = check.nextLevel;
+        check.levelCount = check.nextLevelCount;
+        check.nextLevel = NULL;
+        check.nextLevelCount = check.nextLevelCapacity = 0;
+    }
+
+    for (uint64_t word = 0; word < check.words; word++)
+        lost += __builtin_popcountll(check.allocated[word] & ~check.referenced[word]);
+    if (lost > 0)
+        reportProblem(&check, "Allocation Bitmap", "%llu clusters are allocated but used by no chain (lost)", (unsigned long long)lost);
+
+    printf("Checked %llu entry sets in %llu directories, %llu clusters in chains: ", (unsigned long long)check.entrySets,
+           (unsigned long long)check.directories, (unsigned long long)check.chainClusters);
+    if (check.problems == 0)
+        printf("no problems found\n");
+    else
+        printf("%llu problems found\n", (unsigned long long)check.problems);
+
+    pthread_mutex_destroy(&check.lock);
+    free(check.level);
+    free(check.referenced);
+    free(check.allocated);
+    free((void *)check.runs);
+    free(threads);
+    return check.problems;
+}
+
+//------------------------------------------------------
+// formatListLine
+//
+// PURPOSE: Build one line of list output: a dash per level (or the full path in unordered mode), the entry type and the name
+// INPUT PARAMETERS:
+//     levels below the root, whether the entry is a directory, the name (or path) to print
+// OUTPUT PARAMETERS:
+//      heap allocated, newline terminated line. caller must free it
+//------------------------------------------------------
+char *formatListLine(int levels, bool directory, const char *name)
+{
+    const char *tag = directory ? "Directory: " : "File: ";
+    size_t length = levels + strlen(tag) + strlen(name) + 2; //newline and null terminator
+    char *line = malloc(length);
+    assert(line != NULL);
+
+    memset(line, '-', levels);
+    snprintf(line + levels, length - levels, "%s%s\n", tag, name);
+    return line;
+}
+
+//input: the directory's location, depth and path (the path is copied)
+//returns a heap allocated node describing a directory that still has to be read
+listNode *newListNode(uint32_t firstCluster, uint64_t dataLength, bool noFatChain, int levels, const char *directoryPath)
+{
+    listNode *node = calloc(1, sizeof(listNode));
+    assert(node != NULL);
+    node->firstCluster = firstCluster;
+    node->dataLength = dataLength;
+    node->noFatChain = noFatChain;
+    node->levels = levels;
+    node->path = strdup(directoryPath);
+    return node;
+}
+
+//input: pool, the queue to add to (normally the caller's own), directory to read
+void pushTask(listPool *pool, int queueIndex, listNode *node)
+{
+    workQueue *queue = &pool->queues[queueIndex];
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity)
+    {
+        if (queue->head > 0) //slide the live tasks back to the start before growing
+        {
+            memmove(queue->tasks, queue->tasks + queue->head, (queue->tail - queue->head) * sizeof(listNode *));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        if (queue->tail == queue->capacity)
+        {
+            queue->capacity = queue->capacity > 0 ? queue->capacity * 2 : 16;
+            queue->tasks = realloc(queue->tasks, queue->capacity * sizeof(listNode *));
+            assert(queue->tasks != NULL);
+        }
+    }
+    queue->tasks[queue->tail++] = node;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+//------------------------------------------------------
+// takeTask
+//
+// PURPOSE: Get the next directory for a worker: the newest task of its own queue (depth first, stays local) or, when that is empty, steal the oldest task of another worker's queue
+// INPUT PARAMETERS:
+//     pool, index of the worker asking
+// OUTPUT PARAMETERS:
+//      the directory to read, NULL if every queue is empty
+//------------------------------------------------------
+listNode *takeTask(listPool *pool, int workerIndex)
+{
+    listNode *node = NULL;
+
+    for (int i = 0; i < pool->threadCount && node == NULL; i++)
+    {
+        workQueue *queue = &pool->queues[(workerIndex + i) % pool->threadCount];
+        pthread_mutex_lock(&queue->lock);
+        if (queue->tail > queue->head)
+        {
+            if (i == 0)
+                node = queue->tasks[--queue->tail];
+            else
+                node = queue->tasks[queue->head++];
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    if (node != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return node;
+}
+
+//------------------------------------------------------
+// readListDirectory
+//
+// PURPOSE: Read one directory for the parallel list. Every entry becomes a line and every sub directory becomes a new task. In ordered mode the lines are kept on the node for printing later, in unordered mode they are printed straight away.
+// INPUT PARAMETERS:
+//     pool, index of the worker doing the reading, the directory
+//------------------------------------------------------
+void readListDirectory(listPool *pool, int workerIndex, listNode *node)
+{
+    dirIterator directoryIterator;
+    dirEntry file;
+    char *asciiString;
+    char *entryPath;
+    int capacity = 0;
+
+    openDirectory(pool->volume, &directoryIterator, node->firstCluster, node->dataLength, node->noFatChain);
+    while (nextDirEntry(&directoryIterator, &file))
+    {
+        asciiString = unicode2ascii(file.name, file.nameLength);
+        entryPath = malloc(strlen(node->path) + strlen(asciiString) + 2);
+        assert(entryPath != NULL);
+        sprintf(entryPath, "%s%s%s", node->path, node->path[0] != '\0' ? "/" : "", asciiString);
+
+        if (node->entryCount == capacity)
+        {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            node->lines = realloc(node->lines, capacity * sizeof(char *));
+            node->children = realloc(node->children, capacity * sizeof(listNode *));
+            assert(node->lines != NULL && node->children != NULL);
+        }
+        if (pool->unordered)
+            node->lines[node->entryCount] = formatListLine(0, file.directory, entryPath);
+        else
+            node->lines[node->entryCount] = formatListLine(node->levels, file.directory, asciiString);
+        node->children[node->entryCount] = NULL;
+        if (file.directory)
+        {
+            node->children[node->entryCount] = newListNode(file.firstCluster, file.dataLength, file.noFatChain, node->levels + 1, entryPath);
+            pushTask(pool, workerIndex, node->children[node->entryCount]);
+        }
+        node->entryCount++;
+        free(entryPath);
+        free(asciiString);
+    }
+    closeDirectory(&directoryIterator);
+
+    if (pool->unordered)
+    {
+        //the whole directory goes out in one piece, then the node is no longer needed
+        pthread_mutex_lock(&pool->outputLock);
+        for (int i = 0; i < node->entryCount; i++)
+        {
+            fputs(node->lines[i], stdout);
+            free(node->lines[i]);
+        }
+        pthread_mutex_unlock(&pool->outputLock);
+        free(node->lines);
+        free(node->children);
+        free(node->path);
+        free(node);
+    }
+}
+
+//input: worker description (pool and index)
+//runs directories until every queue is empty and no other worker can produce more
+void *listWorkerMain(void *argument)
+{
+    listWorker *worker = argument;
+    listPool *pool = worker->pool;
+    listNode *node;
+
+    while (true)
+    {
+        node = takeTask(pool, worker->index);
+        if (node != NULL)
+        {
+            readListDirectory(pool, worker->index, node);
+            pthread_mutex_lock(&pool->lock);
+            pool->pending--;
+            if (pool->pending == 0)
+                pthread_cond_broadcast(&pool->wake);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && pool->pending > 0)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->pending == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+//input: a directory read in ordered mode
+//prints its lines depth first, exactly as listRecurse would, and frees the tree as it goes
+void printListTree(listNode *node)
+{
+    for (int i = 0; i < node->entryCount; i++)
+    {
+        fputs(node->lines[i], stdout);
+        free(node->lines[i]);
+        if (node->children[i] != NULL)
+            printListTree(node->children[i]);
+    }
+    free(node->lines);
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+
+//------------------------------------------------------
+// listParallel
+//
+// PURPOSE: Execute the list command with a pool of threads, each reading whole directories with positional I/O and stealing work from the others when idle. Ordered output is identical to listRecurse; unordered output streams each directory (with full paths) as soon as it has been read.
+// INPUT PARAMETERS:
+//     the volume, number of threads, whether the output may be unordered
+//------------------------------------------------------
+void listParallel(exfatVolume *volume, int threadCount, bool unordered)
+{
+    listPool pool;
+    pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+    listWorker *workers = malloc(threadCount * sizeof(listWorker));
+    assert(threads != NULL && workers != NULL);
+
+    pool.queues = calloc(threadCount, sizeof(workQueue));
+    assert(pool.queues != NULL);
+    pool.volume = volume;
+    pool.threadCount = threadCount;
+    pool.unordered = unordered;
+    pool.queued = 0;
+    pool.pending = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    pthread_mutex_init(&pool.outputLock, NULL);
+    for (int i = 0; i < threadCount; i++)
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+
+    listNode *root = newListNode(volume->rootDirectory, 0, false, 0, ""); //the root directory always uses the FAT
+    pushTask(&pool, 0, root);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].index = i;
+        pthread_create(&threads[i], NULL, listWorkerMain, &workers[i]);
+    }
+    for (int i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+
+    if (!unordered)
+        printListTree(root);
+
+    for (int i = 0; i < threadCount; i++)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].tasks);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.wake);
+    pthread_mutex_destroy(&pool.outputLock);
+    free(pool.queues);
+    free(workers);
+    free(threads);
+}
+
+//------------------------------------------------------
+// copyToFile
+//
+// PURPOSE: Copy a byte range of the volume into an output file, letting the kernel move the data when it can: copy_file_range first (no trip through user space, or even a shared extent on file systems that support it), then sendfile, and otherwise a write straight from the mapping or through the caller's buffer. A method that fails once is not tried again.
+// INPUT PARAMETERS:
+//     the volume, the output file, where the data is on the volume, where it goes in the output, how many bytes, a COPY_BUFFER_BYTES buffer for the last fallback
+// OUTPUT PARAMETERS:
+//      true if every byte was written
+//------------------------------------------------------
+bool copyToFile(const exfatVolume *volume, int out, uint64_t volumeOffset, uint64_t fileOffset, uint64_t length, uint8_t *buffer)
+{
+    while (length > 0 && __atomic_load_n(&useCopyRange, __ATOMIC_RELAXED))
+    {
+        loff_t inPosition = volumeOffset;
+        loff_t outPosition = fileOffset;
+        ssize_t copied = copy_file_range(volume->fd, &inPosition, out, &outPosition, length < KERNEL_COPY_MAX_BYTES ? length : KERNEL_COPY_MAX_BYTES, 0);
+        STAT_ADD(STAT_KERNEL_COPIES, 1);
+        if (copied < 0 && errno == EINTR)
+            continue;
+        if (copied < 0)
+            __atomic_store_n(&useCopyRange, false, __ATOMIC_RELAXED);
+        if (copied <= 0) //0: past the end of the image, the fallback zero fills
+            break;
+        STAT_ADD(STAT_BYTES_READ, copied);
+        STAT_ADD(STAT_BYTES_WRITTEN, copied);
+        volumeOffset += copied;
+        fileOffset += copied;
+        length -= copied;
+    }
+
+    if (length > 0 && __atomic_load_n(&useSendfile, __ATOMIC_RELAXED))
+    {
+        STAT_ADD(STAT_LSEEK_CALLS, 1);
+        bool seekable = lseek(out, fileOffset, SEEK_SET) >= 0; //sendfile writes at the file position
+        while (seekable && length > 0)
+        {
+            off_t inPosition = volumeOffset;
+            ssize_t copied = sendfile(out, volume->fd, &inPosition, length < KERNEL_COPY_MAX_BYTES ? length : KERNEL_COPY_MAX_BYTES);
+            STAT_ADD(STAT_KERNEL_COPIES, 1);
+            if (copied < 0 && errno == EINTR)
+                continue;
+            if (copied < 0)
+                __atomic_store_n(&useSendfile, false, __ATOMIC_RELAXED);
+            if (copied <= 0)
+                break;
+            STAT_ADD(STAT_BYTES_READ, copied);
+            STAT_ADD(STAT_BYTES_WRITTEN, copied);
+            volumeOffset += copied;
+            fileOffset += copied;
+            length -= copied;
+        }
+    }
+
+    while (length > 0)
+    {
+        uint64_t bytesToCopy = length < COPY_BUFFER_BYTES ? length : COPY_BUFFER_BYTES;
+        //a mapped volume is written straight from the mapping, no intermediate copy
+        ssize_t written = pwrite(out, volumeData(volume, volumeOffset, bytesToCopy, buffer), bytesToCopy, fileOffset);
+        STAT_ADD(STAT_WRITE_CALLS, 1);
+        if (written <= 0)
+            return false;
+        STAT_ADD(STAT_BYTES_WRITTEN, written);
+        volumeOffset += written;
+        fileOffset += written;
+        length -= written;
+    }
+    return true;
+}
+
+//------------------------------------------------------
+// splitCopies
+//
+// PURPOSE: Cut copy requests into blocks of at most blockBytes, the unit the asynchronous engines keep in flight
+// INPUT PARAMETERS:
+//     the requests and how many, the largest block, where to store the number of blocks
+// OUTPUT PARAMETERS:
+//      heap array of blocks, in request order
+//------------------------------------------------------
+copyRequest *splitCopies(const copyRequest *requests, size_t requestCount, uint64_t blockBytes, size_t *blockCount)
+{
+    size_t count = 0;
+    copyRequest *blocks;
+
+    for (size_t i = 0; i < requestCount; i++)
+        count += (requests[i].length + blockBytes - 1) / blockBytes;
+    blocks = malloc((count > 0 ? count : 1) * sizeof(copyRequest));
+    assert(blocks != NULL);
+
+    *blockCount = 0;
+    for (size_t i = 0; i < requestCount; i++)
+    {
+        for (uint64_t done = 0; done < requests[i].length; done += blockBytes)
+        {
+            copyRequest *block = &blocks[(*blockCount)++];
+            block->out = requests[i].out;
+            block->volumeOffset = requests[i].volumeOffset + done;
+            block->fileOffset = requests[i].fileOffset + done;
+            block->length = requests[i].length - done < blockBytes ? requests[i].length - done : blockBytes;
+        }
+    }
+    return blocks;
+}
+
+//input: a ring set up (even partly) by uringOpen
+void uringClose(uringQueue *ring)
+{
+#ifdef HAVE_IO_URING
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesBytes);
+    if (ring->cqRingBytes != 0 && ring->cqRing != NULL && ring->cqRing != MAP_FAILED)
+        munmap(ring->cqRing, ring->cqRingBytes);
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+        munmap(ring->sqRing, ring->sqRingBytes);
+    close(ring->fd);
+#else
+    (void)ring;
+#endif
+}
+
+//------------------------------------------------------
+// uringOpen
+//
+// PURPOSE: Set up an io_uring instance with the raw system calls and map its submission and completion rings
+// INPUT PARAMETERS:
+//     the ring to set up, how many submissions it must hold
+// OUTPUT PARAMETERS:
+//      true if io_uring is available, false (with errno set and nothing left to clean up) otherwise
+//------------------------------------------------------
+bool uringOpen(uringQueue *ring, unsigned entries)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    uint8_t *sqRing;
+    uint8_t *cqRing;
+
+    memset(ring, 0, sizeof(uringQueue));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sqRingBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) //both rings share one mapping
+    {
+        if (ring->cqRingBytes > ring->sqRingBytes)
+            ring->sqRingBytes = ring->cqRingBytes;
+        ring->cqRingBytes = 0;
+    }
+    ring->sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sqRing = mmap(NULL, ring->sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = ring->cqRingBytes == 0 ? ring->sqRing : mmap(NULL, ring->cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int error = errno;
+        uringClose(ring);
+        errno = error;
+        return false;
+    }
+
+    sqRing = ring->sqRing;
+    cqRing = ring->cqRing;
+    ring->sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+    return true;
+#else
+    (void)ring;
+    (void)entries;
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+//input: the ring, IORING_OP_READ or IORING_OP_WRITE, the file, buffer, byte count and file offset, the slot it belongs to
+//queues one read or write, it is handed to the kernel by the next io_uring_enter
+void uringQueueOperation(uringQueue *ring, uint8_t opcode, int fd, void *buffer, uint32_t length, uint64_t offset, uint64_t slot)
+{
+    unsigned tail = *ring->sqTail; //only this thread moves the tail
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+#endif
+
+//------------------------------------------------------
+// copyWithUring
+//
+// PURPOSE: Move blocks from the volume to their output files through io_uring, keeping up to queueDepth of them in flight. Each slot owns a buffer and goes read -> write -> free, resubmitting the rest of any short transfer.
+// INPUT PARAMETERS:
+//     the volume, an open ring, the blocks and how many, slots (and buffers) to use, size of each buffer
+// OUTPUT PARAMETERS:
+//      true if every block was copied, false with errno set otherwise
+//------------------------------------------------------
+bool copyWithUring(const exfatVolume *volume, uringQueue *ring, const copyRequest *blocks, size_t blockCount, int queueDepth, uint64_t blockBytes)
+{
+#ifdef HAVE_IO_URING
+    uringSlot *slots = calloc(queueDepth, sizeof(uringSlot));
+    size_t nextBlock = 0;
+    int inFlight = 0;
+    unsigned toSubmit = 0;
+    int error = 0;
+    assert(slots != NULL);
+
+    for (int s = 0; s < queueDepth; s++)
+    {
+        slots[s].buffer = aligned_alloc(COPY_BUFFER_ALIGNMENT, blockBytes);
+        assert(slots[s].buffer != NULL);
+    }
+
+    while (inFlight > 0 || (error == 0 && nextBlock < blockCount))
+    {
+        for (int s = 0; s < queueDepth && error == 0 && nextBlock < blockCount; s++)
+        {
+            if (slots[s].busy)
+                continue;
+            slots[s].block = blocks[nextBlock++];
+            slots[s].done = 0;
+            slots[s].writing = false;
+            slots[s].busy = true;
+            uringQueueOperation(ring, IORING_OP_READ, volume->fd, slots[s].buffer, slots[s].block.length, slots[s].block.volumeOffset, s);
+            toSubmit++;
+            inFlight++;
+        }
+
+        int entered = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (entered < 0 && errno != EINTR)
+        {
+            error = errno;
+            break; //nothing more can be submitted or reaped
+        }
+        if (entered > 0)
+            toSubmit -= entered;
+
+        unsigned head = *ring->cqHead;
+        unsigned tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            uringSlot *slot = &slots[cqe->user_data];
+            int result = cqe->res;
+
+            if (result < 0 || (slot->writing && result == 0) || error != 0)
+            {
+                if (error == 0)
+                    error = result < 0 ? -result : EIO;
+                slot->busy = false; //after a failure in flight operations are only drained
+                inFlight--;
+                continue;
+            }
+            STAT_ADD(slot->writing ? STAT_WRITE_CALLS : STAT_READ_CALLS, 1);
+            STAT_ADD(slot->writing ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, result);
+            if (!slot->writing && result == 0) //past the end of the image, same as readVolume
+            {
+                memset(slot->buffer + slot->done, 0, slot->block.length - slot->done);
+                result = slot->block.length - slot->done;
+            }
+            slot->done += result;
+            if (slot->done < slot->block.length) //short transfer, queue the rest
+            {
+                uint64_t offset = slot->writing ? slot->block.fileOffset : slot->block.volumeOffset;
+                uringQueueOperation(ring, slot->writing ? IORING_OP_WRITE : IORING_OP_READ, slot->writing ? slot->block.out : volume->fd,
+                                    slot->buffer + slot->done, slot->block.length - slot->done, offset + slot->done, cqe->user_data);
+                toSubmit++;
+            }
+            else if (!slot->writing)
+            {
+                slot->writing = true;
+                slot->done = 0;
+                uringQueueOperation(ring, IORING_OP_WRITE, slot->block.out, slot->buffer, slot->block.length, slot->block.fileOffset, cqe->user_data);
+                toSubmit++;
+            }
+            else
+            {
+                slot->busy = false;
+                inFlight--;
+            }
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    for (int s = 0; s < queueDepth && inFlight == 0; s++) //the kernel may still own the buffers if io_uring_enter itself failed
+        free(slots[s].buffer);
+    free(slots);
+    errno = error;
+    return error == 0;
+#else
+    (void)volume;
+    (void)ring;
+    (void)blocks;
+    (void)blockCount;
+    (void)queueDepth;
+    (void)blockBytes;
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+//input: the copyPool shared by all workers
+//worker of the thread pool engine: takes blocks until none are left (or one failed) and copies each with blocking calls
+void *copyWorkerMain(void *argument)
+{
+    copyPool *pool = argument;
+    uint8_t *buffer = aligned_alloc(COPY_BUFFER_ALIGNMENT, pool->blockBytes); //only touched when the volume is not mapped
+    assert(buffer != NULL);
+
+    while (__atomic_load_n(&pool->error, __ATOMIC_RELAXED) == 0)
+    {
+        size_t index = __atomic_fetch_add(&pool->nextBlock, 1, __ATOMIC_RELAXED);
+        if (index >= pool->blockCount)
+            break;
+        const copyRequest *block = &pool->blocks[index];
+        const uint8_t *data = volumeData(pool->volume, block->volumeOffset, block->length, buffer);
+        for (uint64_t done = 0; done < block->length;)
+        {
+            ssize_t written = pwrite(block->out, data + done, block->length - done, block->fileOffset + done);
+            STAT_ADD(STAT_WRITE_CALLS, 1);
+            if (written <= 0)
+            {
+                int expected = 0;
+                int error = written < 0 ? errno : EIO;
+                __atomic_compare_exchange_n(&pool->error, &expected, error, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                break;
+            }
+            STAT_ADD(STAT_BYTES_WRITTEN, written);
+            done += written;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+//input: why io_uring cannot be used (an errno value)
+//switches --io=uring to the thread pool for the rest of the run, saying so once
+void uringUnavailable(int error)
+{
+    fprintf(stderr, "io_uring unavailable (%s), using --io=threads\n", strerror(error));
+    ioEngineChoice = IO_THREADS;
+}
+
+//------------------------------------------------------
+// runCopies
+//
+// PURPOSE: Carry out a set of copies from the volume into output files with the I/O engine chosen by --io. io_uring falls back to the thread pool (for the rest of the run) when the kernel does not offer it, or sets up a ring but refuses its reads and writes; the copies are then done again by the pool.
+// INPUT PARAMETERS:
+//     the volume, the copies and how many there are
+// OUTPUT PARAMETERS:
+//      true if everything was copied, false with errno set otherwise
+//------------------------------------------------------
+bool runCopies(const exfatVolume *volume, const copyRequest *requests, size_t requestCount)
+{
+    bool copied = true;
+    uint64_t start = statsClock();
+
+    if (ioEngineChoice == IO_SYNC)
+    {
+        uint8_t *buffer = aligned_alloc(COPY_BUFFER_ALIGNMENT, COPY_BUFFER_BYTES); //only touched by the last fallback of copyToFile
+        assert(buffer != NULL);
+        for (size_t i = 0; i < requestCount && copied; i++)
+            copied = copyToFile(volume, requests[i].out, requests[i].volumeOffset, requests[i].fileOffset, requests[i].length, buffer);
+        free(buffer);
+        statsPhase(PHASE_COPY, start, 0);
+        return copied;
+    }
+
+    size_t blockCount;
+    copyRequest *blocks = splitCopies(requests, requestCount, ioBlockBytes, &blockCount);
+    uringQueue ring;
+
+    if (ioEngineChoice == IO_URING && !uringOpen(&ring, ioQueueDepth))
+        uringUnavailable(errno);
+
+    if (ioEngineChoice == IO_URING)
+    {
+        copied = copyWithUring(volume, &ring, blocks, blockCount, ioQueueDepth, ioBlockBytes);
+        int error = errno;
+        uringClose(&ring);
+        errno = error;
+        if (!copied && (error == EINVAL || error == ENOSYS || error == EPERM || error == EOPNOTSUPP)) //kernels before 5.6 have no IORING_OP_READ, seccomp can refuse io_uring_enter
+            uringUnavailable(error);
+    }
+    if (ioEngineChoice == IO_THREADS)
+    {
+        copyPool pool = {volume, blocks, blockCount, 0, ioBlockBytes, 0};
+        int threadCount = (size_t)ioQueueDepth < blockCount ? ioQueueDepth : (int)blockCount;
+        pthread_t *threads = malloc((threadCount > 0 ? threadCount : 1) * sizeof(pthread_t));
+        assert(threads != NULL);
+        for (int i = 0; i < threadCount; i++)
+            pthread_create(&threads[i], NULL, copyWorkerMain, &pool);
+        for (int i = 0; i < threadCount; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+        copied = pool.error == 0;
+        errno = pool.error;
+    }
+    free(blocks);
+    int error = errno;
+    statsPhase(PHASE_COPY, start, 0);
+    errno = error;
+    return copied;
+}
+
+//input: the chunkPool shared by all workers
+//worker of copyChunks: opens its own descriptor of the output (sendfile writes at the file position, which must not be shared) and copies chunks until none are left or one failed
+void *chunkWorkerMain(void *argument)
+{
+    chunkPool *pool = argument;
+    int out = open(pool->name, O_WRONLY);
+    uint8_t *buffer = aligned_alloc(COPY_BUFFER_ALIGNMENT, COPY_BUFFER_BYTES); //only touched by the last fallback of copyToFile
+    int expected = 0;
+    assert(buffer != NULL);
+
+    if (out < 0)
+        __atomic_compare_exchange_n(&pool->error, &expected, errno, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&pool->error, __ATOMIC_RELAXED) == 0)
+    {
+        size_t index = __atomic_fetch_add(&pool->nextChunk, 1, __ATOMIC_RELAXED);
+        if (index >= pool->chunkCount)
+            break;
+        const copyRequest *chunk = &pool->chunks[index];
+        if (!copyToFile(pool->volume, out, chunk->volumeOffset, chunk->fileOffset, chunk->length, buffer))
+        {
+            int error = errno != 0 ? errno : EIO;
+            __atomic_compare_exchange_n(&pool->error, &expected, error, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+    if (out >= 0)
+        close(out);
+    free(buffer);
+    return NULL;
+}
+
+//------------------------------------------------------
+// copyChunks
+//
+// PURPOSE: Copy one large file with several threads: its extents are cut into copyChunkBytes chunks and each thread copies whole chunks with copyToFile (kernel copies first, pread/pwrite as the last fallback), so a striped or NVMe device serves several streams at once
+// INPUT PARAMETERS:
+//     the volume, the output's name (already created), the file's copies (one per extent) and how many
+// OUTPUT PARAMETERS:
+//      true if everything was copied, false with errno set otherwise
+//------------------------------------------------------
+bool copyChunks(const exfatVolume *volume, const char *name, const copyRequest *requests, size_t requestCount)
+{
+    uint64_t start = statsClock();
+    size_t chunkCount;
+    copyRequest *chunks = splitCopies(requests, requestCount, copyChunkBytes, &chunkCount);
+    chunkPool pool = {volume, name, chunks, chunkCount, 0, 0};
+    int threadCount = (size_t)copyThreads < chunkCount ? copyThreads : (int)chunkCount;
+    pthread_t *threads = malloc((threadCount > 0 ? threadCount : 1) * sizeof(pthread_t));
+    assert(threads != NULL);
+
+    for (int i = 0; i < threadCount; i++)
+        pthread_create(&threads[i], NULL, chunkWorkerMain, &pool);
+    for (int i = 0; i < threadCount; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    free(chunks);
+    statsPhase(PHASE_COPY, start, 0);
+    errno = pool.error;
+    return pool.error == 0;
+}
+
+//input: the hash pipeline
+//thread hashing the blocks of a file in the order they were queued, while the next ones are being read and written
+void *hashWorkerMain(void *argument)
+{
+    hashPipeline *pipeline = argument;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (true)
+    {
+        while (pipeline->hashed == pipeline->queued && !pipeline->finished)
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        if (pipeline->hashed == pipeline->queued)
+            break;
+        int slot = pipeline->hashed % HASH_PIPELINE_BUFFERS;
+        pthread_mutex_unlock(&pipeline->lock);
+        hashUpdate(&pipeline->hash, pipeline->blocks[slot], pipeline->lengths[slot]);
+        STAT_ADD(STAT_BYTES_HASHED, pipeline->lengths[slot]);
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->hashed++;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+//input: the hash pipeline
+//returns the slot the next block goes in, once the hashing thread has finished with it
+int freeHashSlot(hashPipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->queued - pipeline->hashed == HASH_PIPELINE_BUFFERS)
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    pthread_mutex_unlock(&pipeline->lock);
+    return pipeline->queued % HASH_PIPELINE_BUFFERS;
+}
+
+//input: the hash pipeline, the slot from freeHashSlot, the block's data and length
+//hands the block to the hashing thread
+void queueHashBlock(hashPipeline *pipeline, int slot, const uint8_t *data, size_t length)
+{
+    pipeline->blocks[slot] = data;
+    pipeline->lengths[slot] = length;
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->queued++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+//------------------------------------------------------
+// copyAndHash
+//
+// PURPOSE: Copy a file's extents into its output and compute the digest chosen by --hash in the same pass. Each block is read once (or taken straight from the mapping) and written, then handed to a hashing thread, which works on it while the following blocks are read and written. The part past the copies, which the output gets as a hole, is hashed as the zeros it reads as, so the digest is that of the extracted file.
+// INPUT PARAMETERS:
+//     the volume, the output file, its copies (in file order, from offset 0) and how many, the file's DataLength, where to put the digest
+// OUTPUT PARAMETERS:
+//      the number of digest bytes, 0 if a write failed (errno set)
+//------------------------------------------------------
+size_t copyAndHash(const exfatVolume *volume, int out, const copyRequest *requests, size_t requestCount, uint64_t length, uint8_t *digest)
+{
+    static const uint8_t zeros[COPY_BUFFER_BYTES];
+    hashPipeline pipeline;
+    pthread_t hasher;
+    uint64_t fileOffset = 0;
+    bool copied = true;
+    size_t digestLength;
+    int writeError;
+
+    hashInit(&pipeline.hash, hashChoice);
+    pipeline.queued = pipeline.hashed = 0;
+    pipeline.finished = false;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.changed, NULL);
+    for (int s = 0; s < HASH_PIPELINE_BUFFERS; s++)
+    {
+        pipeline.buffers[s] = aligned_alloc(COPY_BUFFER_ALIGNMENT, COPY_BUFFER_BYTES); //only touched when the volume is not mapped
+        assert(pipeline.buffers[s] != NULL);
+    }
+    pthread_create(&hasher, NULL, hashWorkerMain, &pipeline);
+
+    for (size_t r = 0; r < requestCount && copied; r++)
+    {
+        for (uint64_t done = 0; done < requests[r].length && copied;)
+        {
+            size_t bytesToCopy = requests[r].length - done < COPY_BUFFER_BYTES ? requests[r].length - done : COPY_BUFFER_BYTES;
+            int slot = freeHashSlot(&pipeline);
+            const uint8_t *data = volumeData(volume, requests[r].volumeOffset + done, bytesToCopy, pipeline.buffers[slot]);
+            size_t written = 0;
+            while (written < bytesToCopy && copied)
+            {
+                ssize_t result = pwrite(out, data + written, bytesToCopy - written, fileOffset + written);
+                STAT_ADD(STAT_WRITE_CALLS, 1);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result == 0) //no progress and no error, report it as one
+                    errno = EIO;
+                copied = result > 0;
+                written += copied ? result : 0;
+            }
+            STAT_ADD(STAT_BYTES_WRITTEN, written);
+            if (!copied) //the slot was never queued, so the hasher is simply told to finish
+                break;
+            queueHashBlock(&pipeline, slot, data, bytesToCopy);
+            done += bytesToCopy;
+            fileOffset += bytesToCopy;
+        }
+    }
+    writeError = errno; //kept across the teardown below
+    while (copied && fileOffset < length) //never written, or missing from a broken chain
+    {
+        size_t zeroBytes = length - fileOffset < COPY_BUFFER_BYTES ? length - fileOffset : COPY_BUFFER_BYTES;
+        queueHashBlock(&pipeline, freeHashSlot(&pipeline), zeros, zeroBytes);
+        fileOffset += zeroBytes;
+    }
+
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.finished = true;
+    pthread_cond_broadcast(&pipeline.changed);
+    pthread_mutex_unlock(&pipeline.lock);
+    pthread_join(hasher, NULL);
+    digestLength = hashFinal(&pipeline.hash, digest);
+    for (int s = 0; s < HASH_PIPELINE_BUFFERS; s++)
+        free(pipeline.buffers[s]);
+    pthread_cond_destroy(&pipeline.changed);
+    pthread_mutex_destroy(&pipeline.lock);
+    errno = writeError;
+    return copied ? digestLength : 0;
+}
+
+//------------------------------------------------------
+// getFile
+//
+// PURPOSE: Copy the chosen file from the file system to the current directory, one extent (run of contiguous clusters) at a time. Only the bytes before ValidDataLength are copied (into a preallocated output), the never written tail after them is left as a hole. A file larger than a chunk is copied by copyChunks when the default I/O engine is in use. With --hash the copy goes through copyAndHash instead and the digest is printed like sha256sum does.
+// INPUT PARAMETERS:
+//     the volume, the name of the file to be created, the cluster to look at, the bytes of the file (length), how many of them were ever written (ValidDataLength), NoFatChain flag of the file
+// OUTPUT PARAMETERS:
+//      true if the whole file was written, false (after reporting why) if it could not be created, a copy failed or its cluster chain ended early
+//------------------------------------------------------
+bool getFile(const exfatVolume *volume, const char *name, uint32_t startCluster, uint64_t length, uint64_t validLength, bool noFatChain)
+{
+    int out = open(name, O_WRONLY | O_CREAT | O_TRUNC, PERMISSIONS);
+    uint64_t bytesWritten = 0;
+    uint64_t bytesPerCluster = volume->bytesPerCluster;
+    int extentCount;
+    extent *extents;
+    copyRequest *requests;
+    size_t requestCount = 0;
+    bool copied;
+    uint8_t digest[MAX_DIGEST_BYTES];
+    size_t digestLength = 0;
+
+    if (out < 0)
+    {
+        perror(name);
+        return false;
+    }
+    if (validLength > 0)
+        fallocate(out, 0, 0, validLength); //one allocation up front, ignored where the file system cannot do it
+    extents = fileExtents(volume, startCluster, validLength, noFatChain, &extentCount);
+    requests = malloc((extentCount > 0 ? extentCount : 1) * sizeof(copyRequest));
+    assert(requests != NULL);
+
+    for (int i = 0; i < extentCount && bytesWritten != validLength; i++)
+    {
+        copyRequest *request = &requests[requestCount++];
+        request->out = out;
+        request->volumeOffset = findOffsetToCluster(volume, extents[i].startCluster);
+        request->fileOffset = bytesWritten;
+        request->length = extents[i].count * bytesPerCluster;
+        if (validLength - bytesWritten < request->length)
+            request->length = validLength - bytesWritten;
+        bytesWritten += request->length;
+    }
+    STAT_ADD(STAT_SPARSE_BYTES, length - validLength);
+    if (hashChoice != HASH_NONE) //the data has to pass through user space to be hashed, so no kernel copies or engines
+        copied = (digestLength = copyAndHash(volume, out, requests, requestCount, length, digest)) > 0;
+    else if (ioEngineChoice == IO_SYNC && copyThreads > 1 && validLength > copyChunkBytes)
+        copied = copyChunks(volume, name, requests, requestCount);
+    else
+        copied = runCopies(volume, requests, requestCount);
+    if (!copied)
+        perror(name);
+    if (copied && bytesWritten < validLength)
+    {
+        fprintf(stderr, "%s: cluster chain ends after %llu of its %llu bytes\n", name, (unsigned long long)bytesWritten, (unsigned long long)validLength);
+        copied = false;
+    }
+    if (digestLength > 0 && copied)
+    {
+        for (size_t i = 0; i < digestLength; i++)
+            printf("%02x", digest[i]);
+        printf("  %s\n", name);
+    }
+    if (ftruncate(out, length) != 0 && copied) //exactly DataLength bytes, whatever was there before. the part past what was copied reads as zeros
+    {
+        perror(name);
+        copied = false;
+    }
+    if (close(out) != 0 && copied) //NFS and the like report failed writes here
+    {
+        perror(name);
+        copied = false;
+    }
+    free(requests);
+    free(extents);
+    return copied;
+}
+
+//input: a path as typed by the user
+//returns a heap copy with leading, trailing and doubled slashes removed ("/a//b/" gives "a/b"), the same splitting get uses
+char *normalisePath(const char *userPath)
+{
+    char *myPath = strdup(userPath);
+    char *normalised = calloc(strlen(userPath) + 1, 1);
+    char *component;
+    assert(myPath != NULL && normalised != NULL);
+
+    for (component = strtok(myPath, "/"); component != NULL; component = strtok(NULL, "/"))
+    {
+        if (normalised[0] != '\0')
+            strcat(normalised, "/");
+        strcat(normalised, component);
+    }
+    free(myPath);
+    return normalised;
+}
+
+//------------------------------------------------------
+// get
+//
+// PURPOSE: Execute the get command: look the path up on the volume and copy the file it names to the current directory
+// INPUT PARAMETERS:
+//     the volume, the path as typed by the user
+// OUTPUT PARAMETERS:
+//      false if the path names no file on the volume or the file could not be copied whole
+//------------------------------------------------------
+bool get(exfatVolume *volume, const char *userPath)
+{
+    dirEntry file;
+    char *normalised = normalisePath(userPath);
+    char *fileName = strrchr(normalised, '/') != NULL ? strrchr(normalised, '/') + 1 : normalised;
+    bool copied = true;
+
+    if (lookupPath(volume, normalised, &file) && !file.directory)
+        copied = getFile(volume, fileName, file.firstCluster, file.dataLength, file.validDataLength, file.noFatChain);
+    else
+    {
+        fprintf(stderr, "not found: %s\n", userPath);
+        copied = false;
+    }
+    free(normalised);
+    return copied;
+}
+
+//------------------------------------------------------
+// hashBytes
+//
+// PURPOSE: Mix a block of bytes into a 64 bit hash, 8 bytes at a time. Used for index keys and for the metadata checksum that tells whether an index is stale.
+// INPUT PARAMETERS:
+//     hash so far (HASH_SEED to start), the bytes, how many there are
+// OUTPUT PARAMETERS:
+//      the updated hash
+//------------------------------------------------------
+uint64_t hashBytes(uint64_t hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    uint64_t word;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= length; i += sizeof(word))
+    {
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * HASH_MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    for (; i < length; i++)
+    {
+        hash = (hash ^ bytes[i]) * HASH_MULTIPLIER;
+    }
+    return hash ^ (hash >> 32);
+}
+
+//input: the volume, a path and its length
+//returns the index key of the path, which ignores case like exFAT name lookups do
+uint64_t hashPath(exfatVolume *volume, const char *path, size_t length)
+{
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+    char *upcased = malloc(length + 1);
+    uint64_t hash;
+    assert(upcased != NULL);
+
+    for (size_t i = 0; i < length; i++)
+        upcased[i] = (char)upcaseTable[(unsigned char)path[i]];
+    hash = hashBytes(HASH_SEED, upcased, length);
+    free(upcased);
+    return hash;
+}
+
+//------------------------------------------------------
+// metadataChecksum
+//
+// PURPOSE: Checksum what tells cheaply whether a volume is the one an index was built from: the checksum of the main boot region and, when the volume is an image file, its size and modification time. It costs a few sectors, not a walk of the tree; changes inside the tree that it cannot see (on a block device there is no modification time) are caught per lookup by indexPathCurrent.
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      the checksum
+//------------------------------------------------------
+uint64_t metadataChecksum(const exfatVolume *volume)
+{
+    uint64_t hash = HASH_SEED;
+    uint32_t bootChecksum = 0;
+    struct stat volumeInfo;
+
+    bootRegionChecksum(volume, 0, &bootChecksum);
+    hash = hashBytes(hash, &bootChecksum, sizeof(bootChecksum));
+    if (fstat(volume->fd, &volumeInfo) == 0 && S_ISREG(volumeInfo.st_mode))
+    {
+        int64_t stamp[3] = {volumeInfo.st_size, volumeInfo.st_mtim.tv_sec, volumeInfo.st_mtim.tv_nsec};
+        hash = hashBytes(hash, stamp, sizeof(stamp));
+    }
+    return hash;
+}
+
+//input: the volume, a directory's first cluster, DataLength (0 for the root) and NoFatChain flag
+//returns hashBytes of the directory as stored, without decoding it
+uint64_t directoryContents(const exfatVolume *volume, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
+{
+    dirIterator directory;
+    uint64_t hash;
+
+    openDirectory(volume, &directory, firstCluster, dataLength, noFatChain);
+    hash = hashBytes(HASH_SEED, directory.contents, directory.length);
+    closeDirectory(&directory);
+    return hash;
+}
+
+//------------------------------------------------------
+// indexRecurse
+//
+// PURPOSE: Add every entry of a directory, and recursively of its sub directories, to the index being built
+// INPUT PARAMETERS:
+//     the volume, the index being built, the directory's first cluster, DataLength (0 for the root) and NoFatChain flag, its path ("" for the root)
+// OUTPUT PARAMETERS:
+//      hashBytes of the directory as stored, for its record
+//------------------------------------------------------
+uint64_t indexRecurse(exfatVolume *volume, indexBuilder *builder, uint32_t firstCluster, uint64_t dataLength, bool noFatChain, const char *directoryPath)
+{
+    dirIterator directoryIterator;
+    dirEntry file;
+    char *asciiString;
+
+    openDirectory(volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+    uint64_t contents = hashBytes(HASH_SEED, directoryIterator.contents, directoryIterator.length);
+    while (nextDirEntry(&directoryIterator, &file))
+    {
+        asciiString = unicode2ascii(file.name, file.nameLength);
+        size_t pathLength = strlen(directoryPath) + (directoryPath[0] != '\0') + strlen(asciiString);
+
+        if (builder->recordCount == builder->recordCapacity)
+        {
+            builder->recordCapacity = builder->recordCapacity > 0 ? builder->recordCapacity * 2 : 256;
+            builder->records = realloc(builder->records, builder->recordCapacity * sizeof(indexRecord));
+            assert(builder->records != NULL);
+        }
+        while (builder->stringsLength + pathLength + 1 > builder->stringsCapacity)
+        {
+            builder->stringsCapacity = builder->stringsCapacity > 0 ? builder->stringsCapacity * 2 : 4096;
+            builder->strings = realloc(builder->strings, builder->stringsCapacity);
+            assert(builder->strings != NULL);
+        }
+
+        char *entryPath = builder->strings + builder->stringsLength;
+        sprintf(entryPath, "%s%s%s", directoryPath, directoryPath[0] != '\0' ? "/" : "", asciiString);
+        indexRecord *record = &builder->records[builder->recordCount++];
+        memset(record, 0, sizeof(indexRecord));
+        record->pathHash = hashPath(volume, entryPath, pathLength);
+        record->pathOffset = builder->stringsLength;
+        record->pathLength = pathLength;
+        record->firstCluster = file.firstCluster;
+        record->dataLength = file.dataLength;
+        record->validDataLength = file.validDataLength;
+        record->attributes = file.attributes;
+        record->generalFlags = file.generalFlags;
+        builder->stringsLength += pathLength + 1;
+
+        if (file.directory)
+        {
+            //entryPath and record may move when strings and records grow, recurse with a private copy and store through the record's number
+            char *childPath = strdup(entryPath);
+            uint32_t recordNumber = builder->recordCount - 1;
+            uint64_t childContents = indexRecurse(volume, builder, file.firstCluster, file.dataLength, file.noFatChain, childPath);
+            builder->records[recordNumber].contents = childContents;
+            free(childPath);
+        }
+        free(asciiString);
+    }
+    closeDirectory(&directoryIterator);
+    return contents;
+}
+
+//------------------------------------------------------
+// buildIndex
+//
+// PURPOSE: Walk the whole tree once and write the sidecar index: a header tying it to this volume, an open addressing hash table of full paths, the records and the path strings. The file is written under a temporary name and renamed into place.
+// INPUT PARAMETERS:
+//     the volume, path of the index file
+// OUTPUT PARAMETERS:
+//      number of entries indexed, -1 if the index could not be written
+//------------------------------------------------------
+long buildIndex(exfatVolume *volume, const char *indexFile)
+{
+    indexBuilder builder = {0};
+    indexHeader header = {0};
+    uint32_t *buckets;
+    char *temporaryFile;
+    int out;
+    bool written;
+
+    header.rootContents = indexRecurse(volume, &builder, volume->rootDirectory, 0, false, "");
+
+    header.bucketCount = INDEX_MIN_BUCKETS;
+    while (header.bucketCount < builder.recordCount * 2)
+        header.bucketCount *= 2;
+    buckets = calloc(header.bucketCount, sizeof(uint32_t));
+    assert(buckets != NULL);
+    for (uint32_t i = 0; i < builder.recordCount; i++)
+    {
+        uint32_t slot = builder.records[i].pathHash & (header.bucketCount - 1);
+        while (buckets[slot] != 0) //linear probing
+            slot = (slot + 1) & (header.bucketCount - 1);
+        buckets[slot] = i + 1; //0 marks an empty bucket
+    }
+
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.serialNumber = volume->serialNumber;
+    header.metadataChecksum = metadataChecksum(volume);
+    header.recordCount = builder.recordCount;
+
+    temporaryFile = malloc(strlen(indexFile) + 5);
+    assert(temporaryFile != NULL);
+    sprintf(temporaryFile, "%s.tmp", indexFile);
+    out = open(temporaryFile, O_WRONLY | O_CREAT | O_TRUNC, PERMISSIONS);
+    written = out >= 0 &&
+              write(out, &header, sizeof(header)) == sizeof(header) &&
+              write(out, buckets, header.bucketCount * sizeof(uint32_t)) == (ssize_t)(header.bucketCount * sizeof(uint32_t)) &&
+              write(out, builder.records, builder.recordCount * sizeof(indexRecord)) == (ssize_t)(builder.recordCount * sizeof(indexRecord)) &&
+              write(out, builder.strings, builder.stringsLength) == (ssize_t)builder.stringsLength;
+    if (out >= 0)
+        close(out);
+    if (written)
+        written = rename(temporaryFile, indexFile) == 0;
+    else
+        unlink(temporaryFile);
+
+    free(temporaryFile);
+    free(buckets);
+    free(builder.records);
+    free(builder.strings);
+    return written ? (long)header.recordCount : -1;
+}
+
+//------------------------------------------------------
+// openIndex
+//
+// PURPOSE: Map an index file and check that it belongs to this volume and that the volume's boot region (and, for an image file, its size and modification time) have not changed since it was built. Changes inside the tree are checked per lookup by indexPathCurrent.
+// INPUT PARAMETERS:
+//     the volume, path of the index file, where to store the mapping's size
+// OUTPUT PARAMETERS:
+//      the mapped index, NULL if it is missing, damaged or stale (anything mapped is unmapped again)
+//------------------------------------------------------
+const uint8_t *openIndex(const exfatVolume *volume, const char *indexFile, size_t *indexSize)
+{
+    struct stat indexInfo;
+    const indexHeader *header;
+    const uint8_t *index;
+    int fd = open(indexFile, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &indexInfo) != 0 || (size_t)indexInfo.st_size < sizeof(indexHeader))
+    {
+        close(fd);
+        return NULL;
+    }
+    *indexSize = indexInfo.st_size;
+    index = mmap(NULL, *indexSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)
+        return NULL;
+
+    header = (const indexHeader *)index;
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_VERSION ||
+        header->serialNumber != volume->serialNumber || header->bucketCount == 0 ||
+        sizeof(indexHeader) + (uint64_t)header->bucketCount * sizeof(uint32_t) + (uint64_t)header->recordCount * sizeof(indexRecord) > *indexSize ||
+        header->metadataChecksum != metadataChecksum(volume))
+    {
+        munmap((void *)index, *indexSize);
+        return NULL;
+    }
+    return index;
+}
+
+//------------------------------------------------------
+// lookupIndex
+//
+// PURPOSE: Find a full path in a mapped index with one hash lookup, ignoring case like exFAT does
+// INPUT PARAMETERS:
+//     the volume, the mapped index and its size, the normalised path (no leading or doubled slashes)
+// OUTPUT PARAMETERS:
+//      the record for the path, NULL if it is not on the volume
+//------------------------------------------------------
+const indexRecord *lookupIndex(exfatVolume *volume, const uint8_t *index, size_t indexSize, const char *wantedPath)
+{
+    const indexHeader *header = (const indexHeader *)index;
+    const uint32_t *buckets = (const uint32_t *)(index + sizeof(indexHeader));
+    const indexRecord *records = (const indexRecord *)(buckets + header->bucketCount);
+    const char *strings = (const char *)(records + header->recordCount);
+    size_t stringsLength = indexSize - (strings - (const char *)index);
+    size_t wantedLength = strlen(wantedPath);
+    uint64_t wantedHash = hashPath(volume, wantedPath, wantedLength);
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+    uint32_t slot = wantedHash & (header->bucketCount - 1);
+
+    for (uint32_t probes = 0; probes < header->bucketCount && buckets[slot] != 0; probes++)
+    {
+        uint32_t recordIndex = buckets[slot] - 1;
+        if (recordIndex < header->recordCount)
+        {
+            const indexRecord *record = &records[recordIndex];
+            if (record->pathHash == wantedHash && record->pathLength == wantedLength &&
+                (uint64_t)record->pathOffset + wantedLength <= stringsLength)
+            {
+                size_t i = 0;
+                while (i < wantedLength && upcaseTable[(unsigned char)strings[record->pathOffset + i]] == upcaseTable[(unsigned char)wantedPath[i]])
+                    i++;
+                if (i == wantedLength)
+                    return record;
+            }
+        }
+        slot = (slot + 1) & (header->bucketCount - 1);
+    }
+    return NULL;
+}
+
+//------------------------------------------------------
+// indexPathCurrent
+//
+// PURPOSE: Check, before an index lookup is trusted, that the directories it depends on are unchanged: the root and every directory along the path, down to the deepest one the index has. Each is hashed as stored and compared with the hash recorded when the index was built. A rename, resize, addition or removal in one of them changes its bytes; a change anywhere else cannot affect this path. Only the directories on the path are read, never the whole tree.
+// INPUT PARAMETERS:
+//     the volume, the mapped index and its size, the normalised path
+// OUTPUT PARAMETERS:
+//      true if the index's answer for the path (found or not found) is still right
+//------------------------------------------------------
+bool indexPathCurrent(exfatVolume *volume, const uint8_t *index, size_t indexSize, const char *wantedPath)
+{
+    const indexHeader *header = (const indexHeader *)index;
+    char *prefix = strdup(wantedPath);
+    bool current = directoryContents(volume, volume->rootDirectory, 0, false) == header->rootContents;
+    assert(prefix != NULL);
+
+    //every directory on the path: the parent of the wanted entry and its ancestors, while the index has them
+    for (char *slash = strchr(prefix, '/'); current && slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        const indexRecord *record = lookupIndex(volume, index, indexSize, prefix);
+        *slash = '/';
+        if (record == NULL || (record->attributes & FILE_BIT_OFFSET) == 0)
+            break; //the path ends here, and the directory holding that answer has been checked
+        current = directoryContents(volume, record->firstCluster, record->dataLength, (record->generalFlags & NO_FAT_CHAIN_FLAG) != 0) == record->contents;
+    }
+    free(prefix);
+    return current;
+}
+
+//------------------------------------------------------
+// getIndexed
+//
+// PURPOSE: Execute the get command through the sidecar index instead of walking the tree. A missing or stale index is rebuilt first.
+// INPUT PARAMETERS:
+//     the volume, path of the index file, the path as typed by the user
+// OUTPUT PARAMETERS:
+//      false if the path names no file on the volume or the file could not be copied whole
+//------------------------------------------------------
+bool getIndexed(exfatVolume *volume, const char *indexFile, const char *userPath)
+{
+    size_t indexSize = 0;
+    const uint8_t *index = openIndex(volume, indexFile, &indexSize);
+    char *normalised = normalisePath(userPath);
+    char *fileName = strrchr(normalised, '/') != NULL ? strrchr(normalised, '/') + 1 : normalised;
+    bool copied = true;
+
+    if (index != NULL && !indexPathCurrent(volume, index, indexSize, normalised)) //something on the path changed, the index is stale
+    {
+        munmap((void *)index, indexSize);
+        index = NULL;
+    }
+    if (index == NULL && buildIndex(volume, indexFile) >= 0)
+        index = openIndex(volume, indexFile, &indexSize);
+
+    if (index != NULL && fileName[0] != '\0')
+    {
+        const indexRecord *record = lookupIndex(volume, index, indexSize, normalised);
+        if (record != NULL && (record->attributes & FILE_BIT_OFFSET) == 0)
+            copied = getFile(volume, fileName, record->firstCluster, record->dataLength, record->validDataLength, (record->generalFlags & NO_FAT_CHAIN_FLAG) != 0);
+        else
+        {
+            fprintf(stderr, "not found: %s\n", userPath);
+            copied = false;
+        }
+    }
+    else if (fileName[0] != '\0')
+    {
+        copied = get(volume, userPath); //index unusable (e.g. read-only directory), fall back to walking the tree
+    }
+    else
+    {
+        fprintf(stderr, "not found: %s\n", userPath); //the root directory is not a file
+        copied = false;
+    }
+
+    if (index != NULL)
+        munmap((void *)index, indexSize);
+    free(normalised);
+    return copied;
+}
+
+//input: the volume, a path to up-case in place
+void upcasePath(exfatVolume *volume, char *userPath)
+{
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+
+    for (; *userPath != '\0'; userPath++)
+        *userPath = (char)upcaseTable[(unsigned char)*userPath];
+}
+
+//input: the volume, text to up-case in place
+//like upcasePath but only for ASCII, leaving the bytes of UTF-8 sequences alone
+void upcaseAscii(exfatVolume *volume, char *text)
+{
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+
+    for (; *text != '\0'; text++)
+        if ((unsigned char)*text < 0x80)
+            *text = (char)upcaseTable[(unsigned char)*text];
+}
+
+//------------------------------------------------------
+// matchComponents
+//
+// PURPOSE: Match the components of a path against those of a --path glob, where "**" stands for any number of components (none included) and every other component is an fnmatch pattern for exactly one
+// INPUT PARAMETERS:
+//     the glob's components and their number, the path's components and their number, whether to ask instead if a path below this one could match
+// OUTPUT PARAMETERS:
+//      true if the path matches (with belowOnly, if something below it could)
+//------------------------------------------------------
+bool matchComponents(char **pattern, int patternCount, char **path, int pathCount, bool belowOnly)
+{
+    if (patternCount > 0 && strcmp(pattern[0], "**") == 0)
+        return matchComponents(pattern + 1, patternCount - 1, path, pathCount, belowOnly) ||
+               (pathCount > 0 && matchComponents(pattern, patternCount, path + 1, pathCount - 1, belowOnly)) ||
+               (pathCount == 0 && belowOnly);
+    if (pathCount == 0)
+        return belowOnly ? patternCount > 0 : patternCount == 0;
+    if (patternCount == 0)
+        return false;
+    return fnmatch(pattern[0], path[0], 0) == 0 && matchComponents(pattern + 1, patternCount - 1, path + 1, pathCount - 1, belowOnly);
+}
+
+//input: the search, a UTF-8 path from the root and its length, whether to ask instead if a path below it could match
+//returns true if the path satisfies --path (always when it was not given)
+bool pathMatches(const finder *search, const char *path, size_t pathLength, bool belowOnly)
+{
+    char *copy;
+    char **components;
+    int componentCount = 0;
+    bool matches;
+
+    if (search->pathComponents == NULL)
+        return true;
+    copy = malloc(pathLength + 1);
+    components = malloc((pathLength / 2 + 2) * sizeof(char *)); //a component and a slash take at least two bytes
+    assert(copy != NULL && components != NULL);
+    memcpy(copy, path, pathLength);
+    copy[pathLength] = '\0';
+    upcaseAscii(search->volume, copy);
+    for (char *saveptr = NULL, *token = strtok_r(copy, "/", &saveptr); token != NULL; token = strtok_r(NULL, "/", &saveptr))
+        components[componentCount++] = token;
+    matches = matchComponents(search->pathComponents, search->pathComponentCount, components, componentCount, belowOnly);
+    free(components);
+    free(copy);
+    return matches;
+}
+
+//input: the search, the list output holding the entry's path
+//returns true if the last component of the path satisfies --name (always when it was not given)
+bool nameMatches(const finder *search, const listOutput *output)
+{
+    const char *name = memrchr(output->path, '/', output->pathLength);
+    size_t nameLength;
+    char *upcased;
+    bool matches;
+
+    if (search->name == NULL)
+        return true;
+    name = name != NULL ? name + 1 : output->path;
+    nameLength = output->path + output->pathLength - name;
+    upcased = malloc(nameLength + 1);
+    assert(upcased != NULL);
+    memcpy(upcased, name, nameLength);
+    upcased[nameLength] = '\0';
+    upcaseAscii(search->volume, upcased);
+    matches = fnmatch(search->name, upcased, 0) == 0;
+    free(upcased);
+    return matches;
+}
+
+//input: the search, an entry set
+//returns true if the entry passes the tests that need no name: --type, --min-size, --max-size and --attr
+bool cheapFiltersMatch(const finder *search, const dirEntry *file)
+{
+    const findQuery *query = search->query;
+
+    if ((query->type == 'f' && file->directory) || (query->type == 'd' && !file->directory))
+        return false;
+    if (file->dataLength < query->minSize || file->dataLength > query->maxSize)
+        return false;
+    return (file->attributes & query->attributes) == query->attributes;
+}
+
+//input: the search, a thread's list output
+//writes out what the thread has buffered, under the search's lock so output of different threads never interleaves
+void flushFind(finder *search, listOutput *output)
+{
+    pthread_mutex_lock(&search->lock);
+    flushList(output);
+    pthread_mutex_unlock(&search->lock);
+}
+
+//------------------------------------------------------
+// findRecurse
+//
+// PURPOSE: Search one directory. A name is only converted when the entry passes the cheap tests or is a directory that has to be searched, and subdirectories --path rules out are never opened. With one thread the others are searched at once, depth first like listRecurse; with more they are queued for the next level.
+// INPUT PARAMETERS:
+//     the search, list output holding the directory's path, the cluster to look at, DataLength of the directory (0 for the root), NoFatChain flag of the directory
+//------------------------------------------------------
+void findRecurse(finder *search, listOutput *output, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
+{
+    dirIterator directoryIterator;
+    dirEntry file;
+    size_t parentLength = output->pathLength;
+
+    openDirectory(search->volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+    while (nextDirEntry(&directoryIterator, &file))
+    {
+        bool candidate = cheapFiltersMatch(search, &file);
+        if (!candidate && !file.directory)
+            continue;
+
+        appendPathName(output, &file);
+        if (candidate && nameMatches(search, output) && pathMatches(search, output->path, output->pathLength, false))
+        {
+            if (output->format == LIST_TEXT)
+            {
+                writeList(output, output->path, output->pathLength);
+                writeList(output, "\n", 1);
+            }
+            else
+            {
+                writeListEntry(search->volume, output, &file, 0);
+            }
+            if (search->threadCount > 1 && output->length > LIST_BUFFER_BYTES / 2) //flush whole entries only
+                flushFind(search, output);
+        }
+
+        if (file.directory && pathMatches(search, output->path, output->pathLength, true))
+        {
+            if (search->threadCount == 1)
+            {
+                findRecurse(search, output, file.firstCluster, file.dataLength, file.noFatChain);
+            }
+            else
+            {
+                findDirectory child = {file.firstCluster, file.dataLength, file.noFatChain, malloc(output->pathLength), output->pathLength};
+                assert(child.path != NULL);
+                memcpy(child.path, output->path, output->pathLength);
+                pthread_mutex_lock(&search->lock);
+                if (search->nextLevelCount == search->nextLevelCapacity)
+                {
+                    search->nextLevelCapacity = search->nextLevelCapacity > 0 ? search->nextLevelCapacity * 2 : 64;
+                    search->nextLevel = realloc(search->nextLevel, search->nextLevelCapacity * sizeof(findDirectory));
+                    assert(search->nextLevel != NULL);
+                }
+                search->nextLevel[search->nextLevelCount++] = child;
+                pthread_mutex_unlock(&search->lock);
+            }
+        }
+        output->pathLength = parentLength;
+    } //while more files at this level
+    closeDirectory(&directoryIterator);
+}
+
+//input: the search
+//thread of a parallel find: searches directories of the current level until none are left, writing out its matches after each
+void *findWorkerMain(void *argument)
+{
+    finder *search = argument;
+    listOutput output = {search->format, STDOUT_FILENO, false, malloc(LIST_BUFFER_BYTES), 0, NULL, 0, 0, false};
+    assert(output.buffer != NULL);
+
+    while (true)
+    {
+        size_t index = __atomic_fetch_add(&search->nextDirectory, 1, __ATOMIC_RELAXED);
+        if (index >= search->levelCount)
+            break;
+        findDirectory *directory = &search->level[index];
+        if (directory->pathLength > output.pathCapacity)
+        {
+            output.pathCapacity = directory->pathLength * 2;
+            output.path = realloc(output.path, output.pathCapacity);
+            assert(output.path != NULL);
+        }
+        memcpy(output.path, directory->path, directory->pathLength);
+        output.pathLength = directory->pathLength;
+        findRecurse(search, &output, directory->firstCluster, directory->dataLength, directory->noFatChain);
+        flushFind(search, &output);
+    }
+    free(output.buffer);
+    free(output.path);
+    return NULL;
+}
+
+//------------------------------------------------------
+// find
+//
+// PURPOSE: Execute the find command: write the path (or with --format=ndjson|binary the list record) of every entry below a directory that matches the query. Patterns are matched without regard to case. With one thread matches come out in tree order as they are found; with more, the directories of each tree level are searched concurrently and every thread writes out its matches as it finishes a directory.
+// INPUT PARAMETERS:
+//     the volume, the query, the directory to search as typed by the user (NULL for the root), the output format, the number of threads
+// OUTPUT PARAMETERS:
+//      false if the directory is not on the volume
+//------------------------------------------------------
+bool find(exfatVolume *volume, const findQuery *query, const char *userPath, listFormat format, int threadCount)
+{
+    finder search = {volume, query, format, threadCount, NULL, NULL, NULL, 0, NULL, 0, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+    findDirectory start = {volume->rootDirectory, 0, false, normalisePath(userPath != NULL ? userPath : ""), 0}; //the root directory always uses the FAT
+    listOutput output = {format, STDOUT_FILENO, false, malloc(LIST_BUFFER_BYTES), 0, NULL, 0, 0, false};
+    dirEntry directory;
+    assert(output.buffer != NULL);
+
+    start.pathLength = strlen(start.path);
+    if (start.pathLength > 0)
+    {
+        if (!lookupPath(volume, start.path, &directory) || !directory.directory)
+        {
+            fprintf(stderr, "%s: no such directory\n", userPath);
+            free(start.path);
+            free(output.buffer);
+            return false;
+        }
+        start.firstCluster = directory.firstCluster;
+        start.dataLength = directory.dataLength;
+        start.noFatChain = directory.noFatChain;
+    }
+    if (query->name != NULL)
+    {
+        search.name = strdup(query->name);
+        assert(search.name != NULL);
+        upcaseAscii(volume, search.name);
+    }
+    if (query->path != NULL)
+    {
+        search.pathText = strdup(query->path);
+        search.pathComponents = malloc((strlen(query->path) / 2 + 2) * sizeof(char *));
+        assert(search.pathText != NULL && search.pathComponents != NULL);
+        upcaseAscii(volume, search.pathText);
+        for (char *saveptr = NULL, *token = strtok_r(search.pathText, "/", &saveptr); token != NULL; token = strtok_r(NULL, "/", &saveptr))
+            search.pathComponents[search.pathComponentCount++] = token;
+    }
+
+    if (format == LIST_BINARY)
+    {
+        listHeader header = {LIST_MAGIC, LIST_VERSION, sizeof(listRecord)};
+        writeList(&output, &header, sizeof(header));
+    }
+    if (threadCount == 1)
+    {
+        output.path = start.path;
+        output.pathLength = output.pathCapacity = start.pathLength;
+        findRecurse(&search, &output, start.firstCluster, start.dataLength, start.noFatChain);
+        start.path = output.path; //appendPathName may have moved it
+        flushList(&output);
+        free(start.path);
+    }
+    else
+    {
+        pthread_t *threads = malloc(threadCount * sizeof(pthread_t));
+        assert(threads != NULL);
+        flushList(&output);
+        search.level = malloc(sizeof(findDirectory));
+        assert(search.level != NULL);
+        search.level[0] = start;
+        search.levelCount = 1;
+        while (search.levelCount > 0)
+        {
+            int started = (size_t)threadCount < search.levelCount ? threadCount : (int)search.levelCount;
+            search.nextDirectory = 0;
+            for (int i = 0; i < started; i++)
+                pthread_create(&threads[i], NULL, findWorkerMain, &search);
+            for (int i = 0; i < started; i++)
+                pthread_join(threads[i], NULL);
+            for (size_t i = 0; i < search.levelCount; i++)
+                free(search.level[i].path);
+            free(search.level);
+            search.level = search.nextLevel;
+            search.levelCount = search.nextLevelCount;
+            search.nextLevel = NULL;
+            search.nextLevelCount = search.nextLevelCapacity = 0;
+        }
+        free(search.level);
+        free(threads);
+    }
+    pthread_mutex_destroy(&search.lock);
+    free(search.name);
+    free(search.pathText);
+    free(search.pathComponents);
+    free(output.buffer);
+    return true;
+}
+
+//input: a size with an optional K, M, G or T suffix (powers of 1024)
+//returns it in bytes
+uint64_t parseSize(const char *text)
+{
+    const char *units = "KMGT";
+    char *suffix;
+    uint64_t size = strtoull(text, &suffix, 10);
+    const char *unit = *suffix != '\0' ? strchr(units, toupper((unsigned char)*suffix)) : NULL;
+
+    if (unit != NULL)
+        size <<= 10 * (unit - units + 1);
+    return size;
+}
+
+//input: --attr letters: r read-only, h hidden, s system, d directory, a archive
+//returns the attribute bits they stand for
+uint16_t parseAttributes(const char *letters)
+{
+    uint16_t attributes = 0;
+
+    for (; *letters != '\0'; letters++)
+    {
+        if (*letters == 'r')
+            attributes |= ATTRIBUTE_READ_ONLY;
+        else if (*letters == 'h')
+            attributes |= ATTRIBUTE_HIDDEN;
+        else if (*letters == 's')
+            attributes |= ATTRIBUTE_SYSTEM;
+        else if (*letters == 'd')
+            attributes |= FILE_BIT_OFFSET;
+        else if (*letters == 'a')
+            attributes |= ATTRIBUTE_ARCHIVE;
+        else
+            fprintf(stderr, "--attr: unknown attribute '%c'\n", *letters);
+    }
+    return attributes;
+}
+
+//input: a directory path
+//creates the directory and any missing parents, like mkdir -p
+void makeDirectories(const char *directoryPath)
+{
+    char *partial = strdup(directoryPath);
+    assert(partial != NULL);
+
+    for (char *slash = strchr(partial + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(partial, DIRECTORY_PERMISSIONS);
+        *slash = '/';
+    }
+    mkdir(partial, DIRECTORY_PERMISSIONS);
+    free(partial);
+}
+
+//qsort/bsearch comparison of two batch targets by their up-cased paths
+int compareTargets(const void *first, const void *second)
+{
+    return strcmp(((const batchTarget *)first)->key, ((const batchTarget *)second)->key);
+}
+
+//qsort comparison of two batch pieces by where they are on the volume
+int comparePieces(const void *first, const void *second)
+{
+    const batchPiece *a = first;
+    const batchPiece *b = second;
+    return (a->diskOffset > b->diskOffset) - (a->diskOffset < b->diskOffset);
+}
+
+//qsort comparison of two batch jobs by the first cluster of their files
+int compareJobs(const void *first, const void *second)
+{
+    const batchJob *a = first;
+    const batchJob *b = second;
+    return (a->firstCluster > b->firstCluster) - (a->firstCluster < b->firstCluster);
+}
+
+//input: the batch, an up-cased normalised volume path
+//returns the target equal to the path, NULL if it is not a target
+batchTarget *findTarget(batchPlan *plan, char *upcased)
+{
+    batchTarget probe = {upcased, NULL, false};
+    return bsearch(&probe, plan->targets, plan->targetCount, sizeof(batchTarget), compareTargets);
+}
+
+//input: the batch, an up-cased normalised directory path
+//returns true if some target lies inside the directory, so it has to be searched
+bool targetBelow(batchPlan *plan, const char *upcased)
+{
+    size_t length = strlen(upcased);
+    int low = 0;
+    int high = plan->targetCount;
+
+    //targets are sorted, so every "dir/..." target follows the first one not below "dir/"
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        int order = strncmp(plan->targets[middle].key, upcased, length);
+        if (order < 0 || (order == 0 && plan->targets[middle].key[length] < '/'))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < plan->targetCount && strncmp(plan->targets[low].key, upcased, length) == 0 && plan->targets[low].key[length] == '/';
+}
+
+//input: the batch, the file's path on the volume, its entry set
+//queues the file to be written to the same path under the destination
+void addBatchJob(batchPlan *plan, const char *volumePath, const dirEntry *file)
+{
+    if (plan->jobCount == plan->jobCapacity)
+    {
+        plan->jobCapacity = plan->jobCapacity > 0 ? plan->jobCapacity * 2 : 64;
+        plan->jobs = realloc(plan->jobs, plan->jobCapacity * sizeof(batchJob));
+        assert(plan->jobs != NULL);
+    }
+    batchJob *job = &plan->jobs[plan->jobCount++];
+    job->outputPath = malloc(strlen(plan->destination) + strlen(volumePath) + 2);
+    assert(job->outputPath != NULL);
+    sprintf(job->outputPath, "%s/%s", plan->destination, volumePath);
+    job->firstCluster = file->firstCluster;
+    job->dataLength = file->dataLength;
+    job->validDataLength = file->validDataLength;
+    job->noFatChain = file->noFatChain;
+    job->opened = false;
+    job->fd = -1;
+}
+
+//------------------------------------------------------
+// batchCollect
+//
+// PURPOSE: The metadata pass of a batch get. Walks only the directories that lead to a target, queues every target file and every file below a target directory, and creates the matching directories under the destination.
+// INPUT PARAMETERS:
+//     the batch, the directory's first cluster, DataLength (0 for the root) and NoFatChain flag, its path ("" for the root), true if the whole directory is being extracted
+//------------------------------------------------------
+void batchCollect(batchPlan *plan, uint32_t firstCluster, uint64_t dataLength, bool noFatChain, const char *directoryPath, bool wholeTree)
+{
+    dirIterator directoryIterator;
+    dirEntry file;
+
+    openDirectory(plan->volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+    while (nextDirEntry(&directoryIterator, &file))
+    {
+        char *asciiString = unicode2ascii(file.name, file.nameLength);
+        if (strcmp(asciiString, ".") == 0 || strcmp(asciiString, "..") == 0 || strchr(asciiString, '/') != NULL) //would escape the destination
+        {
+            free(asciiString);
+            continue;
+        }
+        char *childPath = malloc(strlen(directoryPath) + strlen(asciiString) + 2);
+        assert(childPath != NULL);
+        sprintf(childPath, "%s%s%s", directoryPath, directoryPath[0] != '\0' ? "/" : "", asciiString);
+        char *upcased = strdup(childPath);
+        assert(upcased != NULL);
+        upcasePath(plan->volume, upcased);
+
+        batchTarget *target = findTarget(plan, upcased); //looked up inside a whole tree too, so a target nested in another is found
+        if (target != NULL)
+            target->found = true;
+        bool selected = wholeTree || target != NULL;
+
+        if (selected || (file.directory && targetBelow(plan, upcased)))
+        {
+            char *outputPath = malloc(strlen(plan->destination) + strlen(childPath) + 2);
+            assert(outputPath != NULL);
+            sprintf(outputPath, "%s/%s", plan->destination, file.directory ? childPath : directoryPath);
+            if (file.directory || !wholeTree) //inside a whole tree the parent was made on the way down
+                makeDirectories(outputPath);
+            free(outputPath);
+
+            if (file.directory)
+                batchCollect(plan, file.firstCluster, file.dataLength, file.noFatChain, childPath, selected);
+            else
+                addBatchJob(plan, childPath, &file);
+        }
+        free(upcased);
+        free(childPath);
+        free(asciiString);
+    }
+    closeDirectory(&directoryIterator);
+}
+
+//------------------------------------------------------
+// batchExtract
+//
+// PURPOSE: The data pass of a batch get. Every extent of every queued file is sorted by its position on the volume and copied in that order, so the volume is read mostly sequentially whatever order the files were asked for in. With --hash each file is copied whole instead, files in the order they start on the volume.
+// INPUT PARAMETERS:
+//     the batch, after batchCollect
+// OUTPUT PARAMETERS:
+//      true if every file was written whole, false (after reporting why) if any output could not be created or written or a cluster chain ended early
+//------------------------------------------------------
+bool batchExtract(batchPlan *plan)
+{
+    uint64_t bytesPerCluster = plan->volume->bytesPerCluster;
+    batchPiece *pieces = NULL;
+    size_t pieceCount = 0;
+    size_t pieceCapacity = 0;
+    copyRequest *requests;
+    size_t requestCount = 0;
+    int *windowJobs = malloc(BATCH_OPEN_FILES * sizeof(int)); //jobs whose outputs are open
+    int windowCount = 0;
+    int out;
+    bool extracted = true;
+    assert(windowJobs != NULL);
+
+    if (hashChoice != HASH_NONE) //a digest needs its file's data in order, so files are copied whole, in the order they start on the volume
+    {
+        qsort(plan->jobs, plan->jobCount, sizeof(batchJob), compareJobs);
+        for (int j = 0; j < plan->jobCount; j++)
+            if (!getFile(plan->volume, plan->jobs[j].outputPath, plan->jobs[j].firstCluster, plan->jobs[j].dataLength, plan->jobs[j].validDataLength, plan->jobs[j].noFatChain))
+                extracted = false;
+        free(windowJobs);
+        return extracted;
+    }
+
+    for (int j = 0; j < plan->jobCount; j++)
+    {
+        int extentCount;
+        extent *extents = fileExtents(plan->volume, plan->jobs[j].firstCluster, plan->jobs[j].validDataLength, plan->jobs[j].noFatChain, &extentCount);
+        uint64_t fileOffset = 0;
+        STAT_ADD(STAT_SPARSE_BYTES, plan->jobs[j].dataLength - plan->jobs[j].validDataLength);
+        for (int i = 0; i < extentCount && fileOffset < plan->jobs[j].validDataLength; i++)
+        {
+            if (pieceCount == pieceCapacity)
+            {
+                pieceCapacity = pieceCapacity > 0 ? pieceCapacity * 2 : 256;
+                pieces = realloc(pieces, pieceCapacity * sizeof(batchPiece));
+                assert(pieces != NULL);
+            }
+            batchPiece *piece = &pieces[pieceCount++];
+            piece->diskOffset = findOffsetToCluster(plan->volume, extents[i].startCluster);
+            piece->fileOffset = fileOffset;
+            piece->length = extents[i].count * bytesPerCluster;
+            if (piece->length > plan->jobs[j].validDataLength - fileOffset)
+                piece->length = plan->jobs[j].validDataLength - fileOffset;
+            piece->job = j;
+            fileOffset += piece->length;
+        }
+        if (fileOffset < plan->jobs[j].validDataLength)
+        {
+            fprintf(stderr, "%s: cluster chain ends after %llu of its %llu bytes\n", plan->jobs[j].outputPath, (unsigned long long)fileOffset,
+                    (unsigned long long)plan->jobs[j].validDataLength);
+            extracted = false;
+        }
+        free(extents);
+    }
+    qsort(pieces, pieceCount, sizeof(batchPiece), comparePieces);
+    requests = malloc((pieceCount > 0 ? pieceCount : 1) * sizeof(copyRequest));
+    assert(requests != NULL);
+
+    //pieces are handed to the I/O engine in windows of at most BATCH_OPEN_FILES open outputs, in on-disk order
+    for (size_t p = 0; p <= pieceCount; p++)
+    {
+        batchJob *job = p < pieceCount ? &plan->jobs[pieces[p].job] : NULL;
+        if (job == NULL || (job->fd < 0 && windowCount == BATCH_OPEN_FILES))
+        {
+            if (!runCopies(plan->volume, requests, requestCount))
+            {
+                perror("get");
+                extracted = false;
+            }
+            for (int w = 0; w < windowCount; w++)
+            {
+                close(plan->jobs[windowJobs[w]].fd);
+                plan->jobs[windowJobs[w]].fd = -1;
+            }
+            requestCount = 0;
+            windowCount = 0;
+        }
+        if (job == NULL)
+            break;
+        if (job->fd < 0)
+        {
+            job->fd = open(job->outputPath, O_WRONLY | O_CREAT | (job->opened ? 0 : O_TRUNC), PERMISSIONS);
+            if (job->fd < 0)
+            {
+                perror(job->outputPath);
+                extracted = false;
+                continue;
+            }
+            if (!job->opened)
+                fallocate(job->fd, 0, 0, job->validDataLength);
+            job->opened = true;
+            windowJobs[windowCount++] = pieces[p].job;
+        }
+        copyRequest *request = &requests[requestCount++];
+        request->out = job->fd;
+        request->volumeOffset = pieces[p].diskOffset;
+        request->fileOffset = pieces[p].fileOffset;
+        request->length = pieces[p].length;
+    }
+
+    for (int j = 0; j < plan->jobCount; j++) //empty files have no extents, the tail past ValidDataLength becomes a hole, and a broken chain can leave a file short
+    {
+        out = open(plan->jobs[j].outputPath, O_WRONLY | O_CREAT | (plan->jobs[j].opened ? 0 : O_TRUNC), PERMISSIONS);
+        if (out < 0)
+        {
+            perror(plan->jobs[j].outputPath);
+            extracted = false;
+            continue;
+        }
+        if (ftruncate(out, plan->jobs[j].dataLength) != 0 || close(out) != 0)
+        {
+            perror(plan->jobs[j].outputPath);
+            extracted = false;
+        }
+    }
+    free(windowJobs);
+    free(requests);
+    free(pieces);
+    return extracted;
+}
+
+//------------------------------------------------------
+// getBatch
+//
+// PURPOSE: Execute a batch get: extract many files and/or whole directories in one run, recreating their paths under a destination directory. All targets are resolved in one walk of the tree, then the data is read in on-disk order.
+// INPUT PARAMETERS:
+//     the volume, the paths given on the command line and how many, a file holding more paths one per line (NULL for none, "-" for standard input), the destination directory
+// OUTPUT PARAMETERS:
+//      false if any of the paths is not on the volume (or the path file cannot be read)
+//------------------------------------------------------
+bool getBatch(exfatVolume *volume, char **paths, int pathCount, const char *pathFile, const char *destination)
+{
+    batchPlan plan = {0};
+    int targetCapacity = pathCount > 0 ? pathCount : 1;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int uniqueCount = 0;
+    bool allFound = true;
+
+    plan.volume = volume;
+    plan.destination = destination;
+    plan.targets = calloc(targetCapacity, sizeof(batchTarget));
+    assert(plan.targets != NULL);
+    for (int i = 0; i < pathCount; i++)
+        plan.targets[plan.targetCount++].original = strdup(paths[i]);
+
+    if (pathFile != NULL)
+    {
+        FILE *list = strcmp(pathFile, "-") == 0 ? stdin : fopen(pathFile, "r");
+        if (list == NULL)
+        {
+            perror(pathFile);
+            allFound = false;
+        }
+        while (list != NULL && getline(&line, &lineCapacity, list) >= 0)
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0')
+                continue;
+            if (plan.targetCount == targetCapacity)
+            {
+                targetCapacity *= 2;
+                plan.targets = realloc(plan.targets, targetCapacity * sizeof(batchTarget));
+                assert(plan.targets != NULL);
+            }
+            plan.targets[plan.targetCount++].original = strdup(line);
+        }
+        if (list != NULL && list != stdin)
+            fclose(list);
+        free(line);
+    }
+
+    //targets are kept up-cased, sorted and without duplicates so the walk can binary search them
+    for (int i = 0; i < plan.targetCount; i++)
+    {
+        plan.targets[i].key = normalisePath(plan.targets[i].original);
+        plan.targets[i].found = false;
+        upcasePath(volume, plan.targets[i].key);
+    }
+    qsort(plan.targets, plan.targetCount, sizeof(batchTarget), compareTargets);
+    for (int i = 0; i < plan.targetCount; i++)
+    {
+        if (uniqueCount > 0 && strcmp(plan.targets[i].key, plan.targets[uniqueCount - 1].key) == 0)
+        {
+            free(plan.targets[i].key);
+            free(plan.targets[i].original);
+        }
+        else
+        {
+            plan.targets[uniqueCount++] = plan.targets[i];
+        }
+    }
+    plan.targetCount = uniqueCount;
+
+    //"/" asks for the whole volume, it sorts first
+    bool wholeVolume = plan.targetCount > 0 && plan.targets[0].key[0] == '\0';
+    if (wholeVolume)
+        plan.targets[0].found = true;
+    makeDirectories(destination);
+    batchCollect(&plan, volume->rootDirectory, 0, false, "", wholeVolume);
+    bool extracted = batchExtract(&plan);
+
+    for (int i = 0; i < plan.targetCount; i++)
+    {
+        if (!plan.targets[i].found)
+        {
+            fprintf(stderr, "%s: not found\n", plan.targets[i].original);
+            allFound = false;
+        }
+        free(plan.targets[i].key);
+        free(plan.targets[i].original);
+    }
+    for (int j = 0; j < plan.jobCount; j++)
+        free(plan.jobs[j].outputPath);
+    free(plan.jobs);
+    free(plan.targets);
+    return allFound && extracted;
+}
+
+//------------------------------------------------------
+// changedClusters
+//
+// PURPOSE: Compare the allocation bitmaps and FATs of two images of the same volume and mark every cluster whose allocation bit or FAT entry differs. The comparison kernel skips the equal stretches, a vector at a time, so two images taken a day apart cost little more than reading the two bitmaps and FATs.
+// INPUT PARAMETERS:
+//     the two volumes (same cluster count), how many 64 bit words hold a bit per cluster, where to store how many clusters changed
+// OUTPUT PARAMETERS:
+//      heap allocated bit per cluster of the heap, set where the volumes differ. caller must free it
+//------------------------------------------------------
+uint64_t *changedClusters(const exfatVolume *newer, const exfatVolume *older, uint64_t words, uint64_t *changedCount)
+{
+    differenceKernel firstDifference = selectDifferenceKernel();
+    uint64_t *changed = calloc(words, sizeof(uint64_t));
+    uint64_t *newerBitmap = loadAllocationBitmap(newer, words);
+    uint64_t *olderBitmap = loadAllocationBitmap(older, words);
+    const uint8_t *newerBytes = (const uint8_t *)newerBitmap;
+    const uint8_t *olderBytes = (const uint8_t *)olderBitmap;
+    size_t length = words * sizeof(uint64_t);
+    size_t position = firstDifference(newerBytes, olderBytes, length);
+    assert(changed != NULL);
 
-            bytesReadInEntry = 0;
+    //a cluster allocated or freed, the whole differing word is taken at once
+    while (position < length)
+    {
+        size_t word = position / sizeof(uint64_t);
+        changed[word] = newerBitmap[word] ^ olderBitmap[word];
+        position = (word + 1) * sizeof(uint64_t);
+        position += firstDifference(newerBytes + position, olderBytes + position, length - position);
+    }
 
-            bytesReadInCluster += BYTES_PER_ENTRY;
+    //a chain relinked, extended or cut, which need not change the bitmap (NoFatChain files do not use the FAT at all)
+    newerBytes = (const uint8_t *)newer->fatCache;
+    olderBytes = (const uint8_t *)older->fatCache;
+    length = ((size_t)newer->clusterCount + CLUSTER_INDEX_OFFSET) * FAT_ENTRY_BYTES;
+    position = CLUSTER_INDEX_OFFSET * FAT_ENTRY_BYTES;
+    position += firstDifference(newerBytes + position, olderBytes + position, length - position);
+    while (position < length)
+    {
+        size_t bit = position / FAT_ENTRY_BYTES - CLUSTER_INDEX_OFFSET;
+        changed[bit / BITS_PER_WORD] |= 1ULL << (bit % BITS_PER_WORD);
+        position = (bit + CLUSTER_INDEX_OFFSET + 1) * FAT_ENTRY_BYTES;
+        position += firstDifference(newerBytes + position, olderBytes + position, length - position);
+    }
 
-            if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-            {
-                currCluster = nextCluster(fd, currCluster);
-                lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                bytesReadInCluster = 0;
-            }
+    *changedCount = 0;
+    for (uint64_t word = 0; word < words; word++)
+        *changedCount += __builtin_popcountll(changed[word]);
+    free(newerBitmap);
+    free(olderBitmap);
+    return changed;
+}
 
-            lseek(fd, 2 + findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET); //skip first 2 bytes of filename directory
-            bytesReadInCluster += 2;
-            bytesReadInEntry = 2;
+//input: the diff, a file or directory of the newer volume: first cluster, DataLength and NoFatChain flag
+//returns true if any of its clusters is marked in changed
+bool clustersChanged(const differ *diff, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
+{
+    uint64_t clustersWanted = (dataLength + diff->newer->bytesPerCluster - 1) / diff->newer->bytesPerCluster;
+    bool found = false;
+    int extentCount;
+    extent *extents;
 
-            read(fd, &unicodeString[0], 30);
-            bytesReadInCluster += 30;
-            bytesReadInEntry = BYTES_PER_ENTRY;
+    if (diff->changedClusters == 0 || clustersWanted == 0)
+        return false;
+    if (noFatChain)
+        extents = fileExtents(diff->newer, firstCluster, dataLength, true, &extentCount);
+    else
+        extents = runExtents(diff->newer, diff->runs, firstCluster, clustersWanted, &extentCount);
+    for (int i = 0; i < extentCount && !found; i++)
+    {
+        uint64_t bit = extents[i].startCluster - CLUSTER_INDEX_OFFSET;
+        uint64_t end = bit + extents[i].count;
+        while (bit < end && !found)
+        {
+            uint64_t shift = bit % BITS_PER_WORD;
+            uint64_t bits = end - bit < BITS_PER_WORD - shift ? end - bit : BITS_PER_WORD - shift;
+            uint64_t mask = (bits == BITS_PER_WORD ? ~0ULL : (1ULL << bits) - 1) << shift;
+            found = (diff->changed[bit / BITS_PER_WORD] & mask) != 0;
+            bit += bits;
+        }
+    }
+    free(extents);
+    return found;
+}
 
-            lseek(fd, findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET);
+//input: an entry set of the newer volume and the one with the same name in the older volume
+//returns true if they describe the same data: same kind, attributes, clusters, sizes and modification time
+bool sameEntry(const dirEntry *newer, const dirEntry *older)
+{
+    return newer->directory == older->directory && newer->attributes == older->attributes && newer->firstCluster == older->firstCluster &&
+           newer->noFatChain == older->noFatChain && newer->dataLength == older->dataLength && newer->validDataLength == older->validDataLength &&
+           newer->modifyTimestamp == older->modifyTimestamp && newer->modify10ms == older->modify10ms && newer->modifyUtcOffset == older->modifyUtcOffset;
+}
 
-            //read the secondary entries of the set
-            for (int i = 0; i < secondaryCount - 2; i++) // - 2 because first file name and stream extension have been read already
-            {
-                lseek(fd, 2, SEEK_CUR);
-                bytesReadInCluster += 2;
-                bytesReadInEntry = 2;
-                read(fd, &unicodeString[UNICODE_CHARS_PER_ENTRY * (i + 1)], 30);
-                bytesReadInCluster += 30;
-                bytesReadInEntry = BYTES_PER_ENTRY;
-
-                if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
-                {
-                    currCluster = nextCluster(fd, currCluster);
-                    lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-                    bytesReadInCluster = 0;
-                }
-            }
+//qsort comparison of two entry sets by their NameHash
+int compareNameHashes(const void *first, const void *second)
+{
+    const dirEntry *a = first;
+    const dirEntry *b = second;
+    return (a->nameHash > b->nameHash) - (a->nameHash < b->nameHash);
+}
 
-            asciiString = unicode2ascii(unicodeString, nameLength);
+//input: the diff, the older directory's entry sets sorted by NameHash, which of them have been matched already, how many there are, an entry set of the newer directory
+//returns the unmatched older entry set with the same name (compared without regard to case), marked as matched, NULL if there is none
+const dirEntry *matchEntry(differ *diff, const dirEntry *entries, bool *matched, int count, const dirEntry *file)
+{
+    int low = 0;
+    int high = count;
+
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (entries[middle].nameHash < file->nameHash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (; low < count && entries[low].nameHash == file->nameHash; low++)
+    {
+        if (!matched[low] && sameName(diff->newer, entries[low].name, entries[low].nameLength, file->name, file->nameLength))
+        {
+            matched[low] = true;
+            return &entries[low];
+        }
+    }
+    return NULL;
+}
+
+//input: the diff, 'A', 'M' or 'D', the entry (its path is in the diff's output), its path from the root for --dest
+//writes "<change>\t<path>" (directories end in '/') and queues added and modified files for extraction
+void writeChange(differ *diff, char change, const dirEntry *file, const char *volumePath)
+{
+    char prefix[2] = {change, '\t'};
+    writeList(diff->output, prefix, sizeof(prefix));
+    writeList(diff->output, diff->output->path, diff->output->pathLength);
+    writeList(diff->output, file->directory ? "/\n" : "\n", file->directory ? 2 : 1);
+
+    if (change == 'A')
+        diff->added++;
+    else if (change == 'M')
+        diff->modified++;
+    else
+        diff->deleted++;
+
+    if (diff->plan != NULL && change != 'D')
+    {
+        const char *slash = strrchr(volumePath, '/');
+        char *outputPath = malloc(strlen(diff->plan->destination) + strlen(volumePath) + 2);
+        assert(outputPath != NULL);
+        if (file->directory)
+            sprintf(outputPath, "%s/%s", diff->plan->destination, volumePath);
+        else
+            sprintf(outputPath, "%s/%.*s", diff->plan->destination, slash != NULL ? (int)(slash - volumePath) : 0, volumePath);
+        makeDirectories(outputPath);
+        free(outputPath);
+        if (!file->directory)
+            addBatchJob(diff->plan, volumePath, file);
+    }
+}
+
+//------------------------------------------------------
+// diffRecurse
+//
+// PURPOSE: Compare a directory present in either or both volumes. Entry sets are paired by name (NameHash, then the up-cased names): one only in the newer volume is added, one only in the older deleted, and a pair is modified when its entry set changed or one of its clusters is marked in changed. When the directory's bytes are the same in both volumes its entry sets are taken as pairs without decoding the older copy. Directories are descended into, so everything below an added or deleted one is reported as well.
+// INPUT PARAMETERS:
+//     the diff, the directory's entry set in the newer and in the older volume (either NULL when it is only in the other), its path from the root ("" for the root)
+//------------------------------------------------------
+void diffRecurse(differ *diff, const dirEntry *newerDirectory, const dirEntry *olderDirectory, const char *directoryPath)
+{
+    dirIterator newerIterator;
+    dirIterator olderIterator;
+    dirEntry *olderEntries = NULL;
+    bool *matched;
+    int olderCount = 0;
+    int olderCapacity = 0;
+    bool identical = false;
+    size_t parentLength = diff->output->pathLength;
+    dirEntry file;
 
-            if (directory && strcmp(currentLookUp, asciiString) == 0)
+    if (newerDirectory != NULL)
+        openDirectory(diff->newer, &newerIterator, newerDirectory->firstCluster, newerDirectory->dataLength, newerDirectory->noFatChain);
+    if (olderDirectory != NULL)
+    {
+        openDirectory(diff->older, &olderIterator, olderDirectory->firstCluster, olderDirectory->dataLength, olderDirectory->noFatChain);
+        identical = newerDirectory != NULL && newerIterator.length == olderIterator.length &&
+                    memcmp(newerIterator.contents, olderIterator.contents, newerIterator.length) == 0;
+        while (!identical && nextDirEntry(&olderIterator, &file))
+        {
+            if (olderCount == olderCapacity)
             {
-                get(fdOrig, nextDirCluster, levels + 1);
+                olderCapacity = olderCapacity > 0 ? olderCapacity * 2 : 64;
+                olderEntries = realloc(olderEntries, olderCapacity * sizeof(dirEntry));
+                assert(olderEntries != NULL);
             }
-            else if (!directory && strcmp(currentLookUp, asciiString) == 0)
+            olderEntries[olderCount++] = file;
+        }
+        closeDirectory(&olderIterator);
+        if (olderCount > 0)
+            qsort(olderEntries, olderCount, sizeof(dirEntry), compareNameHashes);
+    }
+    matched = calloc(olderCount > 0 ? olderCount : 1, sizeof(bool));
+    assert(matched != NULL);
+
+    while (newerDirectory != NULL && nextDirEntry(&newerIterator, &file))
+    {
+        const dirEntry *older = identical ? &file : matchEntry(diff, olderEntries, matched, olderCount, &file);
+        char *asciiString = unicode2ascii(file.name, file.nameLength);
+        if (strcmp(asciiString, ".") == 0 || strcmp(asciiString, "..") == 0 || strchr(asciiString, '/') != NULL) //would escape --dest
+        {
+            free(asciiString);
+            continue;
+        }
+        char *childPath = malloc(strlen(directoryPath) + strlen(asciiString) + 2);
+        assert(childPath != NULL);
+        sprintf(childPath, "%s%s%s", directoryPath, directoryPath[0] != '\0' ? "/" : "", asciiString);
+        appendPathName(diff->output, &file);
+
+        if (older != NULL && older->directory != file.directory) //replaced by an entry of the other kind
+        {
+            writeChange(diff, 'D', older, childPath);
+            if (older->directory)
+                diffRecurse(diff, NULL, older, childPath);
+            older = NULL;
+        }
+        if (older == NULL)
+            writeChange(diff, 'A', &file, childPath);
+        else if (!sameEntry(&file, older) || clustersChanged(diff, file.firstCluster, file.dataLength, file.noFatChain))
+            writeChange(diff, 'M', &file, childPath);
+        if (file.directory)
+            diffRecurse(diff, &file, older, childPath);
+
+        diff->output->pathLength = parentLength;
+        free(childPath);
+        free(asciiString);
+    }
+    if (newerDirectory != NULL)
+        closeDirectory(&newerIterator);
+
+    for (int i = 0; i < olderCount; i++)
+    {
+        if (matched[i])
+            continue;
+        char *asciiString = unicode2ascii(olderEntries[i].name, olderEntries[i].nameLength);
+        char *childPath = malloc(strlen(directoryPath) + strlen(asciiString) + 2);
+        assert(childPath != NULL);
+        sprintf(childPath, "%s%s%s", directoryPath, directoryPath[0] != '\0' ? "/" : "", asciiString);
+        appendPathName(diff->output, &olderEntries[i]);
+        writeChange(diff, 'D', &olderEntries[i], childPath);
+        if (olderEntries[i].directory)
+            diffRecurse(diff, NULL, &olderEntries[i], childPath);
+        diff->output->pathLength = parentLength;
+        free(childPath);
+        free(asciiString);
+    }
+    free(matched);
+    free(olderEntries);
+}
+
+//------------------------------------------------------
+// diff
+//
+// PURPOSE: Execute the diff command: report what changed between an older image of the volume and this one. Clusters whose allocation bit or FAT entry differ are found first (see changedClusters), then both trees are walked together (see diffRecurse) to map them, and any changed entry sets, back to the files and directories that own them. Each change is a line "A", "M" or "D", a tab and the path, followed by a summary line starting with '#'. With a destination only the added and modified files are extracted, as a batch get does.
+// INPUT PARAMETERS:
+//     the newer volume, the older image's file name, the destination directory (NULL to only report)
+// OUTPUT PARAMETERS:
+//      false if the older image cannot be opened or is not an image of the same volume, or a file could not be extracted
+//------------------------------------------------------
+bool diff(exfatVolume *volume, const char *olderFileName, const char *destination)
+{
+    listOutput output = {LIST_TEXT, STDOUT_FILENO, false, malloc(LIST_BUFFER_BYTES), 0, NULL, 0, 0, false};
+    batchPlan plan = {0};
+    differ comparison = {0};
+    dirEntry root = {0};
+    uint64_t words;
+    uint64_t start;
+    exfatVolume *older = openVolume(olderFileName, useMmap);
+    assert(output.buffer != NULL);
+
+    if (older == NULL)
+    {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: not an exFAT volume, or its boot sector describes an impossible geometry\n", olderFileName);
+        else
+            perror(olderFileName);
+        free(output.buffer);
+        return false;
+    }
+    if (older->serialNumber != volume->serialNumber || older->clusterCount != volume->clusterCount || older->bytesPerCluster != volume->bytesPerCluster)
+    {
+        fprintf(stderr, "%s: not an image of the same volume (serial number %08X, %u clusters of %llu bytes, against %08X, %u clusters of %llu bytes)\n",
+                olderFileName, older->serialNumber, older->clusterCount, (unsigned long long)older->bytesPerCluster, volume->serialNumber,
+                volume->clusterCount, (unsigned long long)volume->bytesPerCluster);
+        closeVolume(older);
+        free(output.buffer);
+        return false;
+    }
+    if (cacheMegabytes > 0)
+        enableClusterCache(older, (uint64_t)cacheMegabytes * BYTES_PER_KB * BYTES_PER_KB);
+
+    start = statsClock();
+    words = ((uint64_t)volume->clusterCount + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    comparison.newer = volume;
+    comparison.older = older;
+    comparison.changed = changedClusters(volume, older, words > 0 ? words : 1, &comparison.changedClusters);
+    comparison.runs = buildFatRuns(volume);
+    comparison.output = &output;
+    statsPhase(PHASE_BITMAP, start, 0);
+    if (destination != NULL)
+    {
+        plan.volume = volume;
+        plan.destination = destination;
+        makeDirectories(destination);
+        comparison.plan = &plan;
+    }
+
+    start = statsClock();
+    root.directory = true;
+    root.firstCluster = volume->rootDirectory; //DataLength 0: the root directory's chain is followed to its end
+    diffRecurse(&comparison, &root, &root, "");
+    statsPhase(PHASE_TREE, start, 0);
+
+    writeList(&output, "#", 1);
+    writeSummaryField(&output, "changed_clusters", comparison.changedClusters);
+    writeSummaryField(&output, "added", comparison.added);
+    writeSummaryField(&output, "modified", comparison.modified);
+    writeSummaryField(&output, "deleted", comparison.deleted);
+    writeList(&output, "\n", 1);
+    flushList(&output);
+    bool extracted = destination == NULL || batchExtract(&plan);
+
+    for (int j = 0; j < plan.jobCount; j++)
+        free(plan.jobs[j].outputPath);
+    free(plan.jobs);
+    free(comparison.changed);
+    free((void *)comparison.runs);
+    free(output.buffer);
+    free(output.path);
+    closeVolume(older);
+    return extracted;
+}
+
+//------------------------------------------------------
+// describeVolume
+//
+// PURPOSE: Produce the output of the info command
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      heap allocated text. caller must free it
+//------------------------------------------------------
+char *describeVolume(exfatVolume *volume)
+{
+    exfatInfo details;
+    char text[INFO_TEXT_BYTES];
+
+    getInfo(volume, &details);
+    snprintf(text, sizeof(text), "The volume label is %s\nSerial Number: 0x%08x or unsigned: %u\nCluster Size: %d sector(s) or %d bytes\nFree Space: %llu KB\n",
+             details.label, details.serialNumber, details.serialNumber, details.sectorsPerCluster, (details.bytesPerSector * details.sectorsPerCluster),
+             (unsigned long long)(details.freeBytes / BYTES_PER_KB));
+    free(details.label); //must be freed as the function that created it (unicode2ascii allocates it in heap)
+    return strdup(text);
+}
+
+//------------------------------------------------------
+// buildServerTree
+//
+// PURPOSE: Read the whole directory tree into memory once, breadth first so that the children of every directory sit next to each other, and index every path in a hash table
+// INPUT PARAMETERS:
+//     the server, with its volume set
+//------------------------------------------------------
+void buildServerTree(serverState *server)
+{
+    exfatVolume *volume = server->volume;
+    int capacity = 256;
+
+    server->nodes = calloc(capacity, sizeof(serverNode));
+    assert(server->nodes != NULL);
+    server->nodes[0].key = strdup(""); //the root directory, which has no entry set of its own
+    server->nodes[0].parent = -1;
+    server->nodeCount = 1;
+
+    for (int n = 0; n < server->nodeCount; n++)
+    {
+        dirIterator directoryIterator;
+        dirEntry file;
+        const dirEntry *directory = server->nodes[n].entry;
+
+        if (directory != NULL && !directory->directory)
+            continue;
+        if (directory == NULL)
+            openDirectory(volume, &directoryIterator, volume->rootDirectory, 0, false);
+        else
+            openDirectory(volume, &directoryIterator, directory->firstCluster, directory->dataLength, directory->noFatChain);
+        server->nodes[n].firstChild = server->nodeCount;
+        while (nextDirEntry(&directoryIterator, &file))
+        {
+            if (server->nodeCount == capacity)
             {
-                done = true;
-                getFile(fd, currentLookUp, nextDirCluster, length);
+                capacity *= 2;
+                server->nodes = realloc(server->nodes, capacity * sizeof(serverNode));
+                assert(server->nodes != NULL);
             }
+            serverNode *child = &server->nodes[server->nodeCount++];
+            const char *parentKey = server->nodes[n].key;
+            size_t entryBytes = offsetof(dirEntry, name) + file.nameLength * sizeof(uint16_t); //only the characters in use are kept
+            char *asciiString = unicode2ascii(file.name, file.nameLength);
+
+            child->entry = malloc(entryBytes);
+            assert(child->entry != NULL);
+            memcpy(child->entry, &file, entryBytes);
+            child->key = malloc(strlen(parentKey) + strlen(asciiString) + 2);
+            assert(child->key != NULL);
+            sprintf(child->key, "%s%s%s", parentKey, parentKey[0] != '\0' ? "/" : "", asciiString);
+            upcasePath(volume, child->key);
+            child->parent = n;
+            child->firstChild = 0;
+            child->childCount = 0;
             free(asciiString);
-            lseek(fd, findOffsetToCluster(currCluster) + bytesReadInCluster, SEEK_SET);
         }
-        else if (currEntryType == 0)
+        server->nodes[n].childCount = server->nodeCount - server->nodes[n].firstChild;
+        closeDirectory(&directoryIterator);
+    }
+
+    server->bucketCount = INDEX_MIN_BUCKETS;
+    while (server->bucketCount < (uint32_t)server->nodeCount * 2)
+        server->bucketCount *= 2;
+    server->buckets = calloc(server->bucketCount, sizeof(uint32_t));
+    assert(server->buckets != NULL);
+    for (int n = 0; n < server->nodeCount; n++)
+    {
+        uint32_t slot = hashBytes(HASH_SEED, server->nodes[n].key, strlen(server->nodes[n].key)) & (server->bucketCount - 1);
+        while (server->buckets[slot] != 0) //linear probing
+            slot = (slot + 1) & (server->bucketCount - 1);
+        server->buckets[slot] = n + 1; //0 marks an empty bucket
+    }
+}
+
+//input: the server, a path as typed by the user
+//returns the node of the path (0 for the root), -1 if it is not on the volume
+int findServerNode(serverState *server, const char *userPath)
+{
+    char *key = normalisePath(userPath);
+    size_t keyLength = strlen(key);
+    int found = -1;
+
+    upcasePath(server->volume, key);
+    uint32_t slot = hashBytes(HASH_SEED, key, keyLength) & (server->bucketCount - 1);
+    for (uint32_t probes = 0; probes < server->bucketCount && server->buckets[slot] != 0 && found < 0; probes++)
+    {
+        if (strcmp(server->nodes[server->buckets[slot] - 1].key, key) == 0)
+            found = server->buckets[slot] - 1;
+        slot = (slot + 1) & (server->bucketCount - 1);
+    }
+    free(key);
+    return found;
+}
+
+//input: the server, list output, a directory's node, how many levels below the root its children are
+//lists the directory's children and, recursively, everything below them, exactly as listRecurse would
+void serverListRecurse(serverState *server, listOutput *output, int directory, int levels)
+{
+    size_t parentLength = output->pathLength;
+    const serverNode *parent = &server->nodes[directory];
+
+    for (int n = parent->firstChild; n < parent->firstChild + parent->childCount; n++)
+    {
+        const dirEntry *file = server->nodes[n].entry;
+        if (output->format != LIST_TEXT)
+            appendPathName(output, file);
+        writeListEntry(server->volume, output, file, levels);
+        if (file->directory)
+            serverListRecurse(server, output, n, levels + 1);
+        output->pathLength = parentLength;
+    }
+}
+
+//input: the server, list output with an empty path, a node
+//puts the node's full UTF-8 path in the list output
+void serverNodePath(serverState *server, listOutput *output, int node)
+{
+    if (server->nodes[node].entry == NULL)
+        return;
+    serverNodePath(server, output, server->nodes[node].parent);
+    appendPathName(output, server->nodes[node].entry);
+}
+
+//input: the client socket, the volume, where the bytes are on it and how many, a COPY_BUFFER_BYTES buffer
+//returns true if they were all sent: by sendfile, or from the mapping or through the buffer when it cannot be used (bytes past the end of the image go as zeros)
+bool sendVolumeRange(int fd, const exfatVolume *volume, uint64_t offset, uint64_t length, uint8_t *buffer)
+{
+    while (length > 0)
+    {
+        off_t position = offset;
+        ssize_t sent = sendfile(fd, volume->fd, &position, length < KERNEL_COPY_MAX_BYTES ? length : KERNEL_COPY_MAX_BYTES);
+        STAT_ADD(STAT_KERNEL_COPIES, 1);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            break;
+        STAT_ADD(STAT_BYTES_READ, sent);
+        offset += sent;
+        length -= sent;
+    }
+    while (length > 0)
+    {
+        size_t bytes = length < COPY_BUFFER_BYTES ? length : COPY_BUFFER_BYTES;
+        if (!writeAll(fd, volumeData(volume, offset, bytes, buffer), bytes))
+            return false;
+        offset += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+//------------------------------------------------------
+// sendFileData
+//
+// PURPOSE: Send a file's data to a client as response chunks, one or more per extent. Like getFile, exactly DataLength bytes are sent even if the cluster chain is short, and nothing past ValidDataLength is read (zeros are sent instead).
+// INPUT PARAMETERS:
+//     the client socket, the volume, the file's entry set
+// OUTPUT PARAMETERS:
+//      true if the client got every chunk
+//------------------------------------------------------
+bool sendFileData(int fd, const exfatVolume *volume, const dirEntry *file)
+{
+    int extentCount;
+    extent *extents = fileExtents(volume, file->firstCluster, file->validDataLength, file->noFatChain, &extentCount);
+    uint8_t *buffer = malloc(COPY_BUFFER_BYTES);
+    uint64_t sent = 0;
+    bool ok = true;
+    assert(buffer != NULL);
+
+    for (int i = 0; ok && sent < file->dataLength; i++)
+    {
+        bool fromVolume = i < extentCount && sent < file->validDataLength; //otherwise zeros: the never written tail, or past the end of a short chain
+        uint64_t volumeOffset = fromVolume ? findOffsetToCluster(volume, extents[i].startCluster) : 0;
+        uint64_t length = fromVolume ? extents[i].count * volume->bytesPerCluster : file->dataLength - sent;
+        if (fromVolume && length > file->validDataLength - sent)
+            length = file->validDataLength - sent;
+        if (!fromVolume)
+        {
+            memset(buffer, 0, COPY_BUFFER_BYTES);
+            STAT_ADD(STAT_SPARSE_BYTES, length);
+        }
+        for (uint64_t done = 0; ok && done < length;)
         {
-            done = true;
+            uint32_t chunkLength = length - done < KERNEL_COPY_MAX_BYTES ? length - done : KERNEL_COPY_MAX_BYTES;
+            ok = writeAll(fd, &chunkLength, sizeof(chunkLength));
+            if (fromVolume)
+                ok = ok && sendVolumeRange(fd, volume, volumeOffset + done, chunkLength, buffer);
+            for (uint32_t zeros = 0; ok && !fromVolume && zeros < chunkLength; zeros += COPY_BUFFER_BYTES)
+                ok = writeAll(fd, buffer, chunkLength - zeros < COPY_BUFFER_BYTES ? chunkLength - zeros : COPY_BUFFER_BYTES);
+            done += chunkLength;
         }
-        if (bytesReadInEntry < BYTES_PER_ENTRY) //read rest of bytes in entry to go to next entry
+        sent += length;
+    }
+    free(buffer);
+    free(extents);
+    return ok;
+}
+
+//------------------------------------------------------
+// serveRequest
+//
+// PURPOSE: Answer one request: a status byte, then the response body as chunks (a 32 bit little endian length and that many bytes), then a chunk of length 0
+// INPUT PARAMETERS:
+//     the server, the client socket, the request ("info", "list [text|ndjson|binary]", "stat PATH" or "get PATH")
+// OUTPUT PARAMETERS:
+//      false if the client has gone
+//------------------------------------------------------
+bool serveRequest(serverState *server, int fd, char *request)
+{
+    char *argument = strchr(request, ' ');
+    uint8_t status = SERVER_OK;
+    uint32_t endOfResponse = 0;
+    int node = -1;
+    listOutput output = {LIST_TEXT, fd, true, NULL, 0, NULL, 0, 0, false};
+
+    if (argument != NULL)
+        *argument++ = '\0';
+    if ((strcmp(request, "stat") == 0 || strcmp(request, "get") == 0) && argument != NULL)
+        node = findServerNode(server, argument);
+
+    if (strcmp(request, "info") == 0 || strcmp(request, "list") == 0)
+        status = SERVER_OK;
+    else if (strcmp(request, "stat") != 0 && strcmp(request, "get") != 0)
+        status = SERVER_BAD_REQUEST;
+    else if (node <= 0 || (strcmp(request, "get") == 0 && server->nodes[node].entry->directory)) //the root has no entry set to report
+        status = SERVER_NOT_FOUND;
+    if (strcmp(request, "list") == 0 && argument != NULL)
+    {
+        if (strcmp(argument, "ndjson") == 0)
+            output.format = LIST_NDJSON;
+        else if (strcmp(argument, "binary") == 0)
+            output.format = LIST_BINARY;
+        else if (strcmp(argument, "text") != 0)
+            status = SERVER_BAD_REQUEST;
+    }
+    if (!writeAll(fd, &status, sizeof(status)))
+        return false;
+
+    if (status == SERVER_OK && strcmp(request, "info") == 0)
+    {
+        writeListBlock(&output, server->info, strlen(server->info));
+    }
+    else if (status == SERVER_OK && strcmp(request, "get") == 0)
+    {
+        if (!sendFileData(fd, server->volume, server->nodes[node].entry))
+            return false;
+    }
+    else if (status == SERVER_OK)
+    {
+        output.buffer = malloc(LIST_BUFFER_BYTES);
+        assert(output.buffer != NULL);
+        if (strcmp(request, "stat") == 0)
         {
-            lseek(fd, BYTES_PER_ENTRY - bytesReadInEntry, SEEK_CUR);
-            bytesReadInCluster += BYTES_PER_ENTRY - bytesReadInEntry;
+            output.format = LIST_NDJSON;
+            serverNodePath(server, &output, node);
+            writeListEntry(server->volume, &output, server->nodes[node].entry, 0);
         }
-        bytesReadInEntry = 0;
-        if (bytesReadInCluster == (bytesPerSector * sectorsPerCluster)) //go to next cluster
+        else
         {
-            currCluster = nextCluster(fd, currCluster);
-            lseek(fd, findOffsetToCluster(currCluster), SEEK_SET);
-            bytesReadInCluster = 0;
+            if (output.format == LIST_BINARY)
+            {
+                listHeader header = {LIST_MAGIC, LIST_VERSION, sizeof(listRecord)};
+                writeList(&output, &header, sizeof(header));
+            }
+            serverListRecurse(server, &output, 0, 0);
         }
+        flushList(&output);
+        free(output.buffer);
+        free(output.path);
+    }
+    return writeAll(fd, &endOfResponse, sizeof(endOfResponse));
+}
 
-    } //while more files at this level
+//input: bytes to read from a socket and where to put them
+//returns true if they all arrived, false at the end of the connection
+bool readAll(int fd, void *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t result = read(fd, data, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return false;
+        data = (char *)data + result;
+        length -= result;
+    }
+    return true;
+}
+
+//input: a serverClient
+//thread serving one connection: reads requests (a 32 bit little endian length, then the request) and answers them in turn until the client disconnects
+void *serverClientMain(void *argument)
+{
+    serverClient *client = argument;
+    char *request = malloc(SERVER_MAX_REQUEST_BYTES + 1);
+    uint32_t requestLength;
+    assert(request != NULL);
+
+    while (readAll(client->fd, &requestLength, sizeof(requestLength)) && requestLength <= SERVER_MAX_REQUEST_BYTES &&
+           readAll(client->fd, request, requestLength))
+    {
+        request[requestLength] = '\0';
+        if (!serveRequest(client->server, client->fd, request))
+            break;
+    }
+    close(client->fd);
+    free(request);
+    free(client);
+    return NULL;
+}
+
+//------------------------------------------------------
+// serve
+//
+// PURPOSE: Execute the serve command: keep the volume open with its FAT, up-case table, whole directory tree and info in memory, and answer requests from any number of clients on a Unix domain socket, a thread per connection. Runs until killed.
+// INPUT PARAMETERS:
+//     the volume, path of the socket to create (an old one is replaced)
+// OUTPUT PARAMETERS:
+//      false if the socket cannot be set up, the only way it returns
+//------------------------------------------------------
+bool serve(exfatVolume *volume, const char *socketPath)
+{
+    serverState server = {0};
+    struct sockaddr_un address = {0};
+    int listener;
+    uint64_t start = statsClock();
+
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    server.volume = volume;
+    loadUpcaseTable(volume);
+    buildServerTree(&server);
+    server.info = describeVolume(volume);
+    statsPhase(PHASE_TREE, start, 0);
+
+    signal(SIGPIPE, SIG_IGN); //a client that goes away is only a failed write
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SERVER_BACKLOG) != 0)
+    {
+        perror(socketPath);
+        if (listener >= 0)
+            close(listener);
+        return false;
+    }
+    printf("Serving %d entries on %s\n", server.nodeCount - 1, socketPath);
+    fflush(stdout);
+
+    while (true)
+    {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        serverClient *client = malloc(sizeof(serverClient));
+        pthread_t thread;
+        assert(client != NULL);
+        client->server = &server;
+        client->fd = fd;
+        if (pthread_create(&thread, NULL, serverClientMain, client) != 0)
+        {
+            close(fd);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
 }
 
 int main(int argc, char *argv[])
 {
     assert(argc > 0);
-    char *fileName = argv[1];
-    char *command = argv[2];
-    path = argv[3];
-    int fd = open(fileName, O_RDONLY);
+    char **arguments = calloc(argc + 3, sizeof(char *)); //volume, command, path(s) (options may appear anywhere)
+    int argumentCount = 0;
+    bool defaultIndexFile = false;
+    struct stat volumeInfo;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--no-mmap") == 0)
+            useMmap = false;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            listThreads = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "--unordered") == 0)
+            listUnordered = true;
+        else if (strcmp(argv[i], "--index") == 0)
+            indexFile = "";
+        else if (strncmp(argv[i], "--index=", 8) == 0)
+            indexFile = argv[i] + 8;
+        else if (strcmp(argv[i], "--format=text") == 0)
+            listFormatChoice = LIST_TEXT;
+        else if (strcmp(argv[i], "--format=ndjson") == 0)
+            listFormatChoice = LIST_NDJSON;
+        else if (strcmp(argv[i], "--format=binary") == 0)
+            listFormatChoice = LIST_BINARY;
+        else if (strcmp(argv[i], "--io=sync") == 0)
+            ioEngineChoice = IO_SYNC;
+        else if (strcmp(argv[i], "--io=uring") == 0)
+            ioEngineChoice = IO_URING;
+        else if (strcmp(argv[i], "--io=threads") == 0)
+            ioEngineChoice = IO_THREADS;
+        else if (strncmp(argv[i], "--queue-depth=", 14) == 0)
+            ioQueueDepth = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--io-buffer-kb=", 15) == 0)
+            ioBlockBytes = (uint64_t)atoi(argv[i] + 15) * BYTES_PER_KB;
+        else if (strncmp(argv[i], "--copy-threads=", 15) == 0)
+            copyThreads = atoi(argv[i] + 15);
+        else if (strncmp(argv[i], "--chunk-mb=", 11) == 0)
+            copyChunkBytes = (uint64_t)atoi(argv[i] + 11) * BYTES_PER_KB * BYTES_PER_KB;
+        else if (strncmp(argv[i], "--cache-mb=", 11) == 0)
+            cacheMegabytes = atoi(argv[i] + 11);
+        else if (strcmp(argv[i], "--hash=sha256") == 0)
+            hashChoice = HASH_SHA256;
+        else if (strcmp(argv[i], "--hash=xxh64") == 0)
+            hashChoice = HASH_XXH64;
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0)
+            statsEnabled = true;
+        else if (strcmp(argv[i], "--stats=json") == 0)
+            statsEnabled = statsJson = true;
+        else if (strncmp(argv[i], "--dest=", 7) == 0)
+            batchDestination = argv[i] + 7;
+        else if (strncmp(argv[i], "--from=", 7) == 0)
+            batchPathFile = argv[i] + 7;
+        else if (strncmp(argv[i], "--name=", 7) == 0)
+            findChoice.name = argv[i] + 7;
+        else if (strncmp(argv[i], "--path=", 7) == 0)
+            findChoice.path = argv[i] + 7;
+        else if (strcmp(argv[i], "--type=f") == 0 || strcmp(argv[i], "--type=d") == 0)
+            findChoice.type = argv[i][7];
+        else if (strncmp(argv[i], "--min-size=", 11) == 0)
+            findChoice.minSize = parseSize(argv[i] + 11);
+        else if (strncmp(argv[i], "--max-size=", 11) == 0)
+            findChoice.maxSize = parseSize(argv[i] + 11);
+        else if (strncmp(argv[i], "--attr=", 7) == 0)
+            findChoice.attributes = parseAttributes(argv[i] + 7);
+        else
+            arguments[argumentCount++] = argv[i];
+    }
+    if (ioQueueDepth < 1 || ioQueueDepth > MAX_QUEUE_DEPTH)
+        ioQueueDepth = DEFAULT_QUEUE_DEPTH;
+    if (ioBlockBytes < COPY_BUFFER_ALIGNMENT || ioBlockBytes > KERNEL_COPY_MAX_BYTES)
+        ioBlockBytes = DEFAULT_IO_BUFFER_KB * BYTES_PER_KB;
+    ioBlockBytes -= ioBlockBytes % COPY_BUFFER_ALIGNMENT; //aligned_alloc wants a multiple of the alignment
+    if (listThreads <= 0) //--threads=0 means one per online CPU
+        listThreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (copyThreads <= 0) //so does --copy-threads=0
+        copyThreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if (copyChunkBytes == 0 || copyChunkBytes > KERNEL_COPY_MAX_BYTES)
+        copyChunkBytes = (uint64_t)DEFAULT_CHUNK_MB * BYTES_PER_KB * BYTES_PER_KB;
+
+    char *fileName = arguments[0];
+    char *command = arguments[1];
+    char *path = arguments[2];
+    bool batch = argumentCount > 3 || batchDestination != NULL || batchPathFile != NULL;
+    if (fileName == NULL || command == NULL || (strcmp(command, "get") == 0 && path == NULL && batchPathFile == NULL) ||
+        ((strcmp(command, "serve") == 0 || strcmp(command, "diff") == 0) && path == NULL))
+    {
+        fprintf(stderr, "usage: %s <exFATVolume> <info|list|get|find|index|extents|verify|diff|serve> [path/to/file ... | directory | olderImage | socket] [--no-mmap] [--threads=N] [--unordered] [--format=text|ndjson|binary] [--index[=PATH]] [--dest=DIR] [--from=FILE] [--io=sync|uring|threads] [--queue-depth=N] [--io-buffer-kb=N] [--copy-threads=N] [--chunk-mb=N] [--cache-mb=N] [--hash=sha256|xxh64] [--name=GLOB] [--path=GLOB] [--type=f|d] [--min-size=N[K|M|G|T]] [--max-size=N[K|M|G|T]] [--attr=rhsda] [--stats[=json]]\n", argv[0]);
+        free(arguments);
+        return EXIT_FAILURE;
+    }
+    if ((indexFile == NULL || indexFile[0] == '\0') && strcmp(command, "index") == 0)
+        indexFile = "";
+    if (indexFile != NULL && indexFile[0] == '\0' && stat(fileName, &volumeInfo) == 0 && !S_ISREG(volumeInfo.st_mode))
+    {
+        //next to a block device would be inside /dev
+        fprintf(stderr, "%s: not an image file, give the index a path with --index=PATH\n", fileName);
+        free(arguments);
+        return EXIT_FAILURE;
+    }
+    if (indexFile != NULL && indexFile[0] == '\0') //default: next to the volume
+    {
+        indexFile = malloc(strlen(fileName) + strlen(INDEX_SUFFIX) + 1);
+        assert(indexFile != NULL);
+        sprintf(indexFile, "%s%s", fileName, INDEX_SUFFIX);
+        defaultIndexFile = true;
+    }
+
+    uint64_t runStart = statsClock();
+    exfatVolume *volume = openVolume(fileName, useMmap);
+    if (volume == NULL)
+    {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: not an exFAT volume, or its boot sector describes an impossible geometry\n", fileName);
+        else
+            perror(fileName);
+        exit(EXIT_FAILURE);
+    }
+    if (cacheMegabytes > 0)
+        enableClusterCache(volume, (uint64_t)cacheMegabytes * BYTES_PER_KB * BYTES_PER_KB);
+    uint64_t treeStart = statsClock();
+    int status = EXIT_SUCCESS;
+    uint64_t copyBefore = statPhaseNs[PHASE_COPY];
 
     if (strcmp(command, "info") == 0)
     {
-        info(fd);
-        printf("The volume label is %s\n", volumeLabel);
-        printf("Serial Number: 0x%08x or unsigned: %u\n", serialNumber, serialNumber);
-        printf("Cluster Size: %d sector(s) or %d bytes\n", sectorsPerCluster, (bytesPerSector * sectorsPerCluster));
-        printf("Free Space: %d KB\n", freeSpaceKB);
-        free(volumeLabel); //must be freed as the function that created it (unicode2ascii allocates it in heap)
+        char *text = describeVolume(volume);
+        fputs(text, stdout);
+        free(text);
     }
     else if (strcmp(command, "list") == 0)
     {
-        getRootDirectory(fd);
-        listRecurse(fd, rootDirectory, 0);
+        if ((listThreads > 1 || listUnordered) && listFormatChoice == LIST_TEXT)
+        {
+            listParallel(volume, listThreads, listUnordered);
+        }
+        else
+        {
+            if (listThreads > 1 || listUnordered) //the machine readable formats come from the single threaded walk
+                fprintf(stderr, "list: --threads and --unordered only apply to --format=text, listing on one thread\n");
+            list(volume, listFormatChoice);
+        }
+        statsPhase(PHASE_TREE, treeStart, 0);
     }
     else if (strcmp(command, "get") == 0)
     {
-        getRootDirectory(fd);
-        get(fd, rootDirectory, 0);
+        if (batch)
+        {
+            if (!getBatch(volume, arguments + 2, argumentCount - 2, batchPathFile, batchDestination != NULL ? batchDestination : "."))
+                status = EXIT_FAILURE;
+        }
+        else if (indexFile != NULL)
+        {
+            if (!getIndexed(volume, indexFile, path))
+                status = EXIT_FAILURE;
+        }
+        else if (!get(volume, path))
+        {
+            status = EXIT_FAILURE;
+        }
+        statsPhase(PHASE_TREE, treeStart, statPhaseNs[PHASE_COPY] - copyBefore); //walking only, copies are timed on their own
+    }
+    else if (strcmp(command, "find") == 0)
+    {
+        if (!find(volume, &findChoice, path, listFormatChoice, listThreads))
+            status = EXIT_FAILURE;
+        statsPhase(PHASE_TREE, treeStart, 0);
+    }
+    else if (strcmp(command, "index") == 0)
+    {
+        long entries = buildIndex(volume, indexFile);
+        statsPhase(PHASE_TREE, treeStart, 0);
+        if (entries < 0)
+        {
+            perror(indexFile);
+            status = EXIT_FAILURE;
+        }
+        else
+            printf("Indexed %ld entries into %s\n", entries, indexFile);
+    }
+    else if (strcmp(command, "extents") == 0)
+    {
+        if (listFormatChoice == LIST_BINARY)
+        {
+            fprintf(stderr, "extents: only --format=text and --format=ndjson are supported\n");
+            status = EXIT_FAILURE;
+        }
+        else if (!extents(volume, listFormatChoice))
+        {
+            status = EXIT_FAILURE;
+        }
+        statsPhase(PHASE_TREE, treeStart, 0);
+    }
+    else if (strcmp(command, "verify") == 0)
+    {
+        if (verify(volume, listThreads) > 0)
+            status = EXIT_FAILURE;
+        statsPhase(PHASE_TREE, treeStart, 0);
+    }
+    else if (strcmp(command, "diff") == 0)
+    {
+        if (!diff(volume, path, batchDestination))
+            status = EXIT_FAILURE;
+    }
+    else if (strcmp(command, "serve") == 0)
+    {
+        if (!serve(volume, path))
+            status = EXIT_FAILURE;
     }
 
-    close(fd);
-    return EXIT_SUCCESS;
+    if (statsEnabled)
+        printStats(runStart);
+    if (defaultIndexFile)
+        free(indexFile);
+    closeVolume(volume);
+    free(arguments);
+    return status;
 }
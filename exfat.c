@@ -0,0 +1,1633 @@
+//-----------------------------------------
+// exfat.c
+//
+// Reading core of the exFAT reader, see exfat.h. Boot sector parsing, the
+// in-memory FAT, cluster chains and extents, directory iteration, name
+// lookup, volume information and file reads, all on an exfatVolume handle.
+//
+//-----------------------------------------
+
+#define _FILE_OFFSET_BITS 64 //64 bit off_t for pread and lseek on 32 bit builds too, volumes are terabytes
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "exfat.h"
+
+#define VOLUME_LABEL_CHARS 11
+#define UNICODE_CHARS_PER_ENTRY 15
+#define ASCII_TO_UNICODE_CHAR_RATIO 2
+
+#define BITS_PER_BYTE 8
+#define FILE_SYSTEM_NAME "EXFAT   "
+#define MIN_SECTOR_SHIFT 9            //512 byte sectors
+#define MAX_SECTOR_SHIFT 12           //4 KB sectors
+#define MAX_CLUSTER_SHIFT 25          //32 MB clusters, as a shift of bytes
+#define MAX_CLUSTER_COUNT 0xFFFFFFF5u //cluster numbers above this are bad cluster and end of chain marks
+#define END_OF_CHAIN 0xFFFFFFFF
+#define BITMAP_BLOCK_BYTES (1024 * 1024) //bitmap bytes handed to the bit counting kernel at once
+#define AVX2_BYTES 32
+#define UPCASE_TABLE_CHARS 65536
+#define BOOT_CHECKSUM_SECTORS 11 //sectors of a boot region covered by its checksum, which fills the next one
+#define VOLUME_FLAGS_OFFSET 106  //boot sector fields the checksum skips
+#define PERCENT_IN_USE_OFFSET 112
+#define CACHE_HASH_MULTIPLIER 2654435761u //Knuth's multiplicative hash, spreads consecutive clusters over the shards
+#define CACHE_SHARD_SHIFT 28            //top 4 bits of the hash pick one of the CLUSTER_CACHE_SHARDS
+#define UPCASE_IDENTITY_RUN 0xFFFF //in the compressed up-case table, followed by a count of characters that map to themselves
+
+bool statsEnabled;
+uint64_t statPhaseNs[PHASE_COUNT];
+uint64_t statCounts[STAT_COUNTER_COUNT];
+
+//returns the monotonic clock in nanoseconds when --stats is on, 0 otherwise (so timing costs nothing when it is off)
+uint64_t statsClock(void)
+{
+    struct timespec now;
+
+    if (!statsEnabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//input: the phase, statsClock() taken when it started, time spent in nested phases to leave out
+//adds the time since start to the phase
+void statsPhase(statPhase phase, uint64_t start, uint64_t nestedNs)
+{
+    if (statsEnabled)
+        __atomic_fetch_add(&statPhaseNs[phase], statsClock() - start - nestedNs, __ATOMIC_RELAXED);
+}
+
+/**
+ * Convert a Unicode-formatted string containing only ASCII characters
+ * into a regular ASCII-formatted string (16 bit chars to 8 bit 
+ * chars).
+ *
+ * NOTE: this function does a heap allocation for the string it 
+ *       returns, caller is responsible for `free`-ing the allocation
+ *       when necessary.
+ *
+ * uint16_t *unicode_string: the Unicode-formatted string to be 
+ *                           converted.
+ * uint8_t   length: the length of the Unicode-formatted string (in
+ *                   characters).
+ *
+ * returns: a heap allocated ASCII-formatted string.
+ */
+char *unicode2ascii(uint16_t *unicode_string, uint8_t length)
+{
+    assert(unicode_string != NULL);
+    assert(length > 0);
+    
+    char *ascii_string = NULL;
+
+    STAT_ADD(STAT_NAME_ALLOCATIONS, 1);
+    if (unicode_string != NULL && length > 0)
+    {
+        // +1 for a NULL terminator
+        ascii_string = calloc(sizeof(char), length + 1);
+
+        if (ascii_string)
+        {
+            // strip the top 8 bits from every character in the
+            // unicode string
+            for (uint8_t i = 0; i < length; i++)
+            {
+                ascii_string[i] = (char)unicode_string[i];
+            }
+            // stick a null terminator at the end of the string.
+            ascii_string[length] = '\0';
+        }
+    }
+
+    return ascii_string;
+}
+
+//------------------------------------------------------
+// readVolume
+//
+// PURPOSE: Copy bytes of the volume into a buffer, from the mapping or with pread. Bytes past the end of the volume read as zero.
+// INPUT PARAMETERS:
+//     the volume, offset in bytes from the start of the volume, buffer to fill, how many bytes to copy
+//------------------------------------------------------
+void readVolume(const exfatVolume *volume, uint64_t offset, void *buffer, size_t length)
+{
+    size_t available = 0;
+
+    if (offset < volume->size)
+        available = volume->size - offset < length ? volume->size - offset : length;
+
+    if (volume->map != NULL)
+    {
+        memcpy(buffer, volume->map + offset, available);
+    }
+    else
+    {
+        size_t total = 0;
+        while (total < available)
+        {
+            ssize_t got = pread(volume->fd, (uint8_t *)buffer + total, available - total, offset + total);
+            STAT_ADD(STAT_READ_CALLS, 1);
+            if (got <= 0)
+                break;
+            total += got;
+        }
+        available = total;
+    }
+    STAT_ADD(STAT_BYTES_READ, available);
+    memset((uint8_t *)buffer + available, 0, length - available);
+}
+
+//input: the volume, offset and length of a region of it, a buffer of at least length bytes that is only used when the volume is not mapped
+//returns a pointer to the region: straight into the mapping when possible, otherwise into scratch after reading it there
+const uint8_t *volumeData(const exfatVolume *volume, uint64_t offset, size_t length, void *scratch)
+{
+    if (volume->map != NULL && offset <= volume->size && length <= volume->size - offset)
+    {
+        STAT_ADD(STAT_BYTES_READ, length);
+        return volume->map + offset;
+    }
+    readVolume(volume, offset, scratch, length);
+    return scratch;
+}
+
+//input: volume being opened, boot sector of exFAT volume
+static void getSerialNumber(exfatVolume *volume, const uint8_t *bootSector)
+{
+    memcpy(&volume->serialNumber, bootSector + 100, 4);
+}
+
+//input: volume being opened, boot sector of exFAT volume
+static void getRootDirectory(exfatVolume *volume, const uint8_t *bootSector)
+{
+    memcpy(&volume->rootDirectory, bootSector + 96, 4);
+}
+
+//return offset in bytes from start of volume to cluster, in 64 bits since heaps are up to 128 PB
+uint64_t findOffsetToCluster(const exfatVolume *volume, uint32_t cluster)
+{
+    uint64_t offset = (uint64_t)volume->clstHeapOffset * volume->bytesPerSector + (uint64_t)(cluster - CLUSTER_INDEX_OFFSET) * volume->bytesPerCluster;
+    return offset;
+}
+
+//------------------------------------------------------
+// validGeometry
+//
+// PURPOSE: Check the boot sector before anything is derived from it, so that every cluster, sector and byte offset computed later stays inside the volume: the file system name is right, the shifts and number of FATs are in the ranges the specification allows, the FAT holds an entry per cluster and ends before the cluster heap, the heap fits in VolumeLength and the root directory is inside it
+// INPUT PARAMETERS:
+//     boot sector of exFAT volume
+// OUTPUT PARAMETERS:
+//      true if the volume can be read
+//------------------------------------------------------
+static bool validGeometry(const uint8_t *bootSector)
+{
+    uint64_t volumeLength;
+    uint32_t fatOffset, fatLength, heapOffset, clusterCount, rootCluster;
+    uint8_t sectorShift = bootSector[108];
+    uint8_t clusterShift = bootSector[109];
+    uint8_t fatCount = bootSector[110];
+
+    memcpy(&volumeLength, bootSector + 72, 8);
+    memcpy(&fatOffset, bootSector + 80, 4);
+    memcpy(&fatLength, bootSector + 84, 4);
+    memcpy(&heapOffset, bootSector + 88, 4);
+    memcpy(&clusterCount, bootSector + 92, 4);
+    memcpy(&rootCluster, bootSector + 96, 4);
+
+    if (memcmp(bootSector + 3, FILE_SYSTEM_NAME, strlen(FILE_SYSTEM_NAME)) != 0)
+        return false;
+    if (sectorShift < MIN_SECTOR_SHIFT || sectorShift > MAX_SECTOR_SHIFT || clusterShift > MAX_CLUSTER_SHIFT - sectorShift || fatCount < 1 || fatCount > 2)
+        return false;
+    if (clusterCount == 0 || clusterCount > MAX_CLUSTER_COUNT || rootCluster < CLUSTER_INDEX_OFFSET || rootCluster - CLUSTER_INDEX_OFFSET >= clusterCount)
+        return false;
+    if (((uint64_t)clusterCount + CLUSTER_INDEX_OFFSET) * FAT_ENTRY_BYTES > (uint64_t)fatLength << sectorShift)
+        return false;
+    if ((uint64_t)fatOffset + (uint64_t)fatLength * fatCount > heapOffset)
+        return false;
+    return (uint64_t)heapOffset + ((uint64_t)clusterCount << clusterShift) <= volumeLength;
+}
+
+//------------------------------------------------------
+// clusterHeapOffset
+//
+// PURPOSE: Find the offset in sectors the beginning of the cluster heap / data region as well as the count of clusters in the volume
+// INPUT PARAMETERS:
+//     volume being opened, boot sector of exFAT volume
+//------------------------------------------------------
+static void clusterHeapOffset(exfatVolume *volume, const uint8_t *bootSector)
+{
+    memcpy(&volume->clstHeapOffset, bootSector + 88, 4);
+    memcpy(&volume->clusterCount, bootSector + 92, 4);
+}
+
+//------------------------------------------------------
+// sectorsPerClus
+//
+// PURPOSE: Find how many sectors there are per cluster and how many bytes per sector
+// INPUT PARAMETERS:
+//     volume being opened, boot sector of exFAT volume
+//------------------------------------------------------
+static void sectorsPerClus(exfatVolume *volume, const uint8_t *bootSector)
+{
+    uint8_t powerOfTwoClst = bootSector[109];     // 2^powerOfTwoClst = sectors per cluster
+    uint8_t powerOfTwoSecBytes = bootSector[108]; // 2^powerOfTwoSecBytes = bytes per sector
+    int sctPerClst = 1;                           // minimum
+    int bytesPerSec = 1;                          // minimum
+
+    // 2 ^ powerOfTwoSecBytes
+    bytesPerSec = bytesPerSec << powerOfTwoSecBytes;
+    volume->bytesPerSector = bytesPerSec;
+    //2 ^ powerOfTwoClst
+    sctPerClst = sctPerClst << powerOfTwoClst;
+    volume->sectorsPerCluster = sctPerClst;
+    volume->bytesPerCluster = (uint64_t)bytesPerSec * sctPerClst;
+}
+
+//input: volume being opened, boot sector of exFAT volume
+static void getFatOffset(exfatVolume *volume, const uint8_t *bootSector)
+{
+    memcpy(&volume->fatOffset, bootSector + 80, 4);
+}
+
+//input: volume being opened, boot sector of exFAT volume
+static void getFatLength(exfatVolume *volume, const uint8_t *bootSector)
+{
+    memcpy(&volume->fatLength, bootSector + 84, 4);
+}
+
+//------------------------------------------------------
+// loadFat
+//
+// PURPOSE: Make the whole FAT available in memory so that following a cluster chain never issues I/O. A mapped volume is used in place, otherwise the FAT is read with one bulk read.
+// INPUT PARAMETERS:
+//     the volume (geometry must already be known)
+//------------------------------------------------------
+static void loadFat(exfatVolume *volume)
+{
+    //FAT[0] and FAT[1] are reserved, cluster X lives at FAT[X]
+    size_t entries = (size_t)volume->clusterCount + CLUSTER_INDEX_OFFSET;
+    size_t fatBytes = (size_t)volume->fatLength * volume->bytesPerSector;
+    uint64_t fatStart = (uint64_t)volume->fatOffset * volume->bytesPerSector;
+
+    if (volume->map != NULL && fatBytes >= entries * FAT_ENTRY_BYTES && fatStart + entries * FAT_ENTRY_BYTES <= volume->size)
+    {
+        volume->fatCache = (const uint32_t *)(volume->map + fatStart);
+        volume->fatCacheOwned = false;
+        return;
+    }
+
+    if (fatBytes > entries * FAT_ENTRY_BYTES)
+        fatBytes = entries * FAT_ENTRY_BYTES;
+    uint32_t *fat = calloc(entries, FAT_ENTRY_BYTES);
+    assert(fat != NULL);
+    readVolume(volume, fatStart, fat, fatBytes);
+    volume->fatCache = fat;
+    volume->fatCacheOwned = true;
+}
+
+//input: the volume, the current cluster
+//this returns the value stored at FAT[currCluster], served from the in-memory FAT.
+//recall that the correct cluster index is the value returned - 2 for historical reasons.
+uint32_t nextCluster(const exfatVolume *volume, uint32_t currCluster)
+{
+    STAT_ADD(STAT_FAT_LOOKUPS, 1);
+    if (currCluster < CLUSTER_INDEX_OFFSET || currCluster >= volume->clusterCount + CLUSTER_INDEX_OFFSET)
+        return END_OF_CHAIN;
+    return volume->fatCache[currCluster];
+}
+
+//------------------------------------------------------
+// buildExtents
+//
+// PURPOSE: Turn a FAT chain into a run-length list of extents so that contiguous clusters can be transferred with one large I/O
+// INPUT PARAMETERS:
+//     the volume, first cluster of the chain, how many clusters are wanted (0 to follow the chain to its end), where to store the number of extents
+// OUTPUT PARAMETERS:
+//      heap allocated array of extents, caller must free it
+//------------------------------------------------------
+extent *buildExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t clustersWanted, int *extentCount)
+{
+    int capacity = 8;
+    int count = 0;
+    uint64_t clustersFound = 0;
+    uint32_t currCluster = firstCluster;
+    extent *extents = malloc(capacity * sizeof(extent));
+    assert(extents != NULL);
+
+    //no chain is longer than the heap, so a FAT that loops back on itself cannot keep this going forever
+    while (currCluster >= CLUSTER_INDEX_OFFSET && currCluster < volume->clusterCount + CLUSTER_INDEX_OFFSET && clustersFound < volume->clusterCount &&
+           (clustersWanted == 0 || clustersFound < clustersWanted))
+    {
+        if (count > 0 && extents[count - 1].startCluster + extents[count - 1].count == currCluster)
+        {
+            extents[count - 1].count++;
+        }
+        else
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                extents = realloc(extents, capacity * sizeof(extent));
+                assert(extents != NULL);
+            }
+            extents[count].startCluster = currCluster;
+            extents[count].count = 1;
+            count++;
+        }
+        clustersFound++;
+        currCluster = nextCluster(volume, currCluster);
+    }
+    STAT_ADD(STAT_CLUSTERS_VISITED, clustersFound);
+    *extentCount = count;
+    return extents;
+}
+
+//------------------------------------------------------
+// fileExtents
+//
+// PURPOSE: Find the extents holding a file's data. A NoFatChain file is a single extent and never touches the FAT; it is cut off at the end of the cluster heap.
+// INPUT PARAMETERS:
+//     the volume, first cluster of the file, its length in bytes, its NoFatChain flag, where to store the number of extents
+// OUTPUT PARAMETERS:
+//      heap allocated array of extents, caller must free it
+//------------------------------------------------------
+extent *fileExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t length, bool noFatChain, int *extentCount)
+{
+    uint64_t clusters = (length + volume->bytesPerCluster - 1) / volume->bytesPerCluster;
+
+    if (!noFatChain)
+        return buildExtents(volume, firstCluster, clusters, extentCount);
+
+    extent *extents = malloc(sizeof(extent));
+    assert(extents != NULL);
+    if (firstCluster < CLUSTER_INDEX_OFFSET || firstCluster - CLUSTER_INDEX_OFFSET >= volume->clusterCount)
+        clusters = 0;
+    else if (clusters > (uint64_t)volume->clusterCount + CLUSTER_INDEX_OFFSET - firstCluster)
+        clusters = (uint64_t)volume->clusterCount + CLUSTER_INDEX_OFFSET - firstCluster;
+    extents[0].startCluster = firstCluster;
+    extents[0].count = clusters;
+    *extentCount = clusters > 0 ? 1 : 0;
+    STAT_ADD(STAT_CLUSTERS_VISITED, clusters);
+    return extents;
+}
+
+//input: a growing array of extents, its count and capacity, the extent to add
+static void appendExtent(extent **extents, int *count, int *capacity, uint32_t startCluster, uint32_t clusters)
+{
+    if (*count == *capacity)
+    {
+        *capacity *= 2;
+        *extents = realloc(*extents, *capacity * sizeof(extent));
+        assert(*extents != NULL);
+    }
+    (*extents)[*count].startCluster = startCluster;
+    (*extents)[*count].count = clusters;
+    (*count)++;
+}
+
+//------------------------------------------------------
+// buildFatRuns
+//
+// PURPOSE: Measure, in one backward pass over the in-memory FAT, how many clusters of a chain follow each cluster contiguously. With it runExtents resolves a chain an extent at a time instead of a FAT entry at a time.
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      heap allocated array indexed by cluster: clusters from it to the end of its contiguous run, at least 1. caller must free it
+//------------------------------------------------------
+uint32_t *buildFatRuns(const exfatVolume *volume)
+{
+    uint64_t end = (uint64_t)volume->clusterCount + CLUSTER_INDEX_OFFSET;
+    uint32_t *runs = malloc(end * sizeof(uint32_t));
+    assert(runs != NULL);
+
+    runs[0] = runs[1] = 1; //reserved entries
+    for (uint64_t cluster = end - 1; cluster >= CLUSTER_INDEX_OFFSET; cluster--)
+        runs[cluster] = (cluster + 1 < end && volume->fatCache[cluster] == cluster + 1) ? runs[cluster + 1] + 1 : 1;
+    return runs;
+}
+
+//------------------------------------------------------
+// runExtents
+//
+// PURPOSE: Same extents as buildExtents, found with one FAT lookup per extent rather than per cluster
+// INPUT PARAMETERS:
+//     the volume, its runs from buildFatRuns, first cluster of the chain, how many clusters are wanted, where to store the number of extents
+// OUTPUT PARAMETERS:
+//      heap allocated array of extents, caller must free it
+//------------------------------------------------------
+extent *runExtents(const exfatVolume *volume, const uint32_t *runs, uint32_t firstCluster, uint64_t clustersWanted, int *extentCount)
+{
+    int capacity = 8;
+    int count = 0;
+    uint64_t clustersFound = 0;
+    uint32_t currCluster = firstCluster;
+    extent *extents = malloc(capacity * sizeof(extent));
+    assert(extents != NULL);
+
+    //every extent adds at least a cluster, so a looping chain still ends at clustersWanted
+    while (currCluster >= CLUSTER_INDEX_OFFSET && currCluster < volume->clusterCount + CLUSTER_INDEX_OFFSET && clustersFound < clustersWanted)
+    {
+        uint64_t clusters = runs[currCluster];
+        if (clusters > clustersWanted - clustersFound)
+            clusters = clustersWanted - clustersFound;
+        appendExtent(&extents, &count, &capacity, currCluster, clusters);
+        clustersFound += clusters;
+        currCluster = nextCluster(volume, currCluster + clusters - 1);
+    }
+    STAT_ADD(STAT_CLUSTERS_VISITED, clustersFound);
+    *extentCount = count;
+    return extents;
+}
+
+//------------------------------------------------------
+// countExtents
+//
+// PURPOSE: Count the extents holding a file's data, like fileExtents but without building the list
+// INPUT PARAMETERS:
+//     the volume, first cluster of the file, its length in bytes, its NoFatChain flag
+// OUTPUT PARAMETERS:
+//      number of extents (0 for an empty file)
+//------------------------------------------------------
+uint32_t countExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t length, bool noFatChain)
+{
+    uint64_t clustersWanted = (length + volume->bytesPerCluster - 1) / volume->bytesPerCluster;
+    uint64_t clustersFound = 0;
+    uint32_t count = 0;
+    uint32_t previous = 0;
+    uint32_t currCluster = firstCluster;
+
+    if (noFatChain)
+        return clustersWanted > 0 ? 1 : 0;
+    while (currCluster >= CLUSTER_INDEX_OFFSET && currCluster < volume->clusterCount + CLUSTER_INDEX_OFFSET && clustersFound < clustersWanted)
+    {
+        if (clustersFound == 0 || currCluster != previous + 1)
+            count++;
+        previous = currCluster;
+        clustersFound++;
+        currCluster = nextCluster(volume, currCluster);
+    }
+    STAT_ADD(STAT_CLUSTERS_VISITED, clustersFound);
+    return count;
+}
+
+//------------------------------------------------------
+// timestampToUnixMs
+//
+// PURPOSE: Convert an exFAT timestamp (seconds / 2 in bits 0-4, minute 5-10, hour 11-15, day 16-20, month 21-24, years since 1980 25-31) to milliseconds since 1970. Times without a valid UTC offset are taken to be UTC already.
+// INPUT PARAMETERS:
+//     the timestamp, its 10 ms increment (0 if it has none), its UTC offset byte
+// OUTPUT PARAMETERS:
+//      milliseconds since the Unix epoch, 0 if the timestamp is not set
+//------------------------------------------------------
+int64_t timestampToUnixMs(uint32_t timestamp, uint8_t tenMs, uint8_t utcOffset)
+{
+    int64_t year = 1980 + (timestamp >> 25);
+    int64_t month = (timestamp >> 21) & 0x0F;
+    int64_t day = (timestamp >> 16) & 0x1F;
+    int64_t seconds = ((timestamp >> 11) & 0x1F) * 3600 + ((timestamp >> 5) & 0x3F) * 60 + (timestamp & 0x1F) * 2;
+
+    if (month < 1 || month > 12 || day < 1)
+        return 0;
+    //days from 1970-01-01 to the date, counting years from March so the leap day comes last
+    if (month <= 2)
+        year--;
+    int64_t era = year / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    int64_t days = era * 146097 + dayOfEra - 719468;
+
+    if (utcOffset & 0x80) //7 bit two's complement count of 15 minutes
+        seconds -= (int64_t)((int8_t)(utcOffset << 1) >> 1) * 15 * 60;
+    return (days * 86400 + seconds) * 1000 + tenMs * 10;
+}
+
+//one lock's worth of the cluster cache: a hash table of the clusters it holds and a least recently used list through the same slots
+typedef struct clusterCacheShard
+{
+    pthread_mutex_t lock;
+    int slotCount;
+    int used;           //slots filled so far, the others are taken before anything is evicted
+    int newest;         //ends of the LRU list, -1 when it is empty
+    int oldest;
+    uint32_t *clusters; //cluster held by each slot
+    int *newer;         //LRU links between slots, -1 at the ends
+    int *older;
+    int *chain;         //next slot in the same hash bucket, -1 at the end
+    int *buckets;       //slotCount of them, first slot of each, -1 when empty
+    uint8_t *blocks;    //slotCount clusters of data
+} clusterCacheShard;
+
+struct clusterCache
+{
+    clusterCacheShard shards[CLUSTER_CACHE_SHARDS];
+};
+
+//input: a cluster
+//returns where it lives in the cache: the top bits pick the shard, the whole value the bucket
+static uint32_t cacheHash(uint32_t cluster)
+{
+    return cluster * CACHE_HASH_MULTIPLIER;
+}
+
+//------------------------------------------------------
+// enableClusterCache
+//
+// PURPOSE: Put a cache of whole clusters in front of the volume's metadata reads (directories, the root directory, the up-case table) so that walking the same directories again costs no I/O. File data and the allocation bitmap are read past it, so bulk reads never evict metadata. The cache is split into CLUSTER_CACHE_SHARDS independently locked least recently used lists so threads rarely wait for each other. A mapped volume needs no cache: its metadata already comes straight from the page cache.
+// INPUT PARAMETERS:
+//     the volume (before it is shared between threads), the most memory the cached clusters may use
+// OUTPUT PARAMETERS:
+//      true if the cache is in use, false when the volume is mapped or the budget is under one cluster per shard
+//------------------------------------------------------
+bool enableClusterCache(exfatVolume *volume, uint64_t budgetBytes)
+{
+    uint64_t slotsPerShard = budgetBytes / volume->bytesPerCluster / CLUSTER_CACHE_SHARDS;
+
+    if (volume->map != NULL || volume->cache != NULL || slotsPerShard == 0)
+        return false;
+    if (slotsPerShard > INT32_MAX)
+        slotsPerShard = INT32_MAX;
+    volume->cache = calloc(1, sizeof(clusterCache));
+    assert(volume->cache != NULL);
+    for (int i = 0; i < CLUSTER_CACHE_SHARDS; i++)
+    {
+        clusterCacheShard *shard = &volume->cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slotCount = slotsPerShard;
+        shard->newest = shard->oldest = -1;
+        shard->clusters = malloc(slotsPerShard * sizeof(uint32_t));
+        shard->newer = malloc(slotsPerShard * sizeof(int));
+        shard->older = malloc(slotsPerShard * sizeof(int));
+        shard->chain = malloc(slotsPerShard * sizeof(int));
+        shard->buckets = malloc(slotsPerShard * sizeof(int));
+        shard->blocks = malloc(slotsPerShard * volume->bytesPerCluster); //pages are only touched as clusters are cached
+        assert(shard->clusters != NULL && shard->newer != NULL && shard->older != NULL && shard->chain != NULL && shard->buckets != NULL && shard->blocks != NULL);
+        memset(shard->buckets, 0xFF, slotsPerShard * sizeof(int)); //all -1
+    }
+    return true;
+}
+
+//input: a volume's cluster cache, releases it
+static void freeClusterCache(clusterCache *cache)
+{
+    for (int i = 0; i < CLUSTER_CACHE_SHARDS; i++)
+    {
+        clusterCacheShard *shard = &cache->shards[i];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->clusters);
+        free(shard->newer);
+        free(shard->older);
+        free(shard->chain);
+        free(shard->buckets);
+        free(shard->blocks);
+    }
+    free(cache);
+}
+
+//input: a locked shard, a slot on its LRU list
+static void cacheUnlink(clusterCacheShard *shard, int slot)
+{
+    if (shard->newer[slot] >= 0)
+        shard->older[shard->newer[slot]] = shard->older[slot];
+    else
+        shard->newest = shard->older[slot];
+    if (shard->older[slot] >= 0)
+        shard->newer[shard->older[slot]] = shard->newer[slot];
+    else
+        shard->oldest = shard->newer[slot];
+}
+
+//input: a locked shard, a slot that is not on its LRU list
+static void cachePushNewest(clusterCacheShard *shard, int slot)
+{
+    shard->newer[slot] = -1;
+    shard->older[slot] = shard->newest;
+    if (shard->newest >= 0)
+        shard->newer[shard->newest] = slot;
+    else
+        shard->oldest = slot;
+    shard->newest = slot;
+}
+
+//input: the volume, a cluster, a cluster sized buffer
+//returns true, with the cluster copied into the buffer, if the cache holds it
+static bool cacheGet(const exfatVolume *volume, uint32_t cluster, uint8_t *buffer)
+{
+    uint32_t hash = cacheHash(cluster);
+    clusterCacheShard *shard = &volume->cache->shards[hash >> CACHE_SHARD_SHIFT];
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    for (slot = shard->buckets[hash % shard->slotCount]; slot >= 0 && shard->clusters[slot] != cluster; slot = shard->chain[slot])
+        ;
+    if (slot >= 0)
+    {
+        memcpy(buffer, shard->blocks + slot * volume->bytesPerCluster, volume->bytesPerCluster);
+        cacheUnlink(shard, slot);
+        cachePushNewest(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    STAT_ADD(slot >= 0 ? STAT_CACHE_HITS : STAT_CACHE_MISSES, 1);
+    return slot >= 0;
+}
+
+//input: the volume, a cluster and its contents
+//caches the cluster, evicting the shard's least recently used one when it is full
+static void cachePut(const exfatVolume *volume, uint32_t cluster, const uint8_t *data)
+{
+    uint32_t hash = cacheHash(cluster);
+    clusterCacheShard *shard = &volume->cache->shards[hash >> CACHE_SHARD_SHIFT];
+    int *link;
+    int slot;
+
+    pthread_mutex_lock(&shard->lock);
+    for (slot = shard->buckets[hash % shard->slotCount]; slot >= 0 && shard->clusters[slot] != cluster; slot = shard->chain[slot])
+        ;
+    if (slot < 0) //another thread may have cached it since our miss
+    {
+        if (shard->used < shard->slotCount)
+        {
+            slot = shard->used++;
+        }
+        else
+        {
+            slot = shard->oldest;
+            cacheUnlink(shard, slot);
+            for (link = &shard->buckets[cacheHash(shard->clusters[slot]) % shard->slotCount]; *link != slot; link = &shard->chain[*link])
+                ;
+            *link = shard->chain[slot]; //out of its old bucket
+        }
+        shard->clusters[slot] = cluster;
+        shard->chain[slot] = shard->buckets[hash % shard->slotCount];
+        shard->buckets[hash % shard->slotCount] = slot;
+        memcpy(shard->blocks + slot * volume->bytesPerCluster, data, volume->bytesPerCluster);
+        cachePushNewest(shard, slot);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//------------------------------------------------------
+// readMetadata
+//
+// PURPOSE: Read consecutive clusters of metadata through the cluster cache. Clusters it holds are copied from it, each run of clusters it does not hold is read with a single readVolume and then cached.
+// INPUT PARAMETERS:
+//     the volume, the first cluster, how many clusters, buffer for them all
+//------------------------------------------------------
+static void readMetadata(const exfatVolume *volume, uint32_t firstCluster, uint64_t clusterCount, uint8_t *buffer)
+{
+    uint64_t bytesPerCluster = volume->bytesPerCluster;
+    uint64_t missStart = 0;
+    uint64_t missing = 0;
+
+    if (volume->cache == NULL)
+    {
+        readVolume(volume, findOffsetToCluster(volume, firstCluster), buffer, clusterCount * bytesPerCluster);
+        return;
+    }
+    for (uint64_t i = 0; i <= clusterCount; i++)
+    {
+        if (i < clusterCount && !cacheGet(volume, firstCluster + i, buffer + i * bytesPerCluster))
+        {
+            if (missing++ == 0)
+                missStart = i;
+            continue;
+        }
+        if (missing > 0)
+        {
+            readVolume(volume, findOffsetToCluster(volume, firstCluster + missStart), buffer + missStart * bytesPerCluster, missing * bytesPerCluster);
+            for (uint64_t j = missStart; j < missStart + missing; j++)
+                cachePut(volume, firstCluster + j, buffer + j * bytesPerCluster);
+            missing = 0;
+        }
+    }
+}
+
+//------------------------------------------------------
+// openVolume
+//
+// PURPOSE: Open an exFAT volume, map it read-only so that every later access is a pointer read, parse the boot sector and load the FAT. Block devices (or anything else that cannot be mapped) fall back to positional reads with pread. Nothing is read through the file offset, so any number of volumes can be open at once and each can be shared between threads.
+// INPUT PARAMETERS:
+//     path of the exFAT volume, false to never map it
+// OUTPUT PARAMETERS:
+//      heap allocated handle to pass to closeVolume, NULL with errno set if the volume cannot be opened
+//------------------------------------------------------
+exfatVolume *openVolume(const char *fileName, bool useMmap)
+{
+    struct stat volumeInfo;
+    uint8_t scratch[BOOT_SECTOR_BYTES];
+    exfatVolume *volume = calloc(1, sizeof(exfatVolume));
+    assert(volume != NULL);
+
+    volume->fd = open(fileName, O_RDONLY);
+    if (volume->fd < 0 || fstat(volume->fd, &volumeInfo) != 0)
+    {
+        int error = errno;
+        if (volume->fd >= 0)
+            close(volume->fd);
+        free(volume);
+        errno = error;
+        return NULL;
+    }
+
+    if (S_ISREG(volumeInfo.st_mode))
+        volume->size = volumeInfo.st_size;
+    else
+        volume->size = lseek(volume->fd, 0, SEEK_END); //block devices report their size this way
+
+    if (useMmap && S_ISREG(volumeInfo.st_mode) && volume->size > 0 && volume->size <= SIZE_MAX) //a 32 bit build cannot map a large image and reads it instead
+    {
+        void *map = mmap(NULL, volume->size, PROT_READ, MAP_SHARED, volume->fd, 0);
+        if (map != MAP_FAILED)
+            volume->map = map;
+    }
+
+    uint64_t start = statsClock();
+    const uint8_t *bootSector = volumeData(volume, 0, BOOT_SECTOR_BYTES, scratch);
+    if (!validGeometry(bootSector))
+    {
+        if (volume->map != NULL)
+            munmap((void *)volume->map, volume->size);
+        close(volume->fd);
+        free(volume);
+        errno = EINVAL;
+        return NULL;
+    }
+    getSerialNumber(volume, bootSector);
+    getRootDirectory(volume, bootSector);
+    sectorsPerClus(volume, bootSector);
+    clusterHeapOffset(volume, bootSector);
+    getFatOffset(volume, bootSector);
+    getFatLength(volume, bootSector);
+    statsPhase(PHASE_BOOT, start, 0);
+    start = statsClock();
+    loadFat(volume);
+    statsPhase(PHASE_FAT, start, 0);
+    return volume;
+}
+
+//input: a volume returned by openVolume, releases everything it holds
+void closeVolume(exfatVolume *volume)
+{
+    if (volume->cache != NULL)
+        freeClusterCache(volume->cache);
+    free(volume->upcaseTable);
+    if (volume->fatCacheOwned)
+        free((void *)volume->fatCache);
+    if (volume->map != NULL)
+        munmap((void *)volume->map, volume->size);
+    close(volume->fd);
+    free(volume);
+}
+
+//------------------------------------------------------
+// openDirectory
+//
+// PURPOSE: Prepare to walk a directory. The whole directory is made available in memory with one I/O per extent (none at all when it is a single extent of a mapped volume) so entry sets can be decoded without any further reads.
+// INPUT PARAMETERS:
+//     the volume, the iterator to set up, first cluster of the directory, its DataLength (0 to follow the FAT chain to its end, as for the root directory), its NoFatChain flag
+//------------------------------------------------------
+void openDirectory(const exfatVolume *volume, dirIterator *iterator, uint32_t firstCluster, uint64_t dataLength, bool noFatChain)
+{
+    uint64_t bytesPerCluster = volume->bytesPerCluster;
+    uint64_t total = 0;
+    int extentCount;
+    extent *extents;
+
+    if (dataLength == 0)
+        extents = buildExtents(volume, firstCluster, 0, &extentCount);
+    else
+        extents = fileExtents(volume, firstCluster, dataLength, noFatChain, &extentCount);
+    for (int i = 0; i < extentCount; i++)
+        total += extents[i].count * bytesPerCluster;
+    if (dataLength != 0 && dataLength < total)
+        total = dataLength;
+
+    STAT_ADD(STAT_DIRECTORIES_READ, 1);
+    iterator->owned = NULL;
+    iterator->length = total;
+    iterator->position = 0;
+    iterator->filterByHash = false;
+    if (extentCount == 1 && volume->map != NULL && findOffsetToCluster(volume, extents[0].startCluster) + total <= volume->size)
+    {
+        iterator->contents = volume->map + findOffsetToCluster(volume, extents[0].startCluster);
+        STAT_ADD(STAT_BYTES_READ, total);
+    }
+    else
+    {
+        uint64_t filled = 0;
+        uint64_t clusterBytes = (total + bytesPerCluster - 1) / bytesPerCluster * bytesPerCluster; //whole clusters, as the cache holds them
+        iterator->owned = malloc(clusterBytes > 0 ? clusterBytes : 1);
+        assert(iterator->owned != NULL);
+        for (int i = 0; i < extentCount && filled < total; i++)
+        {
+            uint64_t clusters = extents[i].count;
+            if (clusters * bytesPerCluster > clusterBytes - filled)
+                clusters = (clusterBytes - filled) / bytesPerCluster;
+            readMetadata(volume, extents[i].startCluster, clusters, iterator->owned + filled);
+            filled += clusters * bytesPerCluster;
+        }
+        iterator->contents = iterator->owned;
+    }
+    free(extents);
+}
+
+//input: iterator set up by openDirectory
+void closeDirectory(dirIterator *iterator)
+{
+    free(iterator->owned);
+}
+
+//input: iterator set up by openDirectory
+//returns the next 32 byte entry of the directory, or NULL once the end of directory entry (type 0) or the end of its clusters is reached
+const uint8_t *nextRawEntry(dirIterator *iterator)
+{
+    const uint8_t *entry;
+
+    if (iterator->position + BYTES_PER_ENTRY > iterator->length)
+        return NULL;
+    entry = iterator->contents + iterator->position;
+    if (entry[0] == 0)
+        return NULL;
+    iterator->position += BYTES_PER_ENTRY;
+    return entry;
+}
+
+//------------------------------------------------------
+// nextDirEntry
+//
+// PURPOSE: Decode the next File / Stream Extension / File Name entry set of the directory. Everything else (volume label, bitmap, deleted sets...) is skipped.
+// INPUT PARAMETERS:
+//     iterator set up by openDirectory, the struct to fill in
+// OUTPUT PARAMETERS:
+//      true if an entry set was decoded, false at the end of the directory
+//------------------------------------------------------
+bool nextDirEntry(dirIterator *iterator, dirEntry *file)
+{
+    const uint8_t *entry;
+
+    while ((entry = nextRawEntry(iterator)) != NULL)
+    {
+        if (entry[0] != FILE_TYPE_ENTRY)
+            continue;
+
+        STAT_ADD(STAT_ENTRY_SETS, 1);
+        int secondaryCount = entry[1]; //to know how many file name directories there is
+        memcpy(&file->attributes, entry + 4, 2); //after 2 bytes of set checksum
+        file->directory = (file->attributes & FILE_BIT_OFFSET) == FILE_BIT_OFFSET;
+        memcpy(&file->createTimestamp, entry + 8, 4);
+        memcpy(&file->modifyTimestamp, entry + 12, 4);
+        memcpy(&file->accessTimestamp, entry + 16, 4);
+        file->create10ms = entry[20];
+        file->modify10ms = entry[21];
+        file->createUtcOffset = entry[22];
+        file->modifyUtcOffset = entry[23];
+        file->accessUtcOffset = entry[24];
+
+        //stream extension
+        entry = nextRawEntry(iterator);
+        if (entry == NULL)
+            return false;
+        if (entry[0] != STREAM_EXTENSION_ENTRY) //damaged set, look for the next one from here
+        {
+            iterator->position -= BYTES_PER_ENTRY;
+            continue;
+        }
+        file->generalFlags = entry[1];
+        file->noFatChain = (entry[1] & NO_FAT_CHAIN_FLAG) != 0;
+        file->nameLength = entry[3];
+        memcpy(&file->nameHash, entry + 4, 2);
+        memcpy(&file->firstCluster, entry + 20, 4);
+        memcpy(&file->dataLength, entry + 24, 8);
+        memcpy(&file->validDataLength, entry + 8, 8);
+        if (file->validDataLength > file->dataLength) //corrupt, trust DataLength
+            file->validDataLength = file->dataLength;
+        if (iterator->filterByHash && file->nameHash != iterator->wantedHash) //not the name being looked for, skip its name entries
+        {
+            for (int i = 0; i < secondaryCount - 1 && nextRawEntry(iterator) != NULL; i++)
+                ;
+            continue;
+        }
+
+        //the file name entries of the set
+        int nameEntries = 0;
+        for (int i = 0; i < secondaryCount - 1; i++) // - 1 because the stream extension has been read already
+        {
+            entry = nextRawEntry(iterator);
+            if (entry == NULL)
+                return false;
+            if (entry[0] == FILE_NAME_ENTRY && UNICODE_CHARS_PER_ENTRY * (nameEntries + 1) <= MAX_ASCII_STRING_SIZE)
+            {
+                memcpy(&file->name[UNICODE_CHARS_PER_ENTRY * nameEntries], entry + 2, UNICODE_CHARS_PER_ENTRY * ASCII_TO_UNICODE_CHAR_RATIO);
+                nameEntries++;
+            }
+        }
+        if (file->nameLength > nameEntries * UNICODE_CHARS_PER_ENTRY)
+            file->nameLength = nameEntries * UNICODE_CHARS_PER_ENTRY;
+        if (file->nameLength == 0)
+            continue;
+        return true;
+    }
+    return false;
+}
+
+//------------------------------------------------------
+// findRootEntry
+//
+// PURPOSE: Find the first entry of a given type in the root directory (volume label, allocation bitmap...)
+// INPUT PARAMETERS:
+//     the volume, the entry type to look for, BYTES_PER_ENTRY buffer to copy the entry into
+// OUTPUT PARAMETERS:
+//      true if the entry was found
+//------------------------------------------------------
+bool findRootEntry(const exfatVolume *volume, uint8_t entryType, uint8_t *entryCopy)
+{
+    dirIterator root;
+    const uint8_t *entry;
+
+    openDirectory(volume, &root, volume->rootDirectory, 0, false);
+    while ((entry = nextRawEntry(&root)) != NULL && entry[0] != entryType)
+        ;
+    if (entry != NULL)
+        memcpy(entryCopy, entry, BYTES_PER_ENTRY);
+    closeDirectory(&root);
+    return entry != NULL;
+}
+
+//------------------------------------------------------
+// loadUpcaseTable
+//
+// PURPOSE: Expand the volume's up-case table so that names can be compared and hashed the way exFAT does. Characters the table does not cover (or every character, if the volume has no table) map to themselves, except ASCII letters which are always up-cased. The table is built on first use; threads that race to build it agree on one copy with a compare and swap.
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      UPCASE_TABLE_CHARS entries, owned by the volume
+//------------------------------------------------------
+const uint16_t *loadUpcaseTable(exfatVolume *volume)
+{
+    uint8_t entry[BYTES_PER_ENTRY];
+    uint32_t character = 0;
+    uint16_t *table = __atomic_load_n(&volume->upcaseTable, __ATOMIC_ACQUIRE);
+    uint16_t *expected = NULL;
+
+    if (table != NULL)
+        return table;
+    table = malloc(UPCASE_TABLE_CHARS * sizeof(uint16_t));
+    assert(table != NULL);
+    for (uint32_t i = 0; i < UPCASE_TABLE_CHARS; i++)
+        table[i] = (i >= 'a' && i <= 'z') ? i - 'a' + 'A' : i;
+
+    if (findRootEntry(volume, UPCASE_TABLE_ENTRY, entry))
+    {
+        uint32_t firstCluster;
+        uint64_t dataLength;
+        dirIterator compressed; //not a directory, but openDirectory brings any chain into memory
+        memcpy(&firstCluster, entry + 20, 4);
+        memcpy(&dataLength, entry + 24, 8);
+        openDirectory(volume, &compressed, firstCluster, dataLength, false);
+        for (uint64_t i = 0; i + 2 <= compressed.length && character < UPCASE_TABLE_CHARS; i += 2)
+        {
+            uint16_t mapping;
+            memcpy(&mapping, compressed.contents + i, 2);
+            if (mapping == UPCASE_IDENTITY_RUN && i + 4 <= compressed.length)
+            {
+                uint16_t runLength;
+                memcpy(&runLength, compressed.contents + i + 2, 2);
+                character += runLength; //already mapped to themselves
+                i += 2;
+            }
+            else
+            {
+                table[character++] = mapping;
+            }
+        }
+        closeDirectory(&compressed);
+    }
+
+    if (!__atomic_compare_exchange_n(&volume->upcaseTable, &expected, table, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        free(table); //another thread got there first
+        table = expected;
+    }
+    return table;
+}
+
+//input: the volume, a name (UTF-16) and its length in characters
+//returns the exFAT NameHash of the name, as stored in its stream extension entry
+uint16_t nameHash(exfatVolume *volume, const uint16_t *name, int length)
+{
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+    uint16_t hash = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        uint16_t character = upcaseTable[name[i]];
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (character >> 8);
+    }
+    return hash;
+}
+
+//input: the volume, two names (UTF-16) and their lengths in characters
+//returns true if the names are equal ignoring case, which is how exFAT compares names
+bool sameName(exfatVolume *volume, const uint16_t *first, int firstLength, const uint16_t *second, int secondLength)
+{
+    const uint16_t *upcaseTable = loadUpcaseTable(volume);
+
+    if (firstLength != secondLength)
+        return false;
+    for (int i = 0; i < firstLength; i++)
+    {
+        if (upcaseTable[first[i]] != upcaseTable[second[i]])
+            return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------
+// lookupPath
+//
+// PURPOSE: Find a file or directory from its path, one directory per component. Only entry sets with the component's NameHash are decoded and compared, and names are compared ignoring case like exFAT does.
+// INPUT PARAMETERS:
+//     the volume, the path ('/' separated, leading, trailing and doubled slashes are ignored), the struct to fill in
+// OUTPUT PARAMETERS:
+//      true if the path is on the volume (the root itself is not an entry, so "/" is never found)
+//------------------------------------------------------
+bool lookupPath(exfatVolume *volume, const char *userPath, dirEntry *found)
+{
+    uint32_t firstCluster = volume->rootDirectory;
+    uint64_t dataLength = 0; //the root directory always uses the FAT
+    bool noFatChain = false;
+    bool directory = true;
+    bool matched = false;
+    uint16_t wantedName[MAX_ASCII_STRING_SIZE];
+    char *myPath = strdup(userPath);
+    char *position;
+    assert(myPath != NULL);
+
+    for (char *component = strtok_r(myPath, "/", &position); component != NULL; component = strtok_r(NULL, "/", &position))
+    {
+        dirIterator directoryIterator;
+        int wantedLength = strlen(component);
+
+        matched = false;
+        if (!directory || wantedLength > MAX_ASCII_STRING_SIZE) //a file has no children, and the name cannot be on the volume
+            break;
+        for (int i = 0; i < wantedLength; i++)
+            wantedName[i] = (unsigned char)component[i];
+
+        openDirectory(volume, &directoryIterator, firstCluster, dataLength, noFatChain);
+        directoryIterator.filterByHash = true;
+        directoryIterator.wantedHash = nameHash(volume, wantedName, wantedLength);
+        while (!matched && nextDirEntry(&directoryIterator, found))
+            matched = sameName(volume, wantedName, wantedLength, found->name, found->nameLength); //false on a hash collision
+        closeDirectory(&directoryIterator);
+        if (!matched)
+            break;
+        firstCluster = found->firstCluster;
+        dataLength = found->dataLength;
+        noFatChain = found->noFatChain;
+        directory = found->directory;
+    }
+    free(myPath);
+    return matched;
+}
+
+//------------------------------------------------------
+// getVolumeLabel
+//
+// PURPOSE: Read the volume label
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      heap allocated label, "" when the volume has none. caller must free it
+//------------------------------------------------------
+char *getVolumeLabel(const exfatVolume *volume)
+{
+    uint16_t unicodeString[VOLUME_LABEL_CHARS];
+    uint8_t length = 0;
+    uint8_t entry[BYTES_PER_ENTRY];
+
+    if (findRootEntry(volume, VOLUME_LABEL_ENTRY, entry))
+        length = entry[1];
+    if (length > VOLUME_LABEL_CHARS)
+        length = VOLUME_LABEL_CHARS;
+    if (length == 0)
+        return calloc(1, 1); //no label, still heap allocated so the caller can free it
+    memcpy(unicodeString, entry + 2, length * ASCII_TO_UNICODE_CHAR_RATIO);
+    return unicode2ascii(unicodeString, length);
+}
+
+//------------------------------------------------------
+// countSetBitsPortable
+//
+// PURPOSE: Count the set bits of a block of bytes, 64 bits at a time with the classic SWAR reduction. Works on any CPU.
+// INPUT PARAMETERS:
+//     the bytes, how many of them there are
+// OUTPUT PARAMETERS:
+//      number of set bits
+//------------------------------------------------------
+static uint64_t countSetBitsPortable(const uint8_t *bytes, size_t length)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+    uint64_t word;
+
+    for (; i + sizeof(word) <= length; i += sizeof(word))
+    {
+        memcpy(&word, bytes + i, sizeof(word)); //unaligned safe load
+        word = word - ((word >> 1) & 0x5555555555555555ULL);
+        word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+        word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        count += (word * 0x0101010101010101ULL) >> 56;
+    }
+    for (; i < length; i++)
+    {
+        uint8_t byte = bytes[i];
+        while (byte != 0)
+        {
+            byte &= byte - 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//same as countSetBitsPortable but using the popcnt instruction, only called when the CPU has it
+__attribute__((target("popcnt"))) static uint64_t countSetBitsPopcnt(const uint8_t *bytes, size_t length)
+{
+    uint64_t count = 0;
+    size_t i = 0;
+    unsigned long long word;
+
+    for (; i + sizeof(word) <= length; i += sizeof(word))
+    {
+        memcpy(&word, bytes + i, sizeof(word));
+        count += __builtin_popcountll(word);
+    }
+    return count + countSetBitsPortable(bytes + i, length - i);
+}
+
+//------------------------------------------------------
+// countSetBitsAvx2
+//
+// PURPOSE: Count the set bits of a block of bytes 32 bytes at a time: each nibble is looked up in a 16 entry table with vpshufb and the per byte counts are summed with vpsadbw. Only called when the CPU has AVX2.
+// INPUT PARAMETERS:
+//     the bytes, how many of them there are
+// OUTPUT PARAMETERS:
+//      number of set bits
+//------------------------------------------------------
+__attribute__((target("avx2"))) static uint64_t countSetBitsAvx2(const uint8_t *bytes, size_t length)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0F);
+    __m256i totals = _mm256_setzero_si256();
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    while (i + AVX2_BYTES <= length)
+    {
+        //each round adds at most 8 to a byte counter, so 31 rounds fit in 8 bits before flushing into the 64 bit totals
+        __m256i byteCounts = _mm256_setzero_si256();
+        for (int round = 0; round < 31 && i + AVX2_BYTES <= length; round++, i += AVX2_BYTES)
+        {
+            __m256i chunk = _mm256_loadu_si256((const __m256i *)(bytes + i));
+            __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(chunk, lowNibbles));
+            __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), lowNibbles));
+            byteCounts = _mm256_add_epi8(byteCounts, _mm256_add_epi8(low, high));
+        }
+        totals = _mm256_add_epi64(totals, _mm256_sad_epu8(byteCounts, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, totals);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + countSetBitsPopcnt(bytes + i, length - i);
+}
+#endif
+
+//------------------------------------------------------
+// selectBitCountKernel
+//
+// PURPOSE: Pick the fastest set bit counter the CPU running the program supports (checked once at run time)
+// OUTPUT PARAMETERS:
+//      the counting function to use
+//------------------------------------------------------
+bitCountKernel selectBitCountKernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return countSetBitsAvx2;
+    if (__builtin_cpu_supports("popcnt"))
+        return countSetBitsPopcnt;
+#endif
+    return countSetBitsPortable;
+}
+
+//------------------------------------------------------
+// firstDifferencePortable
+//
+// PURPOSE: Find where two blocks of bytes first differ, comparing 64 bits at a time. Works on any CPU.
+// INPUT PARAMETERS:
+//     the two blocks, how many bytes each holds
+// OUTPUT PARAMETERS:
+//      offset of the first byte that differs, length if the blocks are equal
+//------------------------------------------------------
+static size_t firstDifferencePortable(const uint8_t *first, const uint8_t *second, size_t length)
+{
+    size_t i = 0;
+    uint64_t a;
+    uint64_t b;
+
+    for (; i + sizeof(a) <= length; i += sizeof(a))
+    {
+        memcpy(&a, first + i, sizeof(a)); //unaligned safe loads
+        memcpy(&b, second + i, sizeof(b));
+        if (a != b)
+            break;
+    }
+    while (i < length && first[i] == second[i])
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//------------------------------------------------------
+// firstDifferenceAvx2
+//
+// PURPOSE: Same as firstDifferencePortable, 64 bytes at a time: two pairs of 32 byte loads are compared with vpcmpeqb and one vpmovmskb tells whether all 64 bytes matched. The differing word is then located by the portable loop. Only called when the CPU has AVX2.
+// INPUT PARAMETERS:
+//     the two blocks, how many bytes each holds
+// OUTPUT PARAMETERS:
+//      offset of the first byte that differs, length if the blocks are equal
+//------------------------------------------------------
+__attribute__((target("avx2"))) static size_t firstDifferenceAvx2(const uint8_t *first, const uint8_t *second, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 2 * AVX2_BYTES <= length; i += 2 * AVX2_BYTES)
+    {
+        __m256i low = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(first + i)), _mm256_loadu_si256((const __m256i *)(second + i)));
+        __m256i high = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(first + i + AVX2_BYTES)),
+                                         _mm256_loadu_si256((const __m256i *)(second + i + AVX2_BYTES)));
+        if (_mm256_movemask_epi8(_mm256_and_si256(low, high)) != -1)
+            break;
+    }
+    return i + firstDifferencePortable(first + i, second + i, length - i);
+}
+#endif
+
+//------------------------------------------------------
+// selectDifferenceKernel
+//
+// PURPOSE: Pick the fastest block comparison the CPU running the program supports (checked once at run time)
+// OUTPUT PARAMETERS:
+//      the comparison function to use
+//------------------------------------------------------
+differenceKernel selectDifferenceKernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return firstDifferenceAvx2;
+#endif
+    return firstDifferencePortable;
+}
+
+//------------------------------------------------------
+// getEmptys
+//
+// PURPOSE: Count the unset bits of the bitmap to find unused cluster count. The bitmap's cluster chain is resolved into extents and each extent is scanned in large blocks.
+// INPUT PARAMETERS:
+//     the volume, the first cluster of the bitmap, its DataLength in bytes
+// OUTPUT PARAMETERS:
+//      number of unused clusters
+//------------------------------------------------------
+static uint64_t getEmptys(const exfatVolume *volume, uint32_t firstCluster, uint64_t dataLength)
+{
+    bitCountKernel countSetBits = selectBitCountKernel();
+    uint64_t bytesPerCluster = volume->bytesPerCluster;
+    uint32_t clusterCount = volume->clusterCount;
+    uint64_t bitmapBytes = ((uint64_t)clusterCount + BITS_PER_BYTE - 1) / BITS_PER_BYTE; //one bit per cluster of the heap
+    uint64_t bytesScanned = 0;
+    uint64_t usedClusters = 0;
+    int extentCount;
+    extent *extents;
+    uint8_t *scratch = malloc(BITMAP_BLOCK_BYTES); //only touched when the volume is not mapped
+    assert(scratch != NULL);
+
+    if (dataLength != 0 && dataLength < bitmapBytes)
+        bitmapBytes = dataLength;
+    extents = buildExtents(volume, firstCluster, (bitmapBytes + bytesPerCluster - 1) / bytesPerCluster, &extentCount);
+
+    for (int i = 0; i < extentCount && bytesScanned < bitmapBytes; i++)
+    {
+        uint64_t offset = findOffsetToCluster(volume, extents[i].startCluster);
+        uint64_t bytesInExtent = extents[i].count * bytesPerCluster;
+        if (bytesInExtent > bitmapBytes - bytesScanned)
+            bytesInExtent = bitmapBytes - bytesScanned;
+        while (bytesInExtent > 0)
+        {
+            size_t block = bytesInExtent < BITMAP_BLOCK_BYTES ? bytesInExtent : BITMAP_BLOCK_BYTES;
+            const uint8_t *bitmap = volumeData(volume, offset, block, scratch);
+            if (bytesScanned + block == bitmapBytes && clusterCount % BITS_PER_BYTE != 0)
+            {
+                //the last byte only partly describes clusters, ignore its spare high bits
+                uint8_t lastByte = bitmap[block - 1] & ((1 << (clusterCount % BITS_PER_BYTE)) - 1);
+                usedClusters += countSetBits(bitmap, block - 1) + countSetBits(&lastByte, 1);
+            }
+            else
+            {
+                usedClusters += countSetBits(bitmap, block);
+            }
+            bytesScanned += block;
+            bytesInExtent -= block;
+            offset += block;
+        }
+    }
+    free(extents);
+    free(scratch);
+    //clusters the bitmap does not reach (truncated chain) are counted as used
+    uint64_t unscanned = (bitmapBytes - bytesScanned) * BITS_PER_BYTE;
+    if (usedClusters + unscanned >= clusterCount)
+        return 0;
+    return clusterCount - usedClusters - unscanned;
+}
+
+//------------------------------------------------------
+// allocationBitMap
+//
+// PURPOSE: Find where the desired allocation bit map entry is and count the free clusters it describes.
+// INPUT PARAMETERS:
+//     the volume
+// OUTPUT PARAMETERS:
+//      number of unused clusters, 0 if the volume has no bitmap
+//------------------------------------------------------
+static uint64_t allocationBitMap(const exfatVolume *volume)
+{
+    uint8_t entry[BYTES_PER_ENTRY];
+    uint32_t firstCluster;
+    uint64_t dataLength;
+
+    if (!findRootEntry(volume, ALLOCATION_BITMAP_ENTRY, entry)) //search for allocation bit map entry
+        return 0;
+    memcpy(&firstCluster, entry + 20, 4);
+    memcpy(&dataLength, entry + 24, 8);
+    return getEmptys(volume, firstCluster, dataLength);
+}
+
+//------------------------------------------------------
+// freeExtents
+//
+// PURPOSE: Find the runs of unused clusters recorded in the allocation bitmap. Clusters the bitmap does not reach (truncated chain) are taken to be in use, as getEmptys does.
+// INPUT PARAMETERS:
+//     the volume, where to store the number of extents
+// OUTPUT PARAMETERS:
+//      heap allocated array of extents (none if the volume has no bitmap), caller must free it
+//------------------------------------------------------
+extent *freeExtents(const exfatVolume *volume, int *extentCount)
+{
+    uint8_t entry[BYTES_PER_ENTRY];
+    uint32_t firstCluster;
+    uint64_t dataLength;
+    uint64_t bitmapBytes = ((uint64_t)volume->clusterCount + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    uint64_t bytesScanned = 0;
+    uint64_t runStart = 0;
+    uint64_t runLength = 0;
+    int capacity = 8;
+    int count = 0;
+    int bitmapExtentCount = 0;
+    extent *bitmapExtents = NULL;
+    extent *extents = malloc(capacity * sizeof(extent));
+    uint8_t *scratch = malloc(BITMAP_BLOCK_BYTES); //only touched when the volume is not mapped
+    assert(extents != NULL && scratch != NULL);
+
+    if (findRootEntry(volume, ALLOCATION_BITMAP_ENTRY, entry))
+    {
+        memcpy(&firstCluster, entry + 20, 4);
+        memcpy(&dataLength, entry + 24, 8);
+        if (dataLength < bitmapBytes)
+            bitmapBytes = dataLength;
+        bitmapExtents = buildExtents(volume, firstCluster, (bitmapBytes + volume->bytesPerCluster - 1) / volume->bytesPerCluster, &bitmapExtentCount);
+    }
+
+    for (int i = 0; i < bitmapExtentCount && bytesScanned < bitmapBytes; i++)
+    {
+        uint64_t offset = findOffsetToCluster(volume, bitmapExtents[i].startCluster);
+        uint64_t bytesInExtent = bitmapExtents[i].count * volume->bytesPerCluster;
+        if (bytesInExtent > bitmapBytes - bytesScanned)
+            bytesInExtent = bitmapBytes - bytesScanned;
+        while (bytesInExtent > 0)
+        {
+            size_t block = bytesInExtent < BITMAP_BLOCK_BYTES ? bytesInExtent : BITMAP_BLOCK_BYTES;
+            const uint8_t *bitmap = volumeData(volume, offset, block, scratch);
+            for (size_t b = 0; b < block; b++)
+            {
+                uint64_t index = (bytesScanned + b) * BITS_PER_BYTE; //of the byte's first cluster in the heap
+                for (int bit = 0; bit < BITS_PER_BYTE && index + bit < volume->clusterCount; bit++)
+                {
+                    if (bitmap[b] == 0xFF) //all in use, the common case on a full card
+                        bit = BITS_PER_BYTE - 1;
+                    if (!(bitmap[b] & (1 << bit)))
+                    {
+                        if (runLength++ == 0)
+                            runStart = index + bit;
+                    }
+                    else if (runLength > 0)
+                    {
+                        appendExtent(&extents, &count, &capacity, runStart + CLUSTER_INDEX_OFFSET, runLength);
+                        runLength = 0;
+                    }
+                }
+            }
+            bytesScanned += block;
+            bytesInExtent -= block;
+            offset += block;
+        }
+    }
+    if (runLength > 0)
+        appendExtent(&extents, &count, &capacity, runStart + CLUSTER_INDEX_OFFSET, runLength);
+    free(bitmapExtents);
+    free(scratch);
+    *extentCount = count;
+    return extents;
+}
+
+//------------------------------------------------------
+// getInfo
+//
+// PURPOSE: Gather what the info command reports
+// INPUT PARAMETERS:
+//     the volume, the struct to fill in (its label must be freed by the caller)
+//------------------------------------------------------
+void getInfo(exfatVolume *volume, exfatInfo *details)
+{
+    uint64_t start = statsClock();
+    details->label = getVolumeLabel(volume);
+    statsPhase(PHASE_LABEL, start, 0);
+    start = statsClock();
+    details->freeBytes = allocationBitMap(volume) * volume->bytesPerCluster;
+    statsPhase(PHASE_BITMAP, start, 0);
+    details->serialNumber = volume->serialNumber;
+    details->bytesPerSector = volume->bytesPerSector;
+    details->sectorsPerCluster = volume->sectorsPerCluster;
+}
+
+//------------------------------------------------------
+// bootRegionChecksum
+//
+// PURPOSE: Check a boot region (the main one at sector 0 or the backup at sector BOOT_REGION_SECTORS): the checksum of its first 11 sectors, skipping VolumeFlags and PercentInUse which change without it being rewritten, must fill its checksum sector
+// INPUT PARAMETERS:
+//     the volume, the region's first sector, where to store the checksum computed
+// OUTPUT PARAMETERS:
+//      true if every 32 bit word of the checksum sector holds it
+//------------------------------------------------------
+bool bootRegionChecksum(const exfatVolume *volume, uint64_t firstSector, uint32_t *checksum)
+{
+    uint64_t bytesPerSector = volume->bytesPerSector;
+    uint64_t regionBytes = BOOT_CHECKSUM_SECTORS * bytesPerSector;
+    uint8_t *scratch = malloc(regionBytes + bytesPerSector); //only touched when the volume is not mapped
+    const uint8_t *region;
+    uint32_t sum = 0;
+    bool matches = true;
+    assert(scratch != NULL);
+
+    region = volumeData(volume, firstSector * bytesPerSector, regionBytes + bytesPerSector, scratch);
+    for (uint64_t i = 0; i < regionBytes; i++)
+    {
+        if (i == VOLUME_FLAGS_OFFSET || i == VOLUME_FLAGS_OFFSET + 1 || i == PERCENT_IN_USE_OFFSET)
+            continue;
+        sum = ((sum >> 1) | (sum << 31)) + region[i]; //rotate right, add
+    }
+    for (uint64_t i = 0; i < bytesPerSector; i += sizeof(uint32_t))
+    {
+        uint32_t stored;
+        memcpy(&stored, region + regionBytes + i, sizeof(stored));
+        matches = matches && stored == sum;
+    }
+    free(scratch);
+    *checksum = sum;
+    return matches;
+}
+
+//input: a File directory entry followed by its secondary entries, all in memory, the number of entries (SecondaryCount + 1)
+//returns the SetChecksum of the entry set, to compare with the one stored at byte 2 of the File entry (which it skips)
+uint16_t entrySetChecksum(const uint8_t *entries, int entryCount)
+{
+    uint16_t sum = 0;
+    size_t length = (size_t)entryCount * BYTES_PER_ENTRY;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if (i == 2 || i == 3)
+            continue;
+        sum = (uint16_t)((sum >> 1) | (sum << 15)) + entries[i]; //rotate right, add
+    }
+    return sum;
+}
+
+//------------------------------------------------------
+// openFile
+//
+// PURPOSE: Prepare to read a file's data: its cluster chain is resolved into extents once, so every readFile is just positional reads
+// INPUT PARAMETERS:
+//     the volume, the file's entry set (from nextDirEntry or lookupPath)
+// OUTPUT PARAMETERS:
+//      heap allocated handle to pass to closeFile, NULL for a directory
+//------------------------------------------------------
+fileHandle *openFile(exfatVolume *volume, const dirEntry *file)
+{
+    fileHandle *handle;
+    uint64_t fileOffset = 0;
+
+    if (file->directory)
+        return NULL;
+    handle = malloc(sizeof(fileHandle));
+    assert(handle != NULL);
+    handle->volume = volume;
+    handle->dataLength = file->dataLength;
+    handle->validDataLength = file->validDataLength;
+    handle->extents = fileExtents(volume, file->firstCluster, file->validDataLength, file->noFatChain, &handle->extentCount); //nothing past it is read
+    handle->extentOffsets = malloc((handle->extentCount > 0 ? handle->extentCount : 1) * sizeof(uint64_t));
+    assert(handle->extentOffsets != NULL);
+    for (int i = 0; i < handle->extentCount; i++)
+    {
+        handle->extentOffsets[i] = fileOffset;
+        fileOffset += handle->extents[i].count * volume->bytesPerCluster;
+    }
+    return handle;
+}
+
+//------------------------------------------------------
+// readFile
+//
+// PURPOSE: Read file data at any offset, like pread. Bytes past ValidDataLength are zeros and are not read from the volume. Safe to call from several threads on the same handle.
+// INPUT PARAMETERS:
+//     the file, buffer to fill, how many bytes, offset in the file
+// OUTPUT PARAMETERS:
+//      bytes read: fewer than asked at the end of the file (or where a damaged chain ends), 0 past it
+//------------------------------------------------------
+ssize_t readFile(const fileHandle *file, void *buffer, size_t length, uint64_t offset)
+{
+    uint64_t bytesPerCluster = file->volume->bytesPerCluster;
+    size_t total = 0;
+    size_t validBytes = 0; //of the request, before ValidDataLength
+    int low = 0;
+    int high = file->extentCount;
+
+    if (offset >= file->dataLength)
+        return 0;
+    if (length > file->dataLength - offset)
+        length = file->dataLength - offset;
+    if (offset < file->validDataLength)
+        validBytes = file->validDataLength - offset < length ? file->validDataLength - offset : length;
+
+    //the last extent starting at or before offset
+    while (high - low > 1)
+    {
+        int middle = (low + high) / 2;
+        if (file->extentOffsets[middle] <= offset)
+            low = middle;
+        else
+            high = middle;
+    }
+    for (int i = low; i < file->extentCount && total < validBytes; i++)
+    {
+        uint64_t intoExtent = offset + total - file->extentOffsets[i];
+        if (intoExtent >= file->extents[i].count * bytesPerCluster) //past the end of a damaged chain
+            break;
+        uint64_t available = file->extents[i].count * bytesPerCluster - intoExtent;
+        size_t bytes = validBytes - total < available ? validBytes - total : available;
+        readVolume(file->volume, findOffsetToCluster(file->volume, file->extents[i].startCluster) + intoExtent, (uint8_t *)buffer + total, bytes);
+        total += bytes;
+    }
+    if (total == validBytes) //the never written tail
+    {
+        memset((uint8_t *)buffer + total, 0, length - total);
+        STAT_ADD(STAT_SPARSE_BYTES, length - total);
+        total = length;
+    }
+    return total;
+}
+
+//input: a handle returned by openFile
+void closeFile(fileHandle *file)
+{
+    if (file == NULL)
+        return;
+    free(file->extents);
+    free(file->extentOffsets);
+    free(file);
+}
@@ -0,0 +1,226 @@
+//-----------------------------------------
+// exfat.h
+//
+// Reading core of the exFAT reader, usable on its own as a small library.
+// Every function works on an exfatVolume handle returned by openVolume, so
+// several volumes can be open at once and a handle can be shared by
+// threads: nothing in it changes after openVolume except the up-case table,
+// which is installed atomically on first use, and the optional cluster
+// cache, which has its own locks.
+// The library can:
+// 1. open a volume (image file or block device) and parse its boot sector once
+// 2. report its label, serial number, cluster size and free space
+// 3. iterate directories and look up paths
+// 4. read file data at any offset
+//
+//-----------------------------------------
+
+#ifndef EXFAT_H
+#define EXFAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FILE_BIT_OFFSET 16          //bit set if file is file, else directory i.e. base 2: 0001 0000
+#define NO_FAT_CHAIN_FLAG 2         //GeneralSecondaryFlags bit set if the clusters are contiguous and the FAT is not used i.e. base 2: 0000 0010
+#define ALLOCATION_BITMAP_ENTRY 129 //0x81
+#define UPCASE_TABLE_ENTRY 130      //0x82
+#define VOLUME_LABEL_ENTRY 131      //0x83
+#define FILE_TYPE_ENTRY 133         //0x85
+#define STREAM_EXTENSION_ENTRY 192  //0xC0
+#define FILE_NAME_ENTRY 193         //0xC1
+#define BYTES_PER_ENTRY 32
+#define BOOT_SECTOR_BYTES 512
+#define BOOT_REGION_SECTORS 12          //boot sector, extended boot sectors, OEM parameters, reserved, checksum. the backup region follows
+
+#define CLUSTER_INDEX_OFFSET 2
+#define MAX_ASCII_STRING_SIZE 255
+#define FAT_ENTRY_BYTES 4
+#define BYTES_PER_KB 1024
+#define CLUSTER_CACHE_SHARDS 16
+
+//counts a statistic, a not-taken branch when --stats is off. Relaxed atomics since list and the I/O engines run several threads.
+//the counters are process wide: every open volume adds to the same ones
+#define STAT_ADD(counter, amount)                                                          \
+    do                                                                                     \
+    {                                                                                      \
+        if (statsEnabled)                                                                  \
+            __atomic_fetch_add(&statCounts[counter], (uint64_t)(amount), __ATOMIC_RELAXED); \
+    } while (0)
+
+//a run of `count` consecutive clusters starting at `startCluster`
+typedef struct extent
+{
+    uint32_t startCluster;
+    uint32_t count;
+} extent;
+
+//what --stats reports time for. Phases do not overlap: the tree walk excludes the copies done during it
+typedef enum statPhase
+{
+    PHASE_BOOT,   //boot sector parse
+    PHASE_FAT,    //FAT load
+    PHASE_LABEL,  //volume label search
+    PHASE_BITMAP, //allocation bitmap scan
+    PHASE_TREE,   //directory tree walk (list, get, index, batch resolution)
+    PHASE_COPY,   //file data copy
+    PHASE_COUNT
+} statPhase;
+
+//what --stats counts
+typedef enum statCounter
+{
+    STAT_READ_CALLS,      //pread and io_uring reads of the volume
+    STAT_LSEEK_CALLS,
+    STAT_BYTES_READ,      //from the volume, by any means
+    STAT_KERNEL_COPIES,   //copy_file_range and sendfile calls
+    STAT_WRITE_CALLS,     //pwrite and io_uring writes of outputs
+    STAT_BYTES_WRITTEN,   //to outputs, by any means
+    STAT_FAT_LOOKUPS,     //nextCluster calls
+    STAT_CLUSTERS_VISITED,
+    STAT_DIRECTORIES_READ,
+    STAT_ENTRY_SETS,      //decoded by nextDirEntry
+    STAT_NAME_ALLOCATIONS, //unicode2ascii calls
+    STAT_CACHE_HITS,       //metadata clusters found in the cluster cache
+    STAT_CACHE_MISSES,
+    STAT_SPARSE_BYTES,     //past ValidDataLength, zeros that were never read from the volume
+    STAT_BYTES_HASHED,     //fed to --hash digests, zeros included
+    STAT_COUNTER_COUNT
+} statCounter;
+
+//cache of metadata clusters for volumes read with pread, see enableClusterCache
+typedef struct clusterCache clusterCache;
+
+//an open volume: the boot sector fields, parsed once by openVolume, and the whole FAT
+typedef struct exfatVolume
+{
+    int fd;                   //file descriptor of exFAT volume
+    const uint8_t *map;       //read-only mapping of the whole volume, NULL when falling back to pread
+    uint64_t size;            //in bytes
+    uint32_t serialNumber;
+    uint32_t rootDirectory;   //recall that FAT[X] corresponds to Cluster[X-2]
+    uint32_t clstHeapOffset;  //offset to data region in sectors
+    uint32_t fatOffset;       //in sectors
+    uint32_t clusterCount;    //number of clusters
+    uint32_t fatLength;       //in sectors
+    int bytesPerSector;
+    int sectorsPerCluster;
+    uint64_t bytesPerCluster;
+    const uint32_t *fatCache; //the whole FAT, indexed by cluster
+    bool fatCacheOwned;       //fatCache was allocated rather than pointing into map
+    uint16_t *upcaseTable;    //loaded on first use by loadUpcaseTable
+    clusterCache *cache;      //NULL unless enableClusterCache was called
+} exfatVolume;
+
+//what the info command reports
+typedef struct exfatInfo
+{
+    char *label; //heap allocated, "" when the volume has none
+    uint32_t serialNumber;
+    int bytesPerSector;
+    int sectorsPerCluster;
+    uint64_t freeBytes;
+} exfatInfo;
+
+//counts the set bits in a block of bytes, see selectBitCountKernel
+typedef uint64_t (*bitCountKernel)(const uint8_t *bytes, size_t length);
+
+//finds the offset at which two blocks of bytes first differ (length if they are equal), see selectDifferenceKernel
+typedef size_t (*differenceKernel)(const uint8_t *first, const uint8_t *second, size_t length);
+
+//one decoded File / Stream Extension / File Name entry set
+typedef struct dirEntry
+{
+    uint16_t attributes;
+    bool directory;
+    uint8_t generalFlags;
+    bool noFatChain;
+    uint8_t nameLength;                    //in characters
+    uint16_t nameHash;                     //NameHash of the stream extension, over the up-cased name
+    uint32_t firstCluster;
+    uint64_t dataLength;
+    uint64_t validDataLength;              //bytes ever written, the rest of dataLength reads as zeros. never more than dataLength
+    uint32_t createTimestamp;              //as stored in the File entry, see timestampToUnixMs
+    uint32_t modifyTimestamp;
+    uint32_t accessTimestamp;
+    uint8_t create10ms;                    //0-199 units of 10 ms added to the create and modify times
+    uint8_t modify10ms;
+    uint8_t createUtcOffset;               //bit 7 set if valid, then a signed count of 15 minute units
+    uint8_t modifyUtcOffset;
+    uint8_t accessUtcOffset;
+    uint16_t name[MAX_ASCII_STRING_SIZE]; //unicode, not null terminated
+} dirEntry;
+
+//position in a directory whose clusters have been brought into memory by openDirectory
+typedef struct dirIterator
+{
+    const uint8_t *contents; //the directory's bytes, either inside the volume's mapping or in owned
+    uint8_t *owned;          //heap copy of the directory, NULL when contents points into the mapping
+    uint64_t length;         //bytes in contents
+    uint64_t position;       //offset of the next entry to decode
+    bool filterByHash;       //when set nextDirEntry skips, without decoding the name, sets whose NameHash is not wantedHash
+    uint16_t wantedHash;
+} dirIterator;
+
+//a file opened for reading by openFile: its extents and where each starts in the file
+typedef struct fileHandle
+{
+    exfatVolume *volume;
+    extent *extents;
+    uint64_t *extentOffsets; //file offset of the first byte of each extent
+    int extentCount;
+    uint64_t dataLength;
+    uint64_t validDataLength;
+} fileHandle;
+
+//statistics are global to the process rather than kept per volume: all open volumes (and all threads) share them,
+//so a program reading several volumes at once gets their sum. Set statsEnabled before opening volumes and leave it.
+extern bool statsEnabled;                       //--stats or --stats=json
+extern uint64_t statPhaseNs[PHASE_COUNT];       //accumulated by statsPhase
+extern uint64_t statCounts[STAT_COUNTER_COUNT]; //accumulated by STAT_ADD
+
+uint64_t statsClock(void);
+void statsPhase(statPhase phase, uint64_t start, uint64_t nestedNs);
+char *unicode2ascii(uint16_t *unicode_string, uint8_t length);
+
+exfatVolume *openVolume(const char *fileName, bool useMmap);
+void closeVolume(exfatVolume *volume);
+bool enableClusterCache(exfatVolume *volume, uint64_t budgetBytes);
+void readVolume(const exfatVolume *volume, uint64_t offset, void *buffer, size_t length);
+const uint8_t *volumeData(const exfatVolume *volume, uint64_t offset, size_t length, void *scratch);
+uint64_t findOffsetToCluster(const exfatVolume *volume, uint32_t cluster);
+uint32_t nextCluster(const exfatVolume *volume, uint32_t currCluster);
+extent *buildExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t clustersWanted, int *extentCount);
+extent *fileExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t length, bool noFatChain, int *extentCount);
+uint32_t *buildFatRuns(const exfatVolume *volume);
+extent *runExtents(const exfatVolume *volume, const uint32_t *runs, uint32_t firstCluster, uint64_t clustersWanted, int *extentCount);
+uint32_t countExtents(const exfatVolume *volume, uint32_t firstCluster, uint64_t length, bool noFatChain);
+int64_t timestampToUnixMs(uint32_t timestamp, uint8_t tenMs, uint8_t utcOffset);
+
+void openDirectory(const exfatVolume *volume, dirIterator *iterator, uint32_t firstCluster, uint64_t dataLength, bool noFatChain);
+void closeDirectory(dirIterator *iterator);
+const uint8_t *nextRawEntry(dirIterator *iterator);
+bool nextDirEntry(dirIterator *iterator, dirEntry *file);
+bool findRootEntry(const exfatVolume *volume, uint8_t entryType, uint8_t *entryCopy);
+
+const uint16_t *loadUpcaseTable(exfatVolume *volume);
+uint16_t nameHash(exfatVolume *volume, const uint16_t *name, int length);
+bool sameName(exfatVolume *volume, const uint16_t *first, int firstLength, const uint16_t *second, int secondLength);
+bool lookupPath(exfatVolume *volume, const char *userPath, dirEntry *found);
+
+char *getVolumeLabel(const exfatVolume *volume);
+bitCountKernel selectBitCountKernel(void);
+differenceKernel selectDifferenceKernel(void);
+void getInfo(exfatVolume *volume, exfatInfo *details);
+extent *freeExtents(const exfatVolume *volume, int *extentCount);
+
+bool bootRegionChecksum(const exfatVolume *volume, uint64_t firstSector, uint32_t *checksum);
+uint16_t entrySetChecksum(const uint8_t *entries, int entryCount);
+
+fileHandle *openFile(exfatVolume *volume, const dirEntry *file);
+ssize_t readFile(const fileHandle *file, void *buffer, size_t length, uint64_t offset);
+void closeFile(fileHandle *file);
+
+#endif
@@ -0,0 +1,307 @@
+//-----------------------------------------
+// hash.c
+//
+// SHA-256 and XXH64, see hash.h. Both keep an incomplete block in the
+// state between calls and otherwise hash straight from the caller's data.
+//
+//-----------------------------------------
+
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "hash.h"
+
+#define SHA256_DIGEST_BYTES 32
+#define SHA256_LENGTH_BYTES 8 //the message length in bits closes the last block
+#define XXH64_DIGEST_BYTES 8
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+static const uint32_t sha256Constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t sha256Initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static uint32_t rotateRight32(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static uint64_t rotateLeft64(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t readLittle64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value)); //exFAT is little endian and so are the hosts this reader runs on
+    return value;
+}
+
+static uint32_t readLittle32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+//input: SHA-256 state, 64 byte blocks and how many
+static void sha256Blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    uint32_t schedule[64];
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK_BYTES)
+    {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 16; i++)
+            schedule[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotateRight32(schedule[i - 15], 7) ^ rotateRight32(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+            uint32_t s1 = rotateRight32(schedule[i - 2], 17) ^ rotateRight32(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+            schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+        }
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotateRight32(e, 6) ^ rotateRight32(e, 11) ^ rotateRight32(e, 25)) + ((e & f) ^ (~e & g)) + sha256Constants[i] + schedule[i];
+            uint32_t t2 = (rotateRight32(a, 2) ^ rotateRight32(a, 13) ^ rotateRight32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//------------------------------------------------------
+// sha256BlocksShaNi
+//
+// PURPOSE: Same as sha256Blocks with the SHA extensions, four rounds per pair of sha256rnds2 and the message schedule done by sha256msg1/sha256msg2. Only called when the CPU has them.
+// INPUT PARAMETERS:
+//     SHA-256 state, 64 byte blocks and how many
+//------------------------------------------------------
+__attribute__((target("sha,sse4.1"))) static void sha256BlocksShaNi(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL); //big endian words
+    __m128i message[4];
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8); //the instructions keep the state as ABEF and CDGH
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; blocks--, data += SHA256_BLOCK_BYTES)
+    {
+        __m128i abefStart = abef;
+        __m128i cdghStart = cdgh;
+
+        for (int i = 0; i < 16; i++) //four rounds each, message[i % 4] holds their words
+        {
+            __m128i *current = &message[i % 4];
+            if (i < 4)
+                *current = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byteSwap);
+            __m128i words = _mm_add_epi32(*current, _mm_loadu_si128((const __m128i *)&sha256Constants[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            if (i >= 3 && i < 15) //finish the words of the next group
+            {
+                __m128i *next = &message[(i + 1) % 4];
+                *next = _mm_add_epi32(*next, _mm_alignr_epi8(*current, message[(i + 3) % 4], 4));
+                *next = _mm_sha256msg2_epu32(*next, *current);
+            }
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0E));
+            if (i >= 1 && i < 13) //start those of the group three ahead
+                message[(i + 3) % 4] = _mm_sha256msg1_epu32(message[(i + 3) % 4], *current);
+        }
+        abef = _mm_add_epi32(abef, abefStart);
+        cdgh = _mm_add_epi32(cdgh, cdghStart);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)state, _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static uint64_t xxh64Round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * XXH64_PRIME2;
+    return rotateLeft64(accumulator, 31) * XXH64_PRIME1;
+}
+
+static uint64_t xxh64Merge(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= xxh64Round(0, accumulator);
+    return hash * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+//input: XXH64 accumulators, 32 byte stripes and how many
+static void xxh64Stripes(uint64_t *state, const uint8_t *data, size_t stripes)
+{
+    for (; stripes > 0; stripes--, data += XXH64_STRIPE_BYTES)
+        for (int i = 0; i < 4; i++)
+            state[i] = xxh64Round(state[i], readLittle64(data + 8 * i));
+}
+
+//input: a state of the algorithm, whole blocks (SHA-256) or stripes (XXH64) and how many bytes they take
+static void hashBlocks(hashState *hash, const uint8_t *data, size_t length)
+{
+    if (hash->algorithm == HASH_SHA256)
+        hash->sha256Blocks(hash->state.sha256, data, length / SHA256_BLOCK_BYTES);
+    else
+        xxh64Stripes(hash->state.xxh64, data, length / XXH64_STRIPE_BYTES);
+}
+
+//------------------------------------------------------
+// hashInit
+//
+// PURPOSE: Start a digest. SHA-256 uses the SHA extensions when the CPU running the program has them (checked at run time)
+// INPUT PARAMETERS:
+//     the state to set up, the algorithm (not HASH_NONE)
+//------------------------------------------------------
+void hashInit(hashState *hash, hashAlgorithm algorithm)
+{
+    hash->algorithm = algorithm;
+    hash->totalLength = 0;
+    hash->pendingLength = 0;
+    if (algorithm == HASH_SHA256)
+    {
+        memcpy(hash->state.sha256, sha256Initial, sizeof(sha256Initial));
+        hash->sha256Blocks = sha256Blocks;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+            hash->sha256Blocks = sha256BlocksShaNi;
+#endif
+    }
+    else
+    {
+        hash->state.xxh64[0] = XXH64_PRIME1 + XXH64_PRIME2; //seed 0
+        hash->state.xxh64[1] = XXH64_PRIME2;
+        hash->state.xxh64[2] = 0;
+        hash->state.xxh64[3] = -XXH64_PRIME1;
+    }
+}
+
+//------------------------------------------------------
+// hashUpdate
+//
+// PURPOSE: Add the next bytes of the data to a digest
+// INPUT PARAMETERS:
+//     the state, the bytes and how many
+//------------------------------------------------------
+void hashUpdate(hashState *hash, const void *data, size_t length)
+{
+    const uint8_t *bytes = data;
+    size_t blockBytes = hash->algorithm == HASH_SHA256 ? SHA256_BLOCK_BYTES : XXH64_STRIPE_BYTES;
+    size_t whole;
+
+    hash->totalLength += length;
+    if (hash->pendingLength > 0)
+    {
+        size_t taken = blockBytes - hash->pendingLength < length ? blockBytes - hash->pendingLength : length;
+        memcpy(hash->pending + hash->pendingLength, bytes, taken);
+        hash->pendingLength += taken;
+        bytes += taken;
+        length -= taken;
+        if (hash->pendingLength < blockBytes)
+            return;
+        hashBlocks(hash, hash->pending, blockBytes);
+        hash->pendingLength = 0;
+    }
+    whole = length - length % blockBytes;
+    hashBlocks(hash, bytes, whole);
+    memcpy(hash->pending, bytes + whole, length - whole);
+    hash->pendingLength = length - whole;
+}
+
+//------------------------------------------------------
+// hashFinal
+//
+// PURPOSE: Finish a digest
+// INPUT PARAMETERS:
+//     the state (not usable afterwards), where to put the digest (MAX_DIGEST_BYTES is always enough)
+// OUTPUT PARAMETERS:
+//      the number of digest bytes, big endian as sha256sum and xxhsum print them
+//------------------------------------------------------
+size_t hashFinal(hashState *hash, uint8_t *digest)
+{
+    if (hash->algorithm == HASH_SHA256)
+    {
+        uint64_t bitLength = hash->totalLength * 8;
+        size_t padded = hash->pendingLength + 1 + SHA256_LENGTH_BYTES <= SHA256_BLOCK_BYTES ? SHA256_BLOCK_BYTES : 2 * SHA256_BLOCK_BYTES;
+        uint8_t last[2 * SHA256_BLOCK_BYTES] = {0};
+
+        memcpy(last, hash->pending, hash->pendingLength);
+        last[hash->pendingLength] = 0x80;
+        for (int i = 0; i < SHA256_LENGTH_BYTES; i++)
+            last[padded - 1 - i] = (uint8_t)(bitLength >> (8 * i));
+        hash->sha256Blocks(hash->state.sha256, last, padded / SHA256_BLOCK_BYTES);
+        for (int i = 0; i < 8; i++)
+            for (int j = 0; j < 4; j++)
+                digest[4 * i + j] = (uint8_t)(hash->state.sha256[i] >> (24 - 8 * j));
+        return SHA256_DIGEST_BYTES;
+    }
+
+    const uint64_t *accumulators = hash->state.xxh64;
+    const uint8_t *tail = hash->pending;
+    size_t tailLength = hash->pendingLength;
+    uint64_t result;
+
+    if (hash->totalLength >= XXH64_STRIPE_BYTES)
+    {
+        result = rotateLeft64(accumulators[0], 1) + rotateLeft64(accumulators[1], 7) + rotateLeft64(accumulators[2], 12) + rotateLeft64(accumulators[3], 18);
+        for (int i = 0; i < 4; i++)
+            result = xxh64Merge(result, accumulators[i]);
+    }
+    else
+    {
+        result = XXH64_PRIME5; //seed 0
+    }
+    result += hash->totalLength;
+    for (; tailLength >= 8; tail += 8, tailLength -= 8)
+        result = rotateLeft64(result ^ xxh64Round(0, readLittle64(tail)), 27) * XXH64_PRIME1 + XXH64_PRIME4;
+    if (tailLength >= 4)
+    {
+        result = rotateLeft64(result ^ (uint64_t)readLittle32(tail) * XXH64_PRIME1, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        tail += 4;
+        tailLength -= 4;
+    }
+    for (; tailLength > 0; tail++, tailLength--)
+        result = rotateLeft64(result ^ *tail * XXH64_PRIME5, 11) * XXH64_PRIME1;
+    result ^= result >> 33;
+    result *= XXH64_PRIME2;
+    result ^= result >> 29;
+    result *= XXH64_PRIME3;
+    result ^= result >> 32;
+    for (int i = 0; i < XXH64_DIGEST_BYTES; i++)
+        digest[i] = (uint8_t)(result >> (56 - 8 * i));
+    return XXH64_DIGEST_BYTES;
+}
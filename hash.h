@@ -0,0 +1,48 @@
+//-----------------------------------------
+// hash.h
+//
+// Streaming file digests for extraction records: SHA-256 (FIPS 180-4) and
+// XXH64 (seed 0). Data is fed in pieces of any size with hashUpdate, so a
+// file can be hashed as it is copied, and hashFinal gives the digest in the
+// byte order sha256sum and xxhsum print.
+//
+//-----------------------------------------
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_DIGEST_BYTES 32
+#define SHA256_BLOCK_BYTES 64
+#define XXH64_STRIPE_BYTES 32
+
+//which digest --hash computes
+typedef enum hashAlgorithm
+{
+    HASH_NONE,
+    HASH_SHA256,
+    HASH_XXH64
+} hashAlgorithm;
+
+//a digest being computed, see hashInit
+typedef struct hashState
+{
+    hashAlgorithm algorithm;
+    uint64_t totalLength;                  //bytes fed so far
+    uint8_t pending[SHA256_BLOCK_BYTES];   //start of an incomplete block (SHA-256) or stripe (XXH64)
+    size_t pendingLength;
+    void (*sha256Blocks)(uint32_t *state, const uint8_t *data, size_t blocks); //block function picked by hashInit for the CPU
+    union
+    {
+        uint32_t sha256[8];
+        uint64_t xxh64[4];
+    } state;
+} hashState;
+
+void hashInit(hashState *hash, hashAlgorithm algorithm);
+void hashUpdate(hashState *hash, const void *data, size_t length);
+size_t hashFinal(hashState *hash, uint8_t *digest);
+
+#endif